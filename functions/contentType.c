@@ -54,4 +54,15 @@ char* contentType(char* file) {
   }
 }
 
+/* Given a type returned by contentType(), this function says whether
+ * a response of that type is worth compressing.  Text is; images,
+ * audio, and video already are compressed.
+ *
+ * @param mime The type.
+ * @return 1 if it's worth compressing, 0 otherwise.
+ */
+int isCompressible(char* mime) {
+  return (strncmp(mime, "text/", 5) == 0);
+}
+
 #endif /* _CONTENTTYPE_ */
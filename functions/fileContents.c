@@ -37,8 +37,7 @@ void* fileContents(int filedesc, off_t size) {
   /* PROT_READ: Indicates this memory can be read again */
   /* MAP_SHARED: Indicates remappings are possible */
   retVal = mmap(0, size, PROT_READ, MAP_SHARED, filedesc, 0);
-  if (retVal == (void*)-1) { /* failure */
-    close(filedesc);
+  if (retVal == (void*)-1) { /* failure; the caller still owns filedesc */
     return NULL;
   }
 
@@ -46,4 +45,35 @@ void* fileContents(int filedesc, off_t size) {
   return retVal;
 }
 
+/* Maps just part of a file, such as a single byte range, rather than
+ * everything up to it.  Mappings have to start on a page boundary, so
+ * the window may begin a little before offset; slack says how far.
+ *
+ * The caller finds the bytes at the returned pointer plus slack, and
+ * must unmap length plus slack bytes from the returned pointer.
+ *
+ * @param filedesc The file descriptor of the open file resource.
+ * @param offset The position of the first byte wanted.
+ * @param length The number of bytes wanted.
+ * @param slack Set to the distance from the window's start to offset.
+ * @return A pointer to the start of the window, or NULL on failure.
+ */
+void* fileWindow(int filedesc, off_t offset, off_t length, off_t* slack) {
+  long int page = sysconf(_SC_PAGESIZE);
+  void* retVal;
+
+  if (filedesc < 0 || page <= 0) {
+    return NULL;
+  }
+
+  *slack = offset % page;
+  retVal = mmap(0, length + *slack, PROT_READ, MAP_SHARED, filedesc,
+                offset - *slack);
+  if (retVal == (void*)-1) {
+    return NULL;
+  }
+
+  return retVal;
+}
+
 #endif /* _FILECONTENTS_ */
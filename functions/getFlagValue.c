@@ -0,0 +1,52 @@
+#ifndef _GETFLAGVALUE_
+#define _GETFLAGVALUE_
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Helper function.  Scans the command line for the given flag and
+ * returns the argument that immediately follows it, so that flags
+ * taking a value (such as "-e 4") can appear anywhere after the
+ * required arguments.
+ *
+ * @param argc The argument count.
+ * @param argv The argument array.
+ * @param flag The flag to search for, e.g. "-e".
+ * @return The value following the flag, or NULL if the flag was not
+ *         passed or has no value after it.
+ */
+char* getFlagValue(int argc, char** argv, char* flag) {
+  int i;
+
+  /* loop on the arguments, leaving room for the value */
+  for (i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], flag) == 0) { /* found it */
+      return argv[i + 1];
+    }
+  }
+
+  /* no such flag */
+  return NULL;
+}
+
+/* Helper function.  Scans the command line for a flag that takes no
+ * value, such as "-p".
+ *
+ * @param argc The argument count.
+ * @param argv The argument array.
+ * @param flag The flag to search for.
+ * @return 1 if the flag was passed, 0 otherwise.
+ */
+int hasFlag(int argc, char** argv, char* flag) {
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], flag) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+#endif /* _GETFLAGVALUE_ */
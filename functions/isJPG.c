@@ -4,8 +4,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include "getHeaderField.c"
 #include "strcasestr.c"
+#include "../headers/httpParser.h" /* for headerindex */
 
 /*
  * This determines whether there is a request for a JPG image 
@@ -13,16 +13,17 @@
  *
  * @param toSearch The header
  * @param length The length of the header, in bytes.
+ * @param index The header's index, from indexHeader().
  * @return 1 if there is a request for a JPG, 0 otherwise.
  */
-int isJPG(void* toSearch, long int length) {
-  char* field;
+int isJPG(void* toSearch, long int length, headerindex* index) {
+  httpfield* field;
   char buffer[100];
 
   /* first, the easy check */
-  field = getHeaderField(toSearch, length, "\nContent-Type");
-  if (strcasestr(field, ".jpg") || strcasestr(field, "jpeg")) { /* easy */
-    free(field);
+  field = indexFind(index, "Content-Type");
+  if (field && (spanCaseContains(field->value, ".jpg") ||
+                spanCaseContains(field->value, "jpeg"))) { /* easy */
 
     #ifdef DEBUG
       printf("isJPG.c: Request for JPG found in Content-Type.\n");
@@ -31,8 +32,6 @@ int isJPG(void* toSearch, long int length) {
     return 1;
   }
 
-  free(field);
-
   /* arriving here means...not so easy */
   memset(&buffer, 0, sizeof(buffer));
   memcpy(buffer, toSearch, 10);
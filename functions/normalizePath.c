@@ -0,0 +1,131 @@
+#ifndef _NORMALIZEPATH_
+#define _NORMALIZEPATH_
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "strDecode.c" /* for hexit() */
+
+/* helpers */
+static int pathIsClean(char* path, long int len);
+
+/* Decodes the %XX escapes in a requested path and puts it in canonical
+ * form, all in one pass: repeated slashes are squeezed into one, and
+ * "." segments are dropped, so that every spelling of a file comes out
+ * the same and can be used as its key in the file cache.  A ".."
+ * segment, encoded or not, is an attempt to climb out of the document
+ * root, and so is a NULL byte, which would cut the name short.
+ *
+ * Most paths need none of this, so they are first checked 16 bytes at
+ * a time for a '%', a NULL, or a slash followed by a '.' or another
+ * slash, and are left as they are if there isn't one.
+ *
+ * Like strDecode(), this is meant to be called with the SAME pointer
+ * for both arguments; the result is never longer than the original.
+ *
+ * @param to Will contain the canonical path, NULL-terminated.
+ * @param from The requested path, without its leading slash.
+ * @param len The number of bytes in from.
+ * @return The length of the canonical path, or -1 if it's illegal.
+ */
+long int normalizePath(char* to, char* from, long int len) {
+  long int i = 0, out = 0, segment = 0;
+  char c;
+
+  if (pathIsClean(from, len)) { /* nothing to do */
+    memmove(to, from, len);
+    to[len] = '\0';
+    return len;
+  }
+
+  while (i < len) {
+    c = from[i];
+    if (c == '%' && i + 2 < len && isxdigit((unsigned char)from[i + 1]) &&
+        isxdigit((unsigned char)from[i + 2])) {
+      c = hexit(from[i + 1]) * 16 + hexit(from[i + 2]);
+      i += 3;
+    } else {
+      i++;
+    }
+
+    if (c == '\0') { /* evil */
+      return -1;
+    } else if (c != '/') {
+      to[out++] = c;
+      continue;
+    }
+
+    /* a slash ends the segment in to[segment, out) */
+    if (out == segment) { /* empty; a repeated or leading slash */
+      continue;
+    } else if (out - segment == 1 && to[segment] == '.') {
+      out = segment;
+      continue;
+    } else if (out - segment == 2 && to[segment] == '.' &&
+               to[segment + 1] == '.') { /* evil */
+      return -1;
+    }
+    to[out++] = '/';
+    segment = out;
+  }
+
+  /* the last segment has no slash after it */
+  if (out - segment == 1 && to[segment] == '.') {
+    out = segment;
+  } else if (out - segment == 2 && to[segment] == '.' &&
+             to[segment + 1] == '.') { /* evil */
+    return -1;
+  }
+
+  to[out] = '\0';
+  return out;
+}
+
+/* Checks whether a path is already in canonical form: it doesn't
+ * start with a '.' or a slash, and holds no '%', no NULL, and no slash
+ * followed by a '.' or another slash.
+ *
+ * @return 1 if the path can be used as it is, 0 otherwise.
+ */
+static int pathIsClean(char* path, long int len) {
+  long int i = 0;
+
+  if (len > 0 && (path[0] == '.' || path[0] == '/')) {
+    return 0;
+  }
+
+#ifdef __SSE2__
+  /* each byte is looked at alongside the one after it */
+  for ( ; i + 17 <= len; i += 16) {
+    __m128i here = _mm_loadu_si128((__m128i*)(path + i));
+    __m128i next = _mm_loadu_si128((__m128i*)(path + i + 1));
+    __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(here, _mm_set1_epi8('%')),
+                               _mm_cmpeq_epi8(here, _mm_setzero_si128()));
+    __m128i follows = _mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8('.')),
+                                   _mm_cmpeq_epi8(next, _mm_set1_epi8('/')));
+
+    bad = _mm_or_si128(bad, _mm_and_si128(follows,
+                               _mm_cmpeq_epi8(here, _mm_set1_epi8('/'))));
+    if (_mm_movemask_epi8(bad)) {
+      return 0;
+    }
+  }
+#endif
+
+  for ( ; i < len; i++) {
+    if (path[i] == '%' || path[i] == '\0' ||
+        (path[i] == '/' && i + 1 < len &&
+         (path[i + 1] == '.' || path[i + 1] == '/'))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+#endif /* _NORMALIZEPATH_ */
@@ -25,21 +25,39 @@ void printArgs(int program) {
       break;
 
     case SERVER:
-      printf("%s %s\n\nUsage:\n\t%% ./server <listening port> <# of threads> [directory] [-o]\n\n", SERVER_NAME, VERSION);
+      printf("%s %s\n\nUsage:\n\t%% ./server <listening port> <# of threads> [directory] [-o] [-e <loops> [-u]] [-k <seconds>] [-r <requests>] [-h <seconds>] [-b <seconds>] [-f <entries>] [-v <seconds>] [-m <MB>] [-z <threads>] [-w <threads>] [-l <connections>] [-q <connections>] [-d <ms>] [-s <shards> [-p]]\n\n", SERVER_NAME, VERSION);
       printf("listening port : Listens here for client connections.\n");
       printf("  # of threads : Number of worker threads to handle connections.\n");
       printf("     directory : Optional server document root.\n");
       printf("            -o : Server is optimized for shared memory use.\n");
+      printf("    -e <loops> : Serve sockets from <loops> epoll event loops;\n");
+      printf("                 worker threads then only serve shared memory.\n");
+      printf("            -u : Run the event loops on io_uring rather than epoll.\n");
+      printf("  -k <seconds> : Close idle persistent connections after this long (0 disables keep-alive).\n");
+      printf(" -r <requests> : Close persistent connections after this many requests.\n");
+      printf("  -h <seconds> : Give clients this long to send a whole request header (0 waits forever).\n");
+      printf("  -b <seconds> : Close connections whose response makes no progress for this long (0 waits forever).\n");
+      printf("  -f <entries> : Number of open files kept in the file cache (0 disables it).\n");
+      printf("  -v <seconds> : How long a cached file is trusted before checking the disk again.\n");
+      printf("  -m <MB>      : Memory for caching small files' contents (0 disables it).\n");
+      printf("  -z <threads> : Threads gzipping popular text files in the background (0 disables it).\n");
+      printf("  -w <threads> : Let the worker pool grow to this many threads when busy,\n                 shrinking back to <# of threads> when idle.\n");
+      printf("-l <connections> : Listen backlog, the connections the kernel holds until accepted.\n");
+      printf("-q <connections> : Connections each shard queues for its workers; more are refused with a 503.\n");
+      printf("      -d <ms>  : Refuse connections that waited longer than this for a worker while\n                 the queue isn't emptying (0 disables it).\n");
+      printf("  -s <shards>  : Split the server into shards, each with its own listening socket\n                 (SO_REUSEPORT) and its own <# of threads> workers.\n");
+      printf("  -p           : Pin each shard to a CPU.\n");
       break;
 
     case PROXY:
-      printf("Squinn Proxy\n\nUsage:\n\t%% ./proxy <listening port> <# of threads> [-c <RPC server> <port>] [-o]\n\n");
+      printf("Squinn Proxy\n\nUsage:\n\t%% ./proxy <listening port> <# of threads> [-c <RPC server> <port>] [-o] [-w <threads>]\n\n");
       printf("listening port : Listens here for client connections.\n");
       printf("  # of threads : Number of worker threads to handle connections.\n");
       printf("            -c : Proxy will compress JPG images it receives.\n");
       printf("   dist server : Distributed server proxy will send JPGs for compression.\n");
       printf("          port : Port number for the distributed server.\n");
       printf("            -o : Proxy is optimized for shared memory use.\n");
+      printf("  -w <threads> : Let the worker pool grow to this many threads when busy,\n                 shrinking back to <# of threads> when idle.\n");
       break;
   }
 }
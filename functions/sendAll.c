@@ -2,8 +2,24 @@
 #define _SENDALL_
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+/* Debug builds count every send syscall made on behalf of a response,
+ * and every response, so the two can be compared. */
+#ifdef DEBUG
+long int sendSyscalls = 0;
+long int sendResponses = 0;
+#define COUNT_SYSCALL() __sync_fetch_and_add(&sendSyscalls, 1)
+#define COUNT_RESPONSE() __sync_fetch_and_add(&sendResponses, 1)
+#else
+#define COUNT_SYSCALL()
+#define COUNT_RESPONSE()
+#endif
 
 /* Given a socket identifier, the address of an integer, and 
  * a pointer to the block of data to be sent, this function
@@ -25,6 +41,7 @@ int sendAll(int socket, void* buf, long int* len) {
   /* loop until everything has been sent or an error occurs */
   while (total < (*len)) {
     i = send(socket, ((char*)buf + total), bytesleft, MSG_NOSIGNAL);
+    COUNT_SYSCALL();
     if (i < 0) { /* an error occurred */
       return i;
     }
@@ -38,4 +55,89 @@ int sendAll(int socket, void* buf, long int* len) {
   return 0;
 }
 
+/* The gathering counterpart of sendAll().  Several separate buffers
+ * are sent as though they were one, with a single sendmsg() in the
+ * common case, picking up partway through a buffer after a partial
+ * write.  Pass MSG_MORE in flags when more of the response (a file
+ * body, say) will follow, so the kernel holds the tail of the header
+ * back to share a segment with it.
+ *
+ * NOTE: The iovec array is modified as data goes out.
+ *
+ * @param socket The socket identifier.
+ * @param iov The buffers to be sent, in order.
+ * @param count The number of buffers.
+ * @param flags Extra flags for sendmsg(), or 0.
+ * @return The number of bytes sent, or -1 on error.
+ */
+long int writevAll(int socket, struct iovec* iov, int count, int flags) {
+  struct msghdr msg;
+  long int total = 0;
+  ssize_t i;
+
+  memset(&msg, 0, sizeof(msg));
+  while (count > 0) {
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = count;
+    i = sendmsg(socket, &msg, flags | MSG_NOSIGNAL);
+    COUNT_SYSCALL();
+    if (i < 0 && errno == EINTR) { /* try again */
+      continue;
+    } else if (i < 0) { /* an error occurred */
+      return -1;
+    }
+    total += i;
+
+    /* skip past whatever went out */
+    while (count > 0 && (size_t)i >= iov->iov_len) {
+      i -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + i;
+      iov->iov_len -= i;
+    }
+  }
+
+  return total;
+}
+
+/* The file counterpart of sendAll().  Rather than copying the file
+ * through a user space buffer, the kernel moves the data from the
+ * page cache straight onto the socket with sendfile(), picking up
+ * from wherever a partial send left off.
+ *
+ * @param socket The socket identifier.
+ * @param filedesc The open file to send from.
+ * @param offset The position in the file at which to start; it is
+ *               advanced past whatever was sent.  The file's own
+ *               offset is left untouched, so descriptors can be shared.
+ * @param len A pointer to the number of bytes to send; upon the
+ *            function's return it contains the number actually sent.
+ * @return An error code on failure, 0 on success.
+ */
+int sendFileAll(int socket, int filedesc, off_t* offset, long int* len) {
+  long int total = 0; /* everything sent */
+  ssize_t i;
+
+  /* loop until everything has been sent or an error occurs */
+  while (total < (*len)) {
+    i = sendfile(socket, filedesc, offset, (*len) - total);
+    COUNT_SYSCALL();
+    if (i < 0 && errno == EINTR) { /* try again */
+      continue;
+    } else if (i <= 0) { /* an error occurred, or the file shrank */
+      *len = total;
+      return -1;
+    }
+    total += i;
+  }
+
+  /* everything was sent!  store that number */
+  *len = total;
+
+  return 0;
+}
+
 #endif /* _SENDALL_ */
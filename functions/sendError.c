@@ -7,8 +7,67 @@
 #include "../headers/constants.h"
 #include "sendResponse.c"
 
+/* an error page rendered ahead of time */
+typedef struct errorpage {
+  int status;
+  char* title;
+  char* text;
+  char header[1000];          /* everything up to the Connection line */
+  long int headerLen;
+  char body[2000];
+  long int bodyLen;
+} errorpage;
+
+static errorpage errorPages[MAXERRORPAGES];
+static int numErrorPages = 0;
+
+/* Formats the HTML body of an error page.
+ *
+ * @return The length in bytes of the body.
+ */
+static long int renderError(char* buf, long int size, int status,
+                            char* title, char* text) {
+
+  snprintf(buf, (size - 1), "<html><head><title>%d %s</title></head>\n<body bgcolor=\"#CC9999\"><h4>%d %s</h4>\n%s<hr><address><a href=\"%s\">%s</a></address>\n</body></html>\n", status, title, status, title, text, SERVER_URL, SERVER_NAME);
+
+  return strlen(buf);
+}
+
+/* Renders an error page, header and all, so that sendError() can send
+ * it later without formatting anything.  Pages are only looked up when
+ * no additional headers are given, so this is meant for the fixed
+ * errors a program sends over and over.
+ *
+ * NOTE: Call this before any threads start; the pages are never locked.
+ *
+ * @param status The status integer.
+ * @param title The title of the error page, corresponding to the status.
+ * @param text The body text of the error page.
+ * @return 0 on success, -1 if there is no room left.
+ */
+int prerenderError(int status, char* title, char* text) {
+  errorpage* page;
+
+  if (numErrorPages >= MAXERRORPAGES) {
+    return -1;
+  }
+
+  page = &(errorPages[numErrorPages++]);
+  page->status    = status;
+  page->title     = title;
+  page->text      = text;
+  page->bodyLen   = renderError(page->body, sizeof(page->body), status,
+                                title, text);
+  page->headerLen = buildHeaderPrefix(page->header, sizeof(page->header),
+                                      status, title, (char*)0, "text/html",
+                                      page->bodyLen);
+  return 0;
+}
+
 /* A wrapper for sending an HTTP error message from the server
- * to the client.
+ * to the client.  Pages set up by prerenderError() are sent as is.
+ * An error (anything 400 or over) always closes the connection, since
+ * whatever the client sends next can't be trusted to line up.
  *
  * @param status This is the status integer.  Common statuses include
  *               404 Not Found, 503 Server Error, etc
@@ -21,12 +80,34 @@
 void sendError(int status, char* title, char* headers,
                char* text, void* c, int shared) {
 
-  char buf[10000];
-  int strLen;
+  char* buf;
+  long int size, strLen;
+  int i;
+
+  if (!shared && status >= 400) {
+    ((connection*)c)->keepAlive = 0;
+  }
 
-  snprintf(buf, (sizeof(buf) - 1), "<html><head><title>%d %s</title></head>\n<body bgcolor=\"#CC9999\"><h4>%d %s</h4>\n%s<hr><address><a href=\"%s\">%s</a></address>\n</body></html>\n", status, title, status, title, text, SERVER_URL, SERVER_NAME);
+  if (!headers) {
+    for (i = 0; i < numErrorPages; i++) {
+      errorpage* page = &(errorPages[i]);
+      if (page->status == status &&
+          (page->text == text || strcmp(page->text, text) == 0)) {
+        sendPrebuilt(page->header, page->headerLen, page->body,
+                     page->bodyLen, c, shared);
+        return;
+      }
+    }
+  }
 
-  strLen = strlen(buf);
+  /* the template itself is well under HEADERSLACK * 2 */
+  size = (HEADERSLACK * 2) + (2 * strlen(title)) + strlen(text) +
+         strlen(SERVER_URL) + strlen(SERVER_NAME);
+  if (!(buf = scratchAlloc(size))) {
+    printf("Error sending response!\n");
+    return;
+  }
+  strLen = renderError(buf, size, status, title, text);
   sendResponse(status, title, headers, "text/html", strLen, buf, c, shared);
 }
 
@@ -2,13 +2,179 @@
 #define _SENDRESPONSE_
 
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "../headers/constants.h"
 #include "../headers/conList.h"
 #include "../headers/memList.h"
+#include "../headers/arena.h"
 #include "sendAll.c"
+#include "fileContents.c"
 #include "processShared.c"
 
-/* This function sends an HTTP response over the wire.
+/* Formats everything in an HTTP response header that doesn't depend
+ * on the connection it is sent over.  The result can be kept and
+ * reused for any number of responses; connectionTrailer() supplies
+ * the rest.
+ *
+ * @param header The buffer to hold the header.
+ * @param size The size of the buffer.
+ * @param status The return code of the page.
+ * @param title The title corresponding to the status.
+ * @param headers Any additional headers.
+ * @param mime The MIME encoding type of the page, or NULL for a response
+ *             that never has a body (a 304), which then gets neither a
+ *             Content-Type nor a Content-Length.
+ * @param length The length in bytes of the body.
+ * @return The length in bytes of the formatted text.
+ */
+off_t buildHeaderPrefix(char* header, long int size, int status, char* title,
+                        char* headers, char* mime, off_t length) {
+
+  if (!mime) {
+    snprintf(header, (size - 1), "%s %d %s %s%s", PROTOCOL, status, title, EOL, (headers ? headers : ""));
+    return strlen(header);
+  }
+  snprintf(header, (size - 1), "%s %d %s %s%sContent-Length: %ld %sContent-Type: %s %s", PROTOCOL, status, title, EOL, (headers ? headers : ""), length, EOL, mime, EOL);
+
+  return strlen(header);
+}
+
+/* buildHeaderPrefix() into a buffer from the thread's arena, just big
+ * enough for the header in question.
+ *
+ * @param len Set to the length in bytes of the formatted text.
+ * @return The header, good until the arena is reset, or NULL if there
+ *         was no memory for it.
+ */
+char* scratchHeader(long int* len, int status, char* title, char* headers,
+                    char* mime, off_t length) {
+  long int size = HEADERSLACK + strlen(title) + (headers ? strlen(headers) : 0) +
+                  (mime ? strlen(mime) : 0);
+  char* header = scratchAlloc(size);
+
+  if (header) {
+    *len = buildHeaderPrefix(header, size, status, title, headers, mime,
+                             length);
+  }
+
+  return header;
+}
+
+/* Returns the end of the header for a response on this connection,
+ * which says whether the connection will stay open.
+ *
+ * @param c The node containing the socket identifier, OR the shared memory.
+ * @param shared Integer indicating whether this connection is shared memory.
+ * @return A constant string; don't free it.
+ */
+char* connectionTrailer(void* c, int shared) {
+
+  /* shared memory transactions are always one request long */
+  if (!shared && ((connection*)c)->keepAlive) {
+    return "Connection: keep-alive" EOL EOL;
+  }
+  return "Connection: close" EOL EOL;
+}
+
+/* Sends a response whose header (minus the connection trailer) was
+ * formatted ahead of time, typically by buildHeaderPrefix() when the
+ * file was cached.  Over a socket, the prefix, trailer, and body all
+ * go out through a single sendmsg(), so a small response costs one
+ * syscall and usually one TCP segment; event loop connections try that
+ * right away and only queue whatever the socket wouldn't take.  The
+ * answer to a HEAD request leaves the body out.
+ *
+ * @param prefix The pre-rendered header.
+ * @param prefixLen The length in bytes of prefix.
+ * @param body The body of the response.
+ * @param length The length in bytes of the body.
+ * @param c The node containing the socket identifier, OR the shared memory.
+ * @param shared Integer indicating whether this connection is shared memory.
+ */
+void sendPrebuilt(char* prefix, long int prefixLen, void* body,
+                  long int length, void* c, int shared) {
+  struct iovec iov[3];
+  char* trailer = connectionTrailer(c, shared);
+  long int trailerLen = strlen(trailer);
+
+  if (!shared && ((connection*)c)->headOnly) {
+    length = 0;
+  }
+
+  iov[0].iov_base = prefix;
+  iov[0].iov_len  = prefixLen;
+  iov[1].iov_base = trailer;
+  iov[1].iov_len  = trailerLen;
+  iov[2].iov_base = body;
+  iov[2].iov_len  = length;
+
+  if (shared) {
+    memnode* sharedNode = (memnode*)c;
+    char* header = scratchAlloc(prefixLen + trailerLen);
+
+    /* sendShared() wants the header in one piece */
+    if (header) {
+      memcpy(header, prefix, prefixLen);
+      memcpy(header + prefixLen, trailer, trailerLen);
+      sendShared(header, prefixLen + trailerLen, body, length, sharedNode);
+    } else {
+      printf("Error sending response!\n");
+    }
+
+    /* STEP 10 */
+    pthread_mutex_unlock(&(sharedNode->mutex));
+
+  } else if (((connection*)c)->action == EVENT ||
+             ((connection*)c)->action == RING) {
+    connection* connNode = (connection*)c;
+    long int sent = 0, skip;
+    int i;
+
+    COUNT_RESPONSE();
+
+    /* nothing else is queued, so try to get it all out now; the ring
+     * sends everything itself */
+    if (connNode->action == EVENT &&
+        connNode->outLen == connNode->outSent && connNode->fileLeft == 0) {
+      struct msghdr msg;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov    = iov;
+      msg.msg_iovlen = 3;
+      sent = sendmsg(connNode->conn, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+      COUNT_SYSCALL();
+      if (sent < 0) {
+        sent = 0; /* EAGAIN, or an error the event loop will find */
+      }
+    }
+
+    /* queue up whatever didn't make it */
+    for (i = 0; i < 3; i++) {
+      skip = (sent < (long int)iov[i].iov_len ? sent : (long int)iov[i].iov_len);
+      sent -= skip;
+      if (appendOutput(connNode, (char*)iov[i].iov_base + skip, iov[i].iov_len - skip) < 0) {
+        printf("Error queueing response!\n");
+      }
+    }
+
+  } else {
+    connection* connNode = (connection*)c;
+
+    COUNT_RESPONSE();
+    if (writevAll(connNode->conn, iov, 3, 0) < 0) {
+      printf("Error sending response!\n");
+    }
+
+    #ifdef DEBUG
+      printf("sendResponse.c: Sent %ld prebuilt bytes\n", prefixLen + trailerLen + length);
+    #endif
+  }
+}
+
+/* This function sends an HTTP response over the wire.  Over a socket,
+ * the header and body are gathered into a single syscall.
  *
  * @param status The return code of the page.  200 indicates OK, otherwise
  *               indicates an error occurred.
@@ -24,51 +190,146 @@ void sendResponse(int status, char* title, char* headers,
                   char* mime, off_t length, void* body, void* c, 
                   int shared) {
 
-  char header[10000];
-  off_t headerLen;
+  long int headerLen;
+  char* header = scratchHeader(&headerLen, status, title, headers, mime,
+                               length);
+
+  if (!header) {
+    printf("Error sending response!\n");
+    return;
+  }
+
+  /* header and body go out together */
+  sendPrebuilt(header, headerLen, body, length, c, shared);
+}
+
+/* The sendPrebuilt() counterpart of sendFileResponse(): the header
+ * (minus the connection trailer) was formatted ahead of time, and the
+ * body is read straight from an open file.
+ *
+ * @param prefix The pre-rendered header.
+ * @param prefixLen The length in bytes of prefix.
+ * @param length The number of bytes of the file to send.
+ * @param filedesc The open file holding the body.
+ * @param offset The position in the file at which the body starts.
+ * @param c The node containing the socket identifier, OR the shared memory.
+ * @param shared Integer indicating whether this connection is shared memory.
+ * @return 0 on success, or -1 if the file could not be read and nothing
+ *         was sent, in which case the caller should report an error.
+ */
+int sendFilePrebuilt(char* prefix, long int prefixLen, off_t length,
+                     int filedesc, off_t offset, void* c, int shared) {
 
-  snprintf(header, (sizeof(header) - 1), "%s %d %s %s%sContent-Length: %ld %sContent-Type: %s %s%s", PROTOCOL, status, title, EOL, (headers ? headers : ""), length, EOL, mime, EOL, EOL);
+  struct iovec iov[2];
 
-  headerLen = strlen(header);
+  if (filedesc < 0) { /* nothing to read from */
+    return -1;
+  }
+  if (!shared && ((connection*)c)->headOnly) { /* the header will do */
+    sendPrebuilt(prefix, prefixLen, NULL, 0, c, shared);
+    return 0;
+  }
 
-  /* shared or socket connection? */
+  /* shared memory still needs the contents in hand, but only the part
+   * being sent */
   if (shared) {
-    memnode* sharedNode = (memnode*)c;
+    void* contents = NULL;
+    off_t slack = 0;
 
-    /* intermediate steps, depending on caller */
-    sendShared(header, headerLen, body, length, sharedNode);
+    if (length > 0 && !(contents = fileWindow(filedesc, offset, length, &slack))) {
+      return -1;
+    }
+    sendPrebuilt(prefix, prefixLen, (char*)contents + slack, length, c,
+                 shared);
+    if (contents && munmap(contents, length + slack) < 0) {
+      printf("sendResponse.c: Cannot unmap file contents!\n");
+    }
+    return 0;
+  }
 
-    #ifdef DEBUG
-      printf("sendResponse.c: sendShared() successful, unlocking mutex.\n");
-    #endif
+  iov[0].iov_base = prefix;
+  iov[0].iov_len  = prefixLen;
+  iov[1].iov_base = connectionTrailer(c, shared);
+  iov[1].iov_len  = strlen(iov[1].iov_base);
 
-    /* STEP 10 */
-    pthread_mutex_unlock(&(sharedNode->mutex));
+  if (((connection*)c)->action == EVENT ||
+      ((connection*)c)->action == RING) {
+    connection* connNode = (connection*)c;
+
+    /* the event loop sends the file once the header has gone out */
+    if (length > 0 && (connNode->fileDesc = dup(filedesc)) < 0) {
+      return -1;
+    }
+    connNode->fileOffset = offset;
+    connNode->fileLeft = length;
+    COUNT_RESPONSE();
+    if (appendOutput(connNode, iov[0].iov_base, iov[0].iov_len) < 0 ||
+        appendOutput(connNode, iov[1].iov_base, iov[1].iov_len) < 0) {
+      printf("Error queueing response!\n");
+    }
 
     #ifdef DEBUG
-      printf("sendResponse.c: Mutex unlocked.\n");
+      printf("sendResponse.c: Queued %ld header bytes and %ld file bytes\n", (long)(prefixLen + iov[1].iov_len), (long)length);
     #endif
-
   } else {
     connection* connNode = (connection*)c;
-    /* send the entire header package */
-    if (sendAll(connNode->conn, header, &headerLen) < 0) {
+    long int bodyLen = length;
+
+    /* send the entire header package, corked until the body follows */
+    COUNT_RESPONSE();
+    if (writevAll(connNode->conn, iov, 2, (length > 0 ? MSG_MORE : 0)) < 0) {
       printf("Error sending header!\n");
+      return 0;
     }
 
-    #ifdef DEBUG
-      printf("sendResponse.c: Header length is %ld\n", headerLen);
-    #endif
-
-    /* now send the body */
-    if (sendAll(connNode->conn, body, &length) < 0) {
+    /* now let the kernel send the body */
+    if (sendFileAll(connNode->conn, filedesc, &offset, &bodyLen) < 0) {
       printf("Error sending body!\n");
     }
 
     #ifdef DEBUG
-      printf("sendResponse.c: Body length is %ld\n", length);
+      printf("sendResponse.c: Header length is %ld, file length is %ld\n", prefixLen, bodyLen);
     #endif
   }
+
+  return 0;
+}
+
+/* Identical to sendResponse(), except that the body is read straight
+ * from an open file.  Socket connections get the header through one
+ * send and the body through sendfile(), so the file's contents never
+ * pass through user space; only shared memory connections map the
+ * file, since the body has to be copied into the shared segment anyway.
+ *
+ * The caller keeps ownership of filedesc and should close it after
+ * this returns.  Event loop connections take their own duplicate.
+ *
+ * @param status The return code of the page.
+ * @param title The title of the HTML page.
+ * @param headers Any additional headers.
+ * @param mime The MIME encoding type of the page.
+ * @param length The number of bytes of the file to send.
+ * @param filedesc The open file holding the body.
+ * @param offset The position in the file at which the body starts.
+ * @param c The node containing the socket identifier, OR the shared memory.
+ * @param shared Integer indicating whether this connection is shared memory.
+ * @return 0 on success, or -1 if the file could not be read and nothing
+ *         was sent, in which case the caller should report an error.
+ */
+int sendFileResponse(int status, char* title, char* headers,
+                     char* mime, off_t length, int filedesc, off_t offset,
+                     void* c, int shared) {
+
+  long int headerLen;
+  char* header = scratchHeader(&headerLen, status, title, headers, mime,
+                               length);
+
+  if (!header) {
+    return -1;
+  }
+
+  return sendFilePrebuilt(header, headerLen, length, filedesc, offset, c,
+                          shared);
 }
 
   /* send the entire header package */
@@ -26,7 +26,7 @@ char* strcasestr(const char* haystack, const char* needle) {
 
   needleLength = strlen(needle);
   haystackLength = strlen(haystack);
-  for (i = 0; i < haystackLength - needleLength; i++) {
+  for (i = 0; i <= haystackLength - needleLength; i++) {
     int isMatch = 1;
     for (j = 0; j < needleLength; j++) {
       char ch1 = toupper(haystack[i + j]);
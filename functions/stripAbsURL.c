@@ -5,8 +5,8 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "getHeaderField.c"
 #include "../headers/constants.h" /* for EOL */
+#include "../headers/httpParser.h" /* for headerindex */
 
 /* This function operates for the purposes of the proxy server.  When a 
  * request arrives from a client configured to use the proxy, the path
@@ -16,16 +16,20 @@
  *
  * @param header The initial header, to be modified.
  * @param oldLength The number of bytes in the header parameter.
- * @return The length in bytes of the new header.
+ * @param index The header's index, from indexHeader().
+ * @param newL Set to the length in bytes of the new header.
+ * @return The new header, or NULL on failure.
  */
-void* stripAbsURL(void* header, long int oldLength, long int* newL) {
+void* stripAbsURL(void* header, long int oldLength, headerindex* index,
+                  long int* newL) {
   void* newHeader;
   long int newLength, firstHalf, secondHalf;
   char* http = "http://";
   void* start, *end;
   char toFind[10000];
-  char* host = getHeaderField(header, oldLength, "\nHost");
-  if (!host) { /* this is bad */
+  httpfield* host;
+
+  if (!(host = indexFind(index, "Host"))) { /* this is bad */
 
     #ifdef DEBUG
       printf("No host found in header!\n");
@@ -35,13 +39,14 @@ void* stripAbsURL(void* header, long int oldLength, long int* newL) {
   }
 
   /* set new header length (+1 for slash) */
-  newLength = oldLength - strlen(http) - strlen(host);
+  newLength = oldLength - strlen(http) - host->value.len;
   (*newL) = newLength;
 
   #ifdef DEBUG
     printf("Header length changed from %ld to %ld.\n", oldLength, newLength);
-    printf("Host counted: |%s%s|\n", http, host);
-    printf("Host length: %d\n", strlen(http) + strlen(host));
+    printf("Host counted: |%s%.*s|\n", http, (int)host->value.len,
+           host->value.start);
+    printf("Host length: %ld\n", strlen(http) + host->value.len);
   #endif
 
   newHeader = calloc(newLength, sizeof(char));
@@ -56,8 +61,8 @@ void* stripAbsURL(void* header, long int oldLength, long int* newL) {
 
   /* create a duplicate of the part of the header we want to replace */
   memset(&toFind, 0, sizeof(toFind));
-  snprintf(toFind, (sizeof(toFind) - 1), "%s%s", http, host);
-  free(host); /* no memory leaks, kthx */
+  snprintf(toFind, (sizeof(toFind) - 1), "%s%.*s", http,
+           (int)host->value.len, host->value.start);
 
   /* position the two pointers at the start and end of the abs URL */
   start = strchr((char*)header, ' '); /* first space */
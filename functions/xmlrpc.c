@@ -19,8 +19,10 @@
  *
  * @param fromSock The socket identifier on which it receives data.
  * @param toSock The socket identifier to which data is sent.
- * @param header The actual header received.
+ * @param header The actual header received, followed by any bytes of
+ *               the body that were read along with it.
  * @param headerLength This will contain the length of the header.
+ * @param extraLength The number of body bytes right behind the header.
  * @param bodyLength This will contain the length of the expected body.
  * @param compression Indicates if incoming file is a JPG.
  * @param env The XML-RPC environment.
@@ -28,18 +30,37 @@
  * @return The number of bytes forwarded, or -1 on failure.
  */
 int recvAll_Forward(int fromSock, int toSock, void* header,
-                    long int headerLength, long int bodyLength,
-                    int compression, xmlrpc_env* env, char* server) {
+                    long int headerLength, long int extraLength,
+                    long int bodyLength, int compression, xmlrpc_env* env,
+                    char* server) {
   char inputBuffer[20000];
   long int bytesReceived = 0, bytesSent = 0;
   int arbitraryReceive = 0; /* set this flag if bodyLength < 0 */
-  void* imgBuffer, *compImgBuffer;
-  long int compImgSize;
+  void* imgBuffer = NULL, *compImgBuffer = NULL;
+  long int compImgSize, toSend;
 
-  /* first, send out the header */
-  if (sendAll(toSock, header, &headerLength) < 0) {
+  /* the body bytes that came in with the header are already here */
+  if (bodyLength >= 0 && extraLength > bodyLength) {
+    extraLength = bodyLength;
+  }
+  bytesReceived = extraLength;
+
+  /* first, send out the header (and, if nothing is to be compressed,
+   * the start of the body along with it) */
+  toSend = headerLength + (compression ? 0 : extraLength);
+  if (sendAll(toSock, header, &toSend) < 0) {
     return -1;
   }
+  if (compression) { /* hold on to it for the compressor */
+    if (extraLength > 0) {
+      if (!(imgBuffer = malloc(sizeof(char) * extraLength))) {
+        return -1;
+      }
+      memcpy(imgBuffer, (char*)header + headerLength, extraLength);
+    }
+  } else {
+    bytesSent = extraLength;
+  }
 
   #ifdef DEBUG
     printf("Length of body to receive: %ld\n", bodyLength);
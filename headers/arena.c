@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "arena.h"
+
+/* allocations are aligned to this many bytes */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((long int)ARENA_ALIGN - 1))
+
+/* the block header, rounded up so the memory after it stays aligned */
+#define ARENA_HEADER ARENA_ROUND((long int)sizeof(arenablock))
+
+/* helpers */
+static arenablock* newBlock(long int size, arenablock* prev);
+
+/* each thread's current arena */
+static __thread arena* threadArena = NULL;
+
+/* Sets up an empty arena.
+ *
+ * @param a The arena.
+ * @param size Bytes to start out with; no more than ARENA_KEEP.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int initArena(arena* a, long int size) {
+  if (size <= 0 || size > ARENA_KEEP) {
+    size = ARENA_KEEP;
+  }
+
+  a->used  = 0;
+  a->peak  = 0;
+  a->grows = 0;
+  if (!(a->block = newBlock(size, NULL))) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Hands out memory from an arena, adding a block if the current one
+ * is full.  Blocks grow by doubling up to ARENA_KEEP; anything bigger
+ * gets a block of exactly its size, which the next reset throws away.
+ *
+ * @param a The arena.
+ * @param size Bytes needed.
+ * @return The memory, aligned to ARENA_ALIGN, or NULL on failure.
+ */
+void* arenaAlloc(arena* a, long int size) {
+  arenablock* block = a->block;
+  long int want;
+  char* p;
+
+  size = ARENA_ROUND(size > 0 ? size : 1);
+  if (block->size - block->used < size) {
+    want = block->size * 2;
+    if (want > ARENA_KEEP) {
+      want = ARENA_KEEP;
+    }
+    if (want < size) {
+      want = size;
+    }
+    if (!(block = newBlock(want, a->block))) {
+      return NULL;
+    }
+    a->block = block;
+    a->grows++;
+  }
+
+  p = (char*)block + ARENA_HEADER + block->used;
+  block->used += size;
+  a->used     += size;
+
+  return p;
+}
+
+/* Empties an arena, once everything taken from it is no longer needed.
+ * If the request outgrew the first block, the biggest block of up to
+ * ARENA_KEEP bytes is kept for the next one, and the rest are freed.
+ *
+ * @param a The arena.
+ */
+void arenaReset(arena* a) {
+  arenablock* block, *prev, *keep = NULL;
+
+  if (a->used > a->peak) {
+    a->peak = a->used;
+  }
+
+  /* newest first, so the first small enough block is the biggest */
+  for (block = a->block; block; block = prev) {
+    prev = block->prev;
+    if (!keep && block->size <= ARENA_KEEP) {
+      keep = block;
+    } else {
+      free(block);
+    }
+  }
+
+  keep->prev = NULL;
+  keep->used = 0;
+  a->block   = keep;
+  a->used    = 0;
+}
+
+/* Frees everything in an arena. */
+void freeArena(arena* a) {
+  arenablock* block, *prev;
+
+  for (block = a->block; block; block = prev) {
+    prev = block->prev;
+    free(block);
+  }
+  a->block = NULL;
+  if (threadArena == a) {
+    threadArena = NULL;
+  }
+}
+
+/* Makes an arena the calling thread's, for scratchAlloc().
+ *
+ * @param a The arena, or NULL for none.
+ */
+void useArena(arena* a) {
+  threadArena = a;
+}
+
+/* Hands out memory from the calling thread's arena.
+ * NOTE: Call useArena() first in every thread that answers requests!
+ *
+ * @param size Bytes needed.
+ * @return The memory, good until the arena is reset, or NULL on failure.
+ */
+void* scratchAlloc(long int size) {
+  if (!threadArena) {
+    #ifdef DEBUG
+      printf("arena.c: scratchAlloc() called without an arena!\n");
+    #endif
+
+    return NULL;
+  }
+
+  return arenaAlloc(threadArena, size);
+}
+
+/* Allocates a block with room for size bytes after its header. */
+static arenablock* newBlock(long int size, arenablock* prev) {
+  arenablock* block = malloc(ARENA_HEADER + size);
+
+  if (block) {
+    block->prev = prev;
+    block->size = size;
+    block->used = 0;
+  }
+
+  return block;
+}
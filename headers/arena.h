@@ -0,0 +1,59 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+#include "constants.h" /* for ARENA_SIZE and ARENA_KEEP */
+
+/* This file stores everything regarding arenas, the scratch memory a
+ * worker uses while it answers a request: header buffers, error pages,
+ * redirect locations, directory names, and the like.
+ *
+ * Memory is handed out by bumping a pointer, and never given back one
+ * piece at a time; the whole arena is emptied at once with arenaReset()
+ * when the request is finished.  A request that needs more than the
+ * arena holds gets another, bigger block chained on.  Resetting keeps
+ * the biggest block of up to ARENA_KEEP bytes and frees the rest, so
+ * the arena settles at what requests actually need, and a steady
+ * stream of requests does no malloc() or free() at all.  Only the bytes
+ * handed out are ever touched.
+ *
+ * Every thread that answers requests has an arena of its own, made
+ * current with useArena(), and the response functions take their
+ * buffers from it with scratchAlloc(), so nothing needs to be passed
+ * around.  Anything taken from it is good until the thread's next
+ * arenaReset(), and must not be kept past that.
+ *
+ * The type "arenablock" is one chunk of memory in the arena.
+ *
+ * The type "arena" is the arena itself: its newest block, and a few
+ * counters.
+ */
+
+/* one chunk of an arena */
+typedef struct arenablock {
+  struct arenablock* prev;    /* the block filled before this one */
+  long int size;              /* bytes in the block */
+  long int used;              /* bytes handed out */
+} arenablock;
+
+/* the arena */
+typedef struct arena {
+  arenablock* block;          /* the block being filled */
+  long int used;              /* bytes handed out since the last reset */
+  long int peak;              /* the most any one request has used */
+  long int grows;             /* blocks added for requests that didn't fit */
+} arena;
+
+/* arena functions */
+int initArena(arena* a, long int size);
+void* arenaAlloc(arena* a, long int size);
+void arenaReset(arena* a);
+void freeArena(arena* a);
+
+/* the calling thread's arena */
+void useArena(arena* a);
+void* scratchAlloc(long int size);
+
+#include "arena.c"
+#endif /* ARENA_H */
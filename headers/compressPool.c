@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compressPool.h"
+
+/* helpers */
+static void* compressWorker(void* args);
+static void compressEntry(compresspool* pool, cacheentry* entry);
+static char* gzipBuffer(char* in, long int size, long int* outLen);
+
+/* Builds a compression pool and starts its threads.
+ *
+ * @param cache The file cache whose entries will be compressed.
+ * @param numThreads The number of compressing threads.
+ * @param queueSize The most files that may wait to be compressed.
+ * @return A new pool, or NULL on failure.
+ */
+compresspool* newCompressPool(filecache* cache, int numThreads,
+                              int queueSize) {
+  compresspool* pool;
+  int i;
+
+  if (numThreads <= 0 || queueSize <= 0) { /* sanity check */
+    return NULL;
+  }
+
+  if (!(pool = calloc(1, sizeof(compresspool)))) {
+    return NULL;
+  }
+  pool->cache      = cache;
+  pool->numThreads = numThreads;
+  pool->size       = queueSize;
+  if (!(pool->jobs = malloc(sizeof(cacheentry*) * queueSize)) ||
+      !(pool->threads = malloc(sizeof(pthread_t) * numThreads))) {
+    free(pool->jobs);
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&(pool->mutex), NULL);
+  pthread_cond_init(&(pool->ready), NULL);
+
+  for (i = 0; i < numThreads; i++) {
+    if (pthread_create(&(pool->threads[i]), NULL, compressWorker, pool) != 0) {
+      #ifdef DEBUG
+        printf("compressPool.c: Unable to start compression thread %d!\n", i);
+      #endif
+
+      pool->numThreads = i;
+      break;
+    }
+  }
+
+  return pool;
+}
+
+/* Counts a request for a file that could have been answered with a
+ * gzip copy, if only there were one, and queues the file to be
+ * compressed once it has been asked for often enough.  The caller is
+ * expected to have checked that the client takes gzip and that the
+ * file's type is worth compressing.
+ *
+ * @param pool The compression pool.
+ * @param entry A regular file's entry, held by the caller.
+ * @return 1 if the file was queued, 0 otherwise.
+ */
+int compressHit(compresspool* pool, cacheentry* entry) {
+  cachevariant* variant = &(entry->variants[CODING_GZIP]);
+  int slot;
+
+  if (entry->fd < 0 || !S_ISREG(entry->sb.st_mode) ||
+      entry->sb.st_size < COMPRESS_FILEMIN ||
+      entry->sb.st_size > COMPRESS_FILEMAX ||
+      variant->found || cacheSlot(&(variant->contents))) {
+    return 0;
+  }
+
+  /* exactly one request gets to queue it */
+  if (__sync_add_and_fetch(&(entry->compressHits), 1) != COMPRESS_HITS) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&(pool->mutex));
+  if (pool->stopping || pool->count == pool->size) {
+    pool->dropped++;
+    pthread_mutex_unlock(&(pool->mutex));
+    return 0;
+  }
+  cacheHold(pool->cache, entry);
+  slot = (pool->head + pool->count) % pool->size;
+  pool->jobs[slot] = entry;
+  pool->count++;
+  pool->queued++;
+  pthread_cond_signal(&(pool->ready));
+  pthread_mutex_unlock(&(pool->mutex));
+
+  return 1;
+}
+
+/* Prints the pool's counters.
+ *
+ * @param pool The compression pool.
+ */
+void printCompressStats(compresspool* pool) {
+  pthread_mutex_lock(&(pool->mutex));
+  printf("Compression: %ld files queued, %ld compressed (%ld KB to %ld KB), %ld dropped, %ld not worth it, %d waiting\n",
+         pool->queued, pool->compressed, pool->bytesIn / 1024,
+         pool->bytesOut / 1024, pool->dropped, pool->failed, pool->count);
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+/* Stops the pool's threads, once they've finished what they're doing,
+ * and gives back every entry still waiting.
+ * NOTE: Call this before the file cache is destroyed!
+ */
+void destroyCompressPool(compresspool* pool) {
+  int i;
+
+  pthread_mutex_lock(&(pool->mutex));
+  pool->stopping = 1;
+  pthread_cond_broadcast(&(pool->ready));
+  pthread_mutex_unlock(&(pool->mutex));
+
+  for (i = 0; i < pool->numThreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  while (pool->count > 0) {
+    cacheRelease(pool->cache, pool->jobs[pool->head]);
+    pool->head = (pool->head + 1) % pool->size;
+    pool->count--;
+  }
+
+  pthread_cond_destroy(&(pool->ready));
+  pthread_mutex_destroy(&(pool->mutex));
+  free(pool->threads);
+  free(pool->jobs);
+  free(pool);
+}
+
+/* Executed by each compression thread: takes queued entries one at a
+ * time until the pool is stopped.
+ *
+ * args is the pool
+ */
+static void* compressWorker(void* args) {
+  compresspool* pool = (compresspool*)args;
+  cacheentry* entry;
+
+  while (1) {
+    pthread_mutex_lock(&(pool->mutex));
+    while (pool->count == 0 && !pool->stopping) {
+      pthread_cond_wait(&(pool->ready), &(pool->mutex));
+    }
+    if (pool->stopping) {
+      pthread_mutex_unlock(&(pool->mutex));
+      return NULL;
+    }
+    entry = pool->jobs[pool->head];
+    pool->head = (pool->head + 1) % pool->size;
+    pool->count--;
+    pthread_mutex_unlock(&(pool->mutex));
+
+    compressEntry(pool, entry);
+    cacheRelease(pool->cache, entry);
+  }
+}
+
+/* Gzips a file and hands the result to the file cache.  Files already
+ * in memory are compressed from there; anything else is read from the
+ * entry's descriptor.
+ */
+static void compressEntry(compresspool* pool, cacheentry* entry) {
+  long int size = entry->sb.st_size, outLen = 0;
+  char* cached = cacheSlot(&(entry->contents)), *in = cached, *out = NULL;
+  int kept = 0;
+
+  if (!in && (in = malloc(size)) && pread(entry->fd, in, size, 0) != size) {
+    free(in); /* the file is changing under us, most likely */
+    in = NULL;
+  }
+
+  if (in && (out = gzipBuffer(in, size, &outLen)) &&
+      !(kept = cacheCompressed(pool->cache, entry, CODING_GZIP, out, outLen))) {
+    free(out);
+  }
+  if (in != cached) {
+    free(in);
+  }
+
+  pthread_mutex_lock(&(pool->mutex));
+  if (kept) {
+    pool->compressed++;
+    pool->bytesIn  += size;
+    pool->bytesOut += outLen;
+  } else {
+    pool->failed++;
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+/* Compresses a buffer into a gzip stream of its own.
+ *
+ * @param in The bytes to compress.
+ * @param size The number of bytes in in.
+ * @param outLen Set to the length of the result.
+ * @return The result, which the caller must free(), or NULL if it
+ *         couldn't be made or is no smaller than the input.
+ */
+static char* gzipBuffer(char* in, long int size, long int* outLen) {
+  char* out, *shrunk;
+  z_stream zs;
+  int result;
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) { /* 15 + 16: a gzip wrapper */
+    return NULL;
+  }
+  *outLen = deflateBound(&zs, size);
+  if (!(out = malloc(*outLen))) {
+    deflateEnd(&zs);
+    return NULL;
+  }
+
+  zs.next_in   = (Bytef*)in;
+  zs.avail_in  = size;
+  zs.next_out  = (Bytef*)out;
+  zs.avail_out = *outLen;
+  result = deflate(&zs, Z_FINISH);
+  *outLen = zs.total_out;
+  deflateEnd(&zs);
+
+  if (result != Z_STREAM_END || *outLen >= size) { /* saves nothing */
+    free(out);
+    return NULL;
+  }
+  if ((shrunk = realloc(out, *outLen))) {
+    out = shrunk;
+  }
+
+  return out;
+}
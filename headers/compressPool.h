@@ -0,0 +1,65 @@
+#ifndef _COMPRESSPOOL_
+#define _COMPRESSPOOL_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "constants.h" /* for compression defaults */
+#include "fileCache.h"
+
+/* This file stores everything regarding the compression pool, which
+ * gzips popular text files in the background, so that clients taking
+ * gzip get a compressed copy even when the document root has none of
+ * its own, without anything ever being compressed while a request
+ * waits on it.
+ *
+ * Every request for a file that could have used a gzip copy is counted
+ * with compressHit(); on the COMPRESS_HITSth, the file's cache entry is
+ * queued (with a reference held) for one of the pool's threads.  That
+ * thread reads the file, deflates it, and hands the result back to the
+ * file cache with cacheCompressed(), where it counts against the same
+ * memory budget as any other contents and goes away with the entry once
+ * the file changes.  Requests that arrive in the meantime get the file
+ * as it is.
+ *
+ * Only regular files between COMPRESS_FILEMIN and COMPRESS_FILEMAX bytes
+ * are compressed, and never one that has a ".gz" copy of its own.  The
+ * queue is bounded; a file that doesn't fit in it is skipped until its
+ * entry is next resolved, and so is one that doesn't get any smaller.
+ *
+ * The type "compresspool" is the pool: its threads, its queue of cache
+ * entries (a circular buffer under one mutex), and its counters.
+ */
+
+/* the pool */
+typedef struct compresspool {
+  filecache* cache;
+  pthread_t* threads;
+  int numThreads;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;       /* signaled when a job is queued */
+  cacheentry** jobs;          /* entries waiting to be compressed */
+  int head;                   /* the oldest job */
+  int count;
+  int size;
+  int stopping;
+
+  /* counters */
+  long int queued;
+  long int compressed;
+  long int dropped;           /* queue full */
+  long int failed;            /* unreadable, or no smaller */
+  long int bytesIn;
+  long int bytesOut;
+} compresspool;
+
+/* pool functions */
+compresspool* newCompressPool(filecache* cache, int numThreads,
+                              int queueSize);
+int compressHit(compresspool* pool, cacheentry* entry);
+void printCompressStats(compresspool* pool);
+void destroyCompressPool(compresspool* pool);
+
+#include "compressPool.c"
+#endif /* _COMPRESSPOOL_ */
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "conList.h"
 
@@ -43,12 +45,49 @@ connection* newConnection(int conID, instruction a) {
     return NULL;
   }
 
-  toReturn->conn   = conID;
-  toReturn->action = a;
-  toReturn->next   = NULL;
+  initConnection(toReturn, conID, a);
   return toReturn;
 }
 
+/*
+ * Fills in a connection node that the caller already has, such as one
+ * on the stack of a worker thread.
+ *
+ * @param c The node to fill in.
+ * @param conID The socket connection identifier.
+ * @param a The instruction enum for this node.
+ */
+void initConnection(connection* c, int conID, instruction a) {
+  c->conn    = conID;
+  c->action  = a;
+  c->next    = NULL;
+  c->prev    = NULL;
+  c->keepAlive  = 0;
+  c->requests   = 0;
+  c->headOnly   = 0;
+  initTimer(&(c->deadline), c);
+  c->state   = READING;
+  c->inBuf   = NULL;
+  c->inLen   = 0;
+  c->inScanned = 0;
+  c->outBuf  = NULL;
+  c->outLen  = 0;
+  c->outSent = 0;
+  c->fileDesc   = -1;
+  c->fileOffset = 0;
+  c->fileLeft   = 0;
+  c->inflight   = 0;
+  c->receiving  = 0;
+  c->sending    = 0;
+  c->inShut     = 0;
+  c->held       = NULL;
+  c->heldLen    = 0;
+  c->closing    = 0;
+  c->pipe[0]    = -1;
+  c->pipe[1]    = -1;
+  c->piped      = 0;
+}
+
 /*
  * This function returns 0 if the list has something in it, nonzero
  * if the list is EMPTY.
@@ -192,6 +231,83 @@ void printList(conlist* list) {
     node = node->next;
   }
 }
+/*
+ * Queues data on an event-driven connection, to be written out by the
+ * event loop once the socket can accept it.  The data is copied, so the
+ * caller is free to release its own copy immediately.
+ *
+ * @param c The connection on which to queue the data.
+ * @param data The data to be queued.
+ * @param length The number of bytes in data.
+ * @return 0 on success, -1 if the output buffer could not be grown.
+ */
+int appendOutput(connection* c, void* data, long int length) {
+  char* grown;
+
+  if (length <= 0) { /* nothing to do */
+    return 0;
+  }
+
+  grown = realloc(c->outBuf, sizeof(char) * (c->outLen + length));
+  if (!grown) {
+    return -1;
+  }
+
+  memcpy(grown + c->outLen, data, length);
+  c->outBuf = grown;
+  c->outLen += length;
+  return 0;
+}
+
+/*
+ * Releases the input and output buffers of an event-driven connection,
+ * along with any file it was in the middle of sending.
+ */
+void resetBuffers(connection* c) {
+  free(c->inBuf);
+  c->inBuf     = NULL;
+  c->inLen     = 0;
+  c->inScanned = 0;
+  free(c->held);
+  c->held      = NULL;
+  c->heldLen   = 0;
+  resetOutput(c);
+}
+
+/*
+ * Releases the output buffer of an event-driven connection, along with
+ * any file it was in the middle of sending, once a response is done.
+ * Input is left alone, since it may already hold the next request.
+ */
+void resetOutput(connection* c) {
+  free(c->outBuf);
+  c->outBuf  = NULL;
+  c->outLen  = 0;
+  c->outSent = 0;
+  if (c->fileDesc >= 0) {
+    close(c->fileDesc);
+  }
+  c->fileDesc   = -1;
+  c->fileOffset = 0;
+  c->fileLeft   = 0;
+}
+
+/*
+ * Drops a request from the front of a connection's input, sliding any
+ * pipelined requests behind it to the front.
+ *
+ * @param c The connection.
+ * @param length The number of bytes the request used.
+ */
+void consumeInput(connection* c, long int length) {
+  if (length > c->inLen) {
+    length = c->inLen;
+  }
+  memmove(c->inBuf, c->inBuf + length, c->inLen - length);
+  c->inLen    -= length;
+  c->inScanned = 0;
+}
+
 /*
 int main(int argc, char** argv) {
 
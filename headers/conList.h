@@ -3,6 +3,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "timerWheel.h"
 
 /* This file stores all the information regarding connection
  * lists.
@@ -14,10 +18,26 @@
  * PROCESS: Node contains a valid socket identifier to be processed.
  * SHARED: Thread should read shared memory for further instructions. 
  * TERMINATE: Thread receiving this node should terminate.
+ * EVENT: Node is owned by an event loop; responses are queued on the
+ *        node and written out as the socket becomes writable.
+ * RING: Node is owned by an io_uring event loop.  Like EVENT, but its
+ *       socket is a registered file that only the ring can use, so
+ *       responses are always queued.
+ * SHED: Node contains a socket whose client waited too long for a
+ *       worker; it should be refused rather than served.
+ *
+ * The type "connstate" tracks where an EVENT node is in its life:
+ *
+ * READING: Accumulating the request header.
+ * WRITING: Flushing the queued response.
+ * CLOSING: Finished; the event loop should close and free the node.
  *
  * The type "connection" is a single node storing a socket identifier,
  * a subsequent action to take, and a pointer to the next node in the
- * list of nodes.
+ * list of nodes.  Each carries a deadline, which whoever owns the
+ * socket keeps on a timer wheel (see timerWheel.h).  Socket nodes carry
+ * the input buffer their requests are parsed from; EVENT nodes additionally carry their output, since the
+ * event loop services them a little at a time.
  *
  * The type "conlist" is a list of connection nodes, containing a pointer
  * to both the first and last nodes in the list.
@@ -27,14 +47,56 @@
 typedef enum instruction {
   PROCESS,
   SHARED,
-  TERMINATE
+  TERMINATE,
+  EVENT,
+  RING,
+  SHED
 } instruction;
 
+/* the state of an event-driven connection */
+typedef enum connstate {
+  READING,
+  WRITING,
+  CLOSING
+} connstate;
+
 /* the connection node */
 typedef struct connection {
   int conn; /* default connection */
   instruction action;
   struct connection* next;
+  struct connection* prev; /* only used by event loops */
+
+  /* persistent connections */
+  int keepAlive;       /* leave the socket open after this response? */
+  int requests;        /* requests served on this socket so far */
+  int headOnly;        /* answering a HEAD request: headers, no body */
+  timer deadline;      /* when whatever it's waiting on must happen by */
+
+  /* requests received so far, possibly several pipelined ones */
+  char* inBuf;
+  long int inLen;
+  long int inScanned; /* how far the parser has looked (see httpParser.h) */
+
+  /* event-driven connections only */
+  connstate state;
+  char* outBuf;    /* response waiting to be written */
+  long int outLen;
+  long int outSent;
+  int fileDesc;    /* file to send after outBuf, or -1 */
+  off_t fileOffset;
+  long int fileLeft;
+
+  /* io_uring connections only */
+  int inflight;    /* requests the kernel still has */
+  int receiving;   /* a multishot receive is armed */
+  int sending;     /* output requests in flight */
+  int inShut;      /* the client has stopped sending */
+  char* held;      /* received with no room in inBuf yet, or NULL */
+  long int heldLen;
+  int closing;
+  int pipe[2];     /* for splicing the file, or -1 */
+  long int piped;  /* bytes sitting in the pipe */
 } connection;
 
 /* the list of connection nodes */
@@ -47,6 +109,7 @@ typedef struct conlist {
 /* functions */
 conlist* newConList(void);
 connection* newConnection(int conID, instruction a);
+void initConnection(connection* c, int conID, instruction a);
 void addHead(int conID, instruction a, conlist* list);
 void addTail(int conID, instruction a, conlist* list);
 connection* removeHead(conlist* list);
@@ -54,6 +117,10 @@ connection* findCon(int conID, conlist* list);
 void destroyCon(int conID, conlist* list);
 void destroyAll(conlist* list);
 void printList(conlist* list);
+int appendOutput(connection* c, void* data, long int length);
+void resetBuffers(connection* c);
+void resetOutput(connection* c);
+void consumeInput(connection* c, long int length);
 
 #include "conList.c"
 #endif /* CONLIST_H */
@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "conRing.h"
+
+/* helpers */
+static int takeSlot(conring* ring, int* conID, instruction* a, long int* stamp);
+static long int ringClock(void);
+
+/* Builds an empty ring.
+ *
+ * @param size The number of slots; rounded up to a power of two.
+ * @return A new ring, or NULL on failure.
+ */
+conring* newConRing(int size) {
+  conring* ring;
+  unsigned long slots = 1, i;
+
+  if (size <= 0) { /* sanity check */
+    return NULL;
+  }
+  while (slots < (unsigned long)size) {
+    slots <<= 1;
+  }
+
+  ring = calloc(1, sizeof(conring));
+  if (!ring) {
+    return NULL;
+  }
+  ring->slots = malloc(sizeof(conslot) * slots);
+  if (!ring->slots) {
+    free(ring);
+    return NULL;
+  }
+
+  /* slot i is ready to be filled by the i-th push */
+  for (i = 0; i < slots; i++) {
+    ring->slots[i].seq = i;
+  }
+  ring->mask = slots - 1;
+
+  return ring;
+}
+
+/* Adds a connection to the back of the ring, waking one sleeping
+ * consumer if there is one.  Safe to call from any number of threads
+ * (and from a signal handler, since it never takes a lock).
+ *
+ * @param ring The ring.
+ * @param conID The socket connection identifier.
+ * @param a The instruction for whoever pops it.
+ * @return 0 on success, -1 if the ring is full.
+ */
+int ringPush(conring* ring, int conID, instruction a) {
+  unsigned long pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+  conslot* slot;
+  long diff;
+
+  /* claim a slot */
+  while (1) {
+    slot = &(ring->slots[pos & ring->mask]);
+    diff = (long)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) { /* free; try to take it */
+      if (__atomic_compare_exchange_n(&(ring->head), &pos, pos + 1, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) { /* still holds a connection from a lap ago */
+      return -1;
+    } else { /* another producer got here first */
+      pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    }
+  }
+
+  /* fill it and hand it over */
+  slot->conn   = conID;
+  slot->action = a;
+  slot->stamp  = ringClock();
+  __atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+  /* only bother the kernel if somebody is asleep */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(ring->waiters), __ATOMIC_SEQ_CST) > 0) {
+    __atomic_add_fetch(&(ring->wakeups), 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &(ring->wakeups), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+
+  return 0;
+}
+
+/* Takes the connection at the front of the ring, if there is one.
+ *
+ * @param ring The ring.
+ * @param conID Set to the socket connection identifier.
+ * @param a Set to the connection's instruction.
+ * @return 0 on success, -1 if the ring is empty.
+ */
+int ringTryPop(conring* ring, int* conID, instruction* a) {
+  long int stamp;
+
+  return takeSlot(ring, conID, a, &stamp);
+}
+
+/* Takes the connection at the front of the ring, sleeping until one
+ * arrives if the ring is empty.
+ *
+ * @param ring The ring.
+ * @param conID Set to the socket connection identifier.
+ * @param a Set to the connection's instruction.
+ */
+void ringPop(conring* ring, int* conID, instruction* a) {
+  int seen, spins;
+
+  /* a connection usually isn't far off, so give it a moment before
+   * paying for a trip through the kernel */
+  for (spins = 0; spins < CONRING_SPINS; spins++) {
+    if (ringTryPop(ring, conID, a) == 0) {
+      return;
+    }
+    sched_yield();
+  }
+
+  while (ringTryPop(ring, conID, a) < 0) {
+    /* announce ourselves, then look once more before sleeping; any push
+     * after this point either sees us waiting or is seen by the retry */
+    __atomic_add_fetch(&(ring->waiters), 1, __ATOMIC_SEQ_CST);
+    seen = __atomic_load_n(&(ring->wakeups), __ATOMIC_SEQ_CST);
+    if (ringTryPop(ring, conID, a) == 0) {
+      __atomic_sub_fetch(&(ring->waiters), 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+
+    /* returns at once if a wakeup slipped in since we looked */
+    syscall(SYS_futex, &(ring->wakeups), FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(&(ring->waiters), 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/* Takes the connection at the front of the ring, sleeping until one
+ * arrives or the timeout runs out.
+ *
+ * @param ring The ring.
+ * @param conID Set to the socket connection identifier.
+ * @param a Set to the connection's instruction.
+ * @param timeout Milliseconds to wait at most, or -1 to wait forever.
+ * @return Microseconds the connection spent in the ring, or -1 if
+ *         nothing arrived in time.
+ */
+long int ringTimedPop(conring* ring, int* conID, instruction* a, int timeout) {
+  long int stamp, deadline = ringClock() + (long int)timeout * 1000, left;
+  struct timespec wait;
+  int seen, spins;
+
+  for (spins = 0; spins < CONRING_SPINS; spins++) {
+    if (takeSlot(ring, conID, a, &stamp) == 0) {
+      return ringClock() - stamp;
+    }
+    sched_yield();
+  }
+
+  while (takeSlot(ring, conID, a, &stamp) < 0) {
+    left = deadline - ringClock();
+    if (timeout >= 0 && left <= 0) {
+      return -1;
+    }
+    wait.tv_sec  = left / 1000000;
+    wait.tv_nsec = (left % 1000000) * 1000;
+
+    /* the same dance as ringPop(), with a limit on the sleep */
+    __atomic_add_fetch(&(ring->waiters), 1, __ATOMIC_SEQ_CST);
+    seen = __atomic_load_n(&(ring->wakeups), __ATOMIC_SEQ_CST);
+    if (takeSlot(ring, conID, a, &stamp) == 0) {
+      __atomic_sub_fetch(&(ring->waiters), 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    syscall(SYS_futex, &(ring->wakeups), FUTEX_WAIT_PRIVATE, seen,
+            (timeout >= 0 ? &wait : NULL), NULL, 0);
+    __atomic_sub_fetch(&(ring->waiters), 1, __ATOMIC_SEQ_CST);
+  }
+
+  return ringClock() - stamp;
+}
+
+/*
+ * Returns roughly how many connections are waiting in the ring.  The
+ * answer may be stale by the time the caller looks at it.
+ */
+long int ringDepth(conring* ring) {
+  unsigned long head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+  unsigned long tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+
+  return (head > tail ? (long int)(head - tail) : 0);
+}
+
+/*
+ * Kills the ring.  Any sockets still in it are NOT closed.
+ * NOTE: Nobody may be using the ring when this is called!
+ */
+void destroyConRing(conring* ring) {
+  free(ring->slots);
+  free(ring);
+}
+
+/* Claims the connection at the front of the ring, as ringTryPop(), and
+ * also hands back when it was pushed.
+ */
+static int takeSlot(conring* ring, int* conID, instruction* a, long int* stamp) {
+  unsigned long pos = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+  conslot* slot;
+  long diff;
+
+  /* claim a slot */
+  while (1) {
+    slot = &(ring->slots[pos & ring->mask]);
+    diff = (long)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) { /* filled; try to take it */
+      if (__atomic_compare_exchange_n(&(ring->tail), &pos, pos + 1, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) { /* nothing there yet */
+      return -1;
+    } else { /* another consumer got here first */
+      pos = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+    }
+  }
+
+  /* empty it and hand it back to the producers, one lap later */
+  *conID = slot->conn;
+  *a     = slot->action;
+  *stamp = slot->stamp;
+  __atomic_store_n(&(slot->seq), pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* The time, in microseconds, on a clock that never goes backwards. */
+static long int ringClock(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
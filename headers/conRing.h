@@ -0,0 +1,67 @@
+#ifndef CONRING_H
+#define CONRING_H
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "constants.h" /* for CACHELINE */
+#include "conList.h"   /* for instruction */
+
+/* This file stores everything regarding connection rings, the queues
+ * that hand freshly accepted sockets from an accepting thread to the
+ * worker threads.
+ *
+ * A conring is a bounded multi-producer, multi-consumer ring in the
+ * style of Dmitry Vyukov's: every slot carries a sequence number that
+ * says whether it is ready to be filled or ready to be emptied, so
+ * producers and consumers each claim a slot with one compare-and-swap
+ * and never take a lock.  Slots hold the socket and instruction by
+ * value, so nothing is allocated per connection.
+ *
+ * Workers that find the ring empty yield a few times, then sleep on a
+ * futex.  Producers only make a system call when somebody is actually
+ * asleep, and then wake exactly one of them, rather than every idle
+ * worker.
+ *
+ * Every slot also records when it was filled, so whoever empties it can
+ * tell how long the connection sat waiting for a worker.
+ *
+ * The type "conslot" is a single slot of the ring.
+ *
+ * The type "conring" is the ring itself.  The producer and consumer
+ * positions are kept on separate cache lines, so the two sides don't
+ * fight over the same line.
+ */
+
+/* a single slot */
+typedef struct conslot {
+  unsigned long seq;    /* where the slot is in its fill/empty cycle */
+  int conn;
+  instruction action;
+  long int stamp;       /* when it was filled, in microseconds */
+} conslot;
+
+/* the ring */
+typedef struct conring {
+  conslot* slots;
+  unsigned long mask;   /* number of slots - 1 */
+  char pad0[CACHELINE];
+  unsigned long head;   /* next position to push */
+  char pad1[CACHELINE];
+  unsigned long tail;   /* next position to pop */
+  char pad2[CACHELINE];
+  int waiters;          /* consumers asleep, or about to be */
+  int wakeups;          /* futex word, bumped on every wakeup */
+} conring;
+
+/* functions */
+conring* newConRing(int size);
+int ringPush(conring* ring, int conID, instruction a);
+int ringTryPop(conring* ring, int* conID, instruction* a);
+void ringPop(conring* ring, int* conID, instruction* a);
+long int ringTimedPop(conring* ring, int* conID, instruction* a, int timeout);
+long int ringDepth(conring* ring);
+void destroyConRing(conring* ring);
+
+#include "conRing.c"
+#endif /* CONRING_H */
@@ -6,11 +6,105 @@
 #define SERVER_NAME "Squinn!"
 #define SERVER_URL "http://www.magsolweb.net"
 #define VERSION "v1.5"
-#define PROTOCOL "HTTP/1.0"
+#define PROTOCOL "HTTP/1.1"
 #define EOL "\r\n"
-#define MAXCONNECTIONS_SERVER 10
+#define MAXCONNECTIONS_SERVER 511	/* listen() backlog, unless -l says otherwise */
 #define MAXCONNECTIONS_PROXY 10
 #define NUMACCESSES 10
+#define MAXREQUEST 20000
+#define MAXFIELDS 64	/* header fields kept per request */
+#define HEADERCHUNK 4096	/* bytes read at a time by recvHeader() */
+
+/* persistent connection defaults */
+
+#define KEEPALIVE_TIMEOUT 5
+#define KEEPALIVE_MAX 100
+
+/* connection deadlines, and what each is for */
+
+#define HEADER_TIMEOUT 10	/* seconds for a whole request header to arrive */
+#define WRITE_TIMEOUT 30	/* seconds a response can go without progress */
+#define ORIGIN_TIMEOUT 30	/* seconds the proxy waits on an origin server */
+#define DEADLINE_HEADER 1
+#define DEADLINE_WRITE 2
+#define DEADLINE_IDLE 3
+#define DEADLINE_ORIGIN 4
+#define DEADLINES 5		/* one more than the last of them */
+#define WHEEL_TICK 250		/* milliseconds */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS 64		/* 1 << WHEEL_BITS */
+#define WHEEL_LEVELS 4
+
+/* handoff constants */
+
+#define HANDOFF_ENV "SQUINN_HANDOFF"	/* names the new server's handoff socket */
+#define HANDOFF_FD 3
+#define HANDOFF_WAIT 10		/* seconds the two servers wait on each other */
+#define DRAIN_TIMEOUT 30	/* seconds a replaced server has to finish up */
+
+/* file cache defaults */
+
+#define CACHE_SHARDS 16
+#define CACHE_ENTRIES 512
+#define CACHE_INTERVAL 1
+#define CACHE_MEMORY 16		/* megabytes of file contents */
+#define CACHE_FILEMAX 65536	/* largest file kept in memory */
+
+/* background compression defaults */
+
+#define COMPRESS_THREADS 1
+#define COMPRESS_QUEUE 64	/* files waiting to be compressed */
+#define COMPRESS_HITS 3		/* requests before a file is compressed */
+#define COMPRESS_FILEMIN 256	/* smaller files aren't worth it */
+#define COMPRESS_FILEMAX 1048576	/* bigger ones take too long */
+#define COMPRESS_LEVEL 6
+
+/* per-request scratch memory */
+
+#define ARENA_SIZE 4096		/* bytes each worker starts out with */
+#define ARENA_KEEP 65536	/* most bytes kept between requests */
+#define HEADERSLACK 128		/* header bytes beyond its variable parts */
+
+/* byte range limits */
+
+#define MAXRANGES 16		/* ranges honored in one request */
+#define RANGE_MULTIMAX 1048576	/* largest multipart/byteranges body */
+
+/* worker pool defaults */
+
+#define POOL_IDLE 30		/* seconds before an idle worker retires */
+#define POOL_GROW_DEPTH 4	/* queued connections that call for a worker */
+#define POOL_GROW_WAIT 10	/* ...or milliseconds one of them waited */
+
+/* load shedding defaults (see workerPool.h) */
+
+#define SHED_TARGET 50		/* milliseconds a connection may wait in a standing queue */
+#define SHED_INTERVAL 500	/* milliseconds before a queue that won't empty is standing */
+
+/* sharded server constants */
+
+#define CONRING_SIZE 1024	/* connections queued per shard */
+#define CONRING_SPINS 8	/* yields before a worker sleeps */
+#define CACHELINE 64
+#define CPU_MASK_WORDS 16	/* affinity mask size, in longs */
+
+/* most error pages rendered at startup */
+
+#define MAXERRORPAGES 32
+
+/* event loop constants */
+
+#define MAXEVENTS 256
+#define EPOLL_TIMEOUT 1000
+#define ACCEPT_BACKOFF 100	/* ms to hold off accepting when out of descriptors */
+
+/* io_uring event loop constants */
+
+#define URING_ENTRIES 256	/* requests queued per pass before submitting */
+#define URING_FILES 4096	/* registered sockets per loop */
+#define URING_BUFS 256		/* provided receive buffers; a power of two */
+#define URING_BUFSIZE 4096
+#define URING_SPLICE 65536	/* file bytes moved per splice; one pipe's worth */
 
 /* shared memory constants */
 
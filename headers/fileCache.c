@@ -0,0 +1,929 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "fileCache.h"
+
+/* glibc only shows this one off with _GNU_SOURCE */
+#ifndef O_PATH
+#define O_PATH 010000000
+#endif
+
+/* helpers */
+static unsigned long hashPath(char* path);
+static cacheentry* findEntry(filecache* cache, cacheshard* shard,
+                             char* path, unsigned long hash);
+static cacheentry* resolvePath(filecache* cache, char* path,
+                               unsigned long hash);
+static int isCurrent(filecache* cache, cacheentry* entry);
+static int openBeneath(int rootfd, char* path, int flags);
+static void setValidators(cacheentry* entry);
+static void findVariants(filecache* cache, cacheentry* entry);
+static int variantsCurrent(filecache* cache, cacheentry* entry);
+static void linkEntry(filecache* cache, cacheshard* shard, cacheentry* entry);
+static void unlinkEntry(filecache* cache, cacheshard* shard, cacheentry* entry);
+static void touchEntry(cacheshard* shard, cacheentry* entry);
+static void freeEntry(cacheentry* entry);
+static char* keepHeader(filecache* cache, cacheentry* entry, char** slot,
+                        long int* slotLen, char* header, long int headerLen);
+static int fillContents(filecache* cache, cacheentry* entry, int fd,
+                        long int size, char** slot, long int* slotLen);
+static int keepContents(filecache* cache, cacheentry* entry, char** slot,
+                        long int* slotLen, char* contents, long int size);
+static long int entryMemory(cacheentry* entry);
+static long int dropContents(cacheentry* entry);
+
+/* cleared the first time openat2() turns out not to exist */
+static int haveOpenat2 = 1;
+
+/* indexed by CODING_BR, CODING_GZIP */
+char* codingNames[NUMCODINGS] = { "br", "gzip" };
+char* codingSuffixes[NUMCODINGS] = { ".br", ".gz" };
+
+/* Builds an empty file cache.
+ *
+ * @param numShards The number of independently locked shards.
+ * @param maxEntries The total number of paths the cache may hold; this
+ *                   is split evenly between the shards.  0 disables
+ *                   caching, in which case every lookup is a miss.
+ * @param interval Seconds an entry is trusted before it is checked
+ *                 against the disk again.
+ * @param memLimit The total number of bytes of file contents the cache
+ *                 may hold in memory; 0 disables content caching.
+ * @param rootfd A descriptor for the document root; every path is
+ *               resolved beneath it.  The cache closes it when destroyed.
+ * @return A new file cache, or NULL on failure.
+ */
+filecache* newFileCache(int numShards, int maxEntries, int interval,
+                        long int memLimit, int rootfd) {
+  filecache* cache;
+  int i;
+
+  if (numShards <= 0 || maxEntries < 0 || memLimit < 0 || rootfd < 0) { /* sanity check */
+    return NULL;
+  }
+
+  cache = malloc(sizeof(filecache));
+  if (!cache) {
+    return NULL;
+  }
+
+  /* tiny caches don't need every shard */
+  if (maxEntries > 0 && maxEntries < numShards) {
+    numShards = maxEntries;
+  }
+
+  cache->numShards  = numShards;
+  cache->maxEntries = (maxEntries + numShards - 1) / numShards;
+  cache->numBuckets = (cache->maxEntries > 0 ? cache->maxEntries : 1);
+  cache->interval   = interval;
+  cache->memLimit   = memLimit / numShards;
+  cache->rootfd     = rootfd;
+  cache->shards     = calloc(numShards, sizeof(cacheshard));
+  if (!cache->shards) {
+    free(cache);
+    return NULL;
+  }
+
+  for (i = 0; i < numShards; i++) {
+    cacheshard* shard = &(cache->shards[i]);
+    if (pthread_mutex_init(&(shard->mutex), NULL) != 0) {
+      break;
+    }
+    if (!(shard->buckets = calloc(cache->numBuckets, sizeof(cacheentry*)))) {
+      pthread_mutex_destroy(&(shard->mutex));
+      break;
+    }
+  }
+
+  if (i < numShards) { /* undo the shards that were set up */
+    #ifdef DEBUG
+      printf("fileCache.c: Unable to initialize shard %d!\n", i);
+    #endif
+
+    while (--i >= 0) {
+      free(cache->shards[i].buckets);
+      pthread_mutex_destroy(&(cache->shards[i].mutex));
+    }
+    free(cache->shards);
+    free(cache);
+    return NULL;
+  }
+
+  return cache;
+}
+
+/* Resolves a request path, either from the cache or from the disk.
+ * The entry's error field should be checked first: if it is nonzero,
+ * the path could not be resolved and it holds the reason (ENOENT and
+ * the like mean the file doesn't exist, EACCES that it can't be read).
+ *
+ * @param cache The file cache.
+ * @param path The decoded path, relative to the document root.
+ * @return The entry for the path, which must be handed back with
+ *         cacheRelease(), or NULL if memory could not be allocated.
+ */
+cacheentry* cacheLookup(filecache* cache, char* path) {
+  unsigned long hash = hashPath(path);
+  cacheshard* shard = &(cache->shards[hash % cache->numShards]);
+  cacheentry* entry;
+  time_t now = time(NULL);
+  int current;
+
+  pthread_mutex_lock(&(shard->mutex));
+  entry = findEntry(cache, shard, path, hash);
+  if (entry && now - entry->validated < cache->interval) { /* fresh hit */
+    shard->hits++;
+    entry->refs++;
+    touchEntry(shard, entry);
+    pthread_mutex_unlock(&(shard->mutex));
+    return entry;
+  }
+
+  if (entry) { /* hit, but it's time to check the disk again */
+    entry->refs++;
+    pthread_mutex_unlock(&(shard->mutex));
+    current = isCurrent(cache, entry);
+    pthread_mutex_lock(&(shard->mutex));
+
+    if (current) {
+      shard->hits++;
+      entry->validated = now;
+      if (entry->linked) {
+        touchEntry(shard, entry);
+      }
+      pthread_mutex_unlock(&(shard->mutex));
+      return entry;
+    }
+
+    /* the file changed underneath us; forget about it */
+    shard->invalidations++;
+    entry->refs--;
+    if (entry->linked) {
+      unlinkEntry(cache, shard, entry);
+    } else if (entry->refs == 0) {
+      freeEntry(entry);
+    }
+  }
+  pthread_mutex_unlock(&(shard->mutex));
+
+  /* a miss; go to the disk without holding up the rest of the shard */
+  if (!(entry = resolvePath(cache, path, hash))) {
+    return NULL;
+  }
+  entry->refs = 1;
+
+  pthread_mutex_lock(&(shard->mutex));
+  shard->misses++;
+  if (cache->maxEntries > 0) {
+    linkEntry(cache, shard, entry);
+  }
+  pthread_mutex_unlock(&(shard->mutex));
+
+  return entry;
+}
+
+/* Keeps a copy of the response header for a regular file, so that it
+ * only ever has to be formatted once.  If another thread got there
+ * first, its copy wins.
+ *
+ * @param cache The file cache.
+ * @param entry An entry held by the caller.
+ * @param header The formatted header.
+ * @param headerLen The length in bytes of header.
+ * @return The entry's header, or NULL if it couldn't be stored.
+ */
+char* cacheHeader(filecache* cache, cacheentry* entry, char* header,
+                  long int headerLen) {
+  return keepHeader(cache, entry, &(entry->header), &(entry->headerLen),
+                    header, headerLen);
+}
+
+/* Loads a small regular file into memory, so that later requests can
+ * be answered from entry->contents alone.  The file is read without
+ * holding the shard, and the contents of the least recently used
+ * entries are dropped if the shard's memory budget would otherwise be
+ * exceeded.
+ *
+ * @param cache The file cache.
+ * @param entry An entry held by the caller.
+ * @return 1 if entry->contents is ready to be sent, 0 if the file is
+ *         too big, doesn't fit, or couldn't be read.
+ */
+int cacheFill(filecache* cache, cacheentry* entry) {
+  if (!S_ISREG(entry->sb.st_mode)) {
+    return 0;
+  }
+
+  return fillContents(cache, entry, entry->fd, entry->sb.st_size,
+                      &(entry->contents), &(entry->contentsLen));
+}
+
+/* cacheHeader() for one of a file's compressed copies.
+ *
+ * @param cache The file cache.
+ * @param entry An entry held by the caller.
+ * @param coding The copy's coding, CODING_BR or CODING_GZIP.
+ * @param header The formatted header.
+ * @param headerLen The length in bytes of header.
+ * @return The copy's header, or NULL if it couldn't be stored.
+ */
+char* cacheVariantHeader(filecache* cache, cacheentry* entry, int coding,
+                         char* header, long int headerLen) {
+  cachevariant* variant = &(entry->variants[coding]);
+
+  return keepHeader(cache, entry, &(variant->header), &(variant->headerLen),
+                    header, headerLen);
+}
+
+/* cacheFill() for one of a file's compressed copies, which shares the
+ * entry's memory budget and is dropped along with it.
+ *
+ * @param cache The file cache.
+ * @param entry An entry held by the caller.
+ * @param coding The copy's coding, CODING_BR or CODING_GZIP.
+ * @return 1 if the copy's contents are ready to be sent, 0 otherwise.
+ */
+int cacheFillVariant(filecache* cache, cacheentry* entry, int coding) {
+  cachevariant* variant = &(entry->variants[coding]);
+
+  return fillContents(cache, entry, variant->fd, variant->size,
+                      &(variant->contents), &(variant->contentsLen));
+}
+
+/* Keeps a compressed copy of a regular file that was made in memory,
+ * in place of a copy on disk.  Its ETag is the file's with the coding
+ * tacked on.
+ *
+ * @param cache The file cache.
+ * @param entry An entry held by the caller.
+ * @param coding The copy's coding, CODING_BR or CODING_GZIP.
+ * @param contents The copy, allocated with malloc().  If it is kept, the
+ *                 cache owns it from then on; if not, the caller still does.
+ * @param len The length in bytes of contents.
+ * @return 1 if the copy was kept, 0 if there already is one, it doesn't
+ *         fit, or the entry has been evicted.
+ */
+int cacheCompressed(filecache* cache, cacheentry* entry, int coding,
+                    char* contents, long int len) {
+  cachevariant* variant = &(entry->variants[coding]);
+
+  if (!S_ISREG(entry->sb.st_mode) || variant->found ||
+      cacheSlot(&(variant->contents)) || len > cache->memLimit) {
+    return 0;
+  }
+
+  /* both are the same whoever writes them, so set them ahead of time */
+  variant->size = len;
+  snprintf(variant->etag, sizeof(variant->etag), "%.*s-%s\"",
+           (int)strlen(entry->etag) - 1, entry->etag, codingNames[coding]);
+
+  if (!keepContents(cache, entry, &(variant->contents),
+                    &(variant->contentsLen), contents, len)) {
+    return 0;
+  }
+  __sync_add_and_fetch(&(entry->numVariants), 1);
+
+  return 1;
+}
+
+/* Takes another reference to an entry the caller already holds, for
+ * handing it to another thread; that one gives it back with
+ * cacheRelease().
+ *
+ * @param cache The file cache.
+ * @param entry An entry held by the caller.
+ */
+void cacheHold(filecache* cache, cacheentry* entry) {
+  cacheshard* shard = &(cache->shards[entry->hash % cache->numShards]);
+
+  pthread_mutex_lock(&(shard->mutex));
+  entry->refs++;
+  pthread_mutex_unlock(&(shard->mutex));
+}
+
+/* Reads one of an entry's header or contents slots, for a caller
+ * holding the entry but not its shard.  Whatever the slot points to
+ * was filled in before it was put there, and stays put as long as the
+ * entry is held, so a contents slot's length can be read after it.
+ *
+ * @param slot The slot, e.g. &(entry->contents).
+ * @return What's in it, or NULL.
+ */
+char* cacheSlot(char** slot) {
+  return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+/* Keeps the rendered listing page for a directory, so that later
+ * requests can be answered from entry->contents alone.  Pages count
+ * against the same memory budget as file contents.
+ *
+ * @param cache The file cache.
+ * @param entry An entry held by the caller.
+ * @param page The page, allocated with malloc().  If it is kept, the
+ *             cache owns it from then on; if not, the caller still does.
+ * @param pageLen The length in bytes of page.
+ * @return 1 if the page was kept, 0 otherwise.  Either way, if
+ *         entry->contents is set it holds the page to send (another
+ *         thread's, if it got there first).
+ */
+int cacheListing(filecache* cache, cacheentry* entry, char* page,
+                 long int pageLen) {
+  if (!S_ISDIR(entry->sb.st_mode) || pageLen > cache->memLimit) {
+    return 0;
+  }
+
+  return keepContents(cache, entry, &(entry->contents), &(entry->contentsLen),
+                      page, pageLen);
+}
+
+
+/* Hands an entry back to the cache once the caller is finished with
+ * it (and with its descriptor).
+ *
+ * @param cache The file cache.
+ * @param entry The entry returned by cacheLookup().
+ */
+void cacheRelease(filecache* cache, cacheentry* entry) {
+  cacheshard* shard = &(cache->shards[entry->hash % cache->numShards]);
+
+  pthread_mutex_lock(&(shard->mutex));
+  entry->refs--;
+  if (!entry->linked && entry->refs == 0) { /* evicted while in use */
+    freeEntry(entry);
+  }
+  pthread_mutex_unlock(&(shard->mutex));
+}
+
+/* Prints the cache's counters, summed over every shard, so that its
+ * size can be tuned.
+ *
+ * @param cache The file cache.
+ */
+void printCacheStats(filecache* cache) {
+  long int hits = 0, misses = 0, evictions = 0, invalidations = 0, memUsed = 0;
+  int i, entries = 0;
+
+  for (i = 0; i < cache->numShards; i++) {
+    cacheshard* shard = &(cache->shards[i]);
+    pthread_mutex_lock(&(shard->mutex));
+    entries       += shard->numEntries;
+    hits          += shard->hits;
+    misses        += shard->misses;
+    evictions     += shard->evictions;
+    invalidations += shard->invalidations;
+    memUsed       += shard->memUsed;
+    pthread_mutex_unlock(&(shard->mutex));
+  }
+
+  printf("File cache: %d/%d entries, %ld hits, %ld misses (%.1f%% hit rate), %ld evictions, %ld invalidations\n",
+         entries, cache->maxEntries * cache->numShards, hits, misses,
+         (hits + misses ? (100.0 * hits) / (hits + misses) : 0.0),
+         evictions, invalidations);
+  printf("File cache: %ld/%ld KB of file contents and listings in memory\n",
+         memUsed / 1024, (cache->memLimit * cache->numShards) / 1024);
+  printf("File cache: paths resolved with %s\n",
+         (haveOpenat2 ? "openat2(RESOLVE_BENEATH)" : "openat()"));
+}
+
+/* Kills the entire cache, closing every descriptor it holds.
+ * NOTE: Nobody may be holding an entry when this is called!
+ */
+void destroyFileCache(filecache* cache) {
+  int i;
+
+  for (i = 0; i < cache->numShards; i++) {
+    cacheshard* shard = &(cache->shards[i]);
+    while (shard->oldest) {
+      unlinkEntry(cache, shard, shard->oldest);
+    }
+    free(shard->buckets);
+    pthread_mutex_destroy(&(shard->mutex));
+  }
+
+  close(cache->rootfd);
+  free(cache->shards);
+  free(cache);
+}
+
+/* The djb2 string hash. */
+static unsigned long hashPath(char* path) {
+  unsigned long hash = 5381;
+  int ch;
+
+  while ((ch = *path++)) {
+    hash = ((hash << 5) + hash) + ch;
+  }
+
+  return hash;
+}
+
+/* Finds the cached entry for a path within a shard, or NULL.
+ * NOTE: Lock the shard before calling this function!
+ */
+static cacheentry* findEntry(filecache* cache, cacheshard* shard,
+                             char* path, unsigned long hash) {
+  cacheentry* entry = shard->buckets[(hash / cache->numShards) % cache->numBuckets];
+
+  while (entry) {
+    if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+    entry = entry->chain;
+  }
+
+  return NULL;
+}
+
+/* Builds a brand new entry for the path by asking the disk about it.
+ * Regular files and directories are opened as well, so that the
+ * descriptor is ready to send from (or list).  Anything else, a FIFO
+ * for instance, is described but not kept open.
+ *
+ * @return The new entry (with no references), or NULL on failure.
+ */
+static cacheentry* resolvePath(filecache* cache, char* path,
+                               unsigned long hash) {
+  cacheentry* entry = calloc(1, sizeof(cacheentry));
+  int fd, i;
+
+  if (!entry) {
+    return NULL;
+  }
+
+  if (!(entry->path = strdup(path))) {
+    free(entry);
+    return NULL;
+  }
+  entry->hash      = hash;
+  entry->fd        = -1;
+  entry->validated = time(NULL);
+  for (i = 0; i < NUMCODINGS; i++) {
+    entry->variants[i].fd = -1;
+  }
+
+  /* O_NONBLOCK so that opening a FIFO doesn't hang the thread */
+  if ((fd = openBeneath(cache->rootfd, path, O_RDONLY | O_NONBLOCK)) < 0) {
+    entry->error = errno;
+
+    /* there, but unreadable; it still gets described */
+    if (entry->error == EACCES &&
+        (fd = openBeneath(cache->rootfd, path, O_PATH)) >= 0) {
+      fstat(fd, &(entry->sb));
+      close(fd);
+    }
+  } else if (fstat(fd, &(entry->sb)) < 0) {
+    entry->error = errno;
+    close(fd);
+  } else if (S_ISREG(entry->sb.st_mode) || S_ISDIR(entry->sb.st_mode)) {
+    entry->fd = fd;
+    setValidators(entry);
+    findVariants(cache, entry);
+  } else {
+    close(fd);
+  }
+
+  return entry;
+}
+
+/* Checks whether an entry still matches what's on the disk.
+ *
+ * @return 1 if the entry can still be used, 0 if it is out of date.
+ */
+static int isCurrent(filecache* cache, cacheentry* entry) {
+  struct stat sb;
+  int fd = openBeneath(cache->rootfd, entry->path, O_PATH), error;
+
+  if (fd < 0) { /* still missing? */
+    return (entry->error != 0 && entry->error == errno);
+  }
+  error = fstat(fd, &sb);
+  close(fd);
+
+  return (error == 0 && entry->error == 0 &&
+          sb.st_dev == entry->sb.st_dev &&
+          sb.st_ino == entry->sb.st_ino &&
+          sb.st_size == entry->sb.st_size &&
+          sb.st_mtim.tv_sec == entry->sb.st_mtim.tv_sec &&
+          sb.st_mtim.tv_nsec == entry->sb.st_mtim.tv_nsec &&
+          variantsCurrent(cache, entry));
+}
+
+/* Formats the validators for a freshly resolved file.  The ETag changes
+ * whenever the file is replaced, resized, or touched, which is exactly
+ * when isCurrent() throws the entry out.
+ */
+static void setValidators(cacheentry* entry) {
+  struct tm tm;
+
+  if (S_ISREG(entry->sb.st_mode)) {
+    snprintf(entry->etag, sizeof(entry->etag), "\"%lx-%lx-%lx.%lx\"",
+             (unsigned long)entry->sb.st_ino, (unsigned long)entry->sb.st_size,
+             (unsigned long)entry->sb.st_mtim.tv_sec,
+             (unsigned long)entry->sb.st_mtim.tv_nsec);
+  }
+  if (gmtime_r(&(entry->sb.st_mtime), &tm)) {
+    strftime(entry->lastModified, sizeof(entry->lastModified),
+             "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  }
+}
+
+/* Looks for precompressed copies of a freshly resolved regular file,
+ * "file.br" and "file.gz", and keeps a descriptor for each one that
+ * is smaller than the file.  Files that are themselves compressed
+ * copies aren't looked at.  Each copy's ETag is built from its own
+ * inode, size, and modification time, with the coding tacked on.
+ */
+static void findVariants(filecache* cache, cacheentry* entry) {
+  char name[4096];
+  long int len = strlen(entry->path);
+  cachevariant* variant;
+  int i, fd;
+
+  if (!S_ISREG(entry->sb.st_mode)) {
+    return;
+  }
+  for (i = 0; i < NUMCODINGS; i++) {
+    long int suffixLen = strlen(codingSuffixes[i]);
+    if (len >= suffixLen &&
+        strcmp(entry->path + len - suffixLen, codingSuffixes[i]) == 0) {
+      return;
+    }
+  }
+
+  for (i = 0; i < NUMCODINGS; i++) {
+    variant = &(entry->variants[i]);
+    if (snprintf(name, sizeof(name), "%s%s", entry->path,
+                 codingSuffixes[i]) >= (int)sizeof(name) ||
+        (fd = openBeneath(cache->rootfd, name, O_RDONLY | O_NONBLOCK)) < 0) {
+      continue;
+    }
+    if (fstat(fd, &(variant->sb)) < 0 || !S_ISREG(variant->sb.st_mode)) {
+      memset(&(variant->sb), 0, sizeof(variant->sb));
+      close(fd);
+      continue;
+    }
+
+    /* there, but only worth sending if it saves something */
+    variant->found = 1;
+    if (variant->sb.st_size >= entry->sb.st_size) {
+      close(fd);
+      continue;
+    }
+    variant->fd   = fd;
+    variant->size = variant->sb.st_size;
+    snprintf(variant->etag, sizeof(variant->etag), "\"%lx-%lx-%lx.%lx-%s\"",
+             (unsigned long)variant->sb.st_ino,
+             (unsigned long)variant->sb.st_size,
+             (unsigned long)variant->sb.st_mtim.tv_sec,
+             (unsigned long)variant->sb.st_mtim.tv_nsec, codingNames[i]);
+    entry->numVariants++;
+  }
+}
+
+/* Checks whether a file's compressed copies are still the ones found
+ * when it was resolved: none added, none removed, none changed.
+ *
+ * @return 1 if they are, 0 if the entry is out of date.
+ */
+static int variantsCurrent(filecache* cache, cacheentry* entry) {
+  char name[4096];
+  cachevariant* variant;
+  struct stat sb;
+  int i, fd, found;
+
+  if (!S_ISREG(entry->sb.st_mode)) {
+    return 1;
+  }
+
+  for (i = 0; i < NUMCODINGS; i++) {
+    variant = &(entry->variants[i]);
+    snprintf(name, sizeof(name), "%s%s", entry->path, codingSuffixes[i]);
+    found = 0;
+    if ((fd = openBeneath(cache->rootfd, name, O_PATH)) >= 0) {
+      found = (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode));
+      close(fd);
+    }
+
+    if (found != variant->found) {
+      return 0;
+    }
+    if (found && (sb.st_dev != variant->sb.st_dev ||
+                  sb.st_ino != variant->sb.st_ino ||
+                  sb.st_size != variant->sb.st_size ||
+                  sb.st_mtim.tv_sec != variant->sb.st_mtim.tv_sec ||
+                  sb.st_mtim.tv_nsec != variant->sb.st_mtim.tv_nsec)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Opens a path relative to the document root, letting the kernel make
+ * sure it stays there: with RESOLVE_BENEATH, "..", absolute symbolic
+ * links, and anything else that would lead outside the root fail with
+ * EXDEV, and RESOLVE_NO_MAGICLINKS refuses /proc style links.  Without
+ * openat2(), this falls back on openat(), leaving the request path
+ * checks as the only guard.
+ *
+ * @param rootfd The document root.
+ * @param path The path, relative to the root.
+ * @param flags The open() flags; O_CLOEXEC is always added.
+ * @return The new descriptor, or -1 with errno set.
+ */
+static int openBeneath(int rootfd, char* path, int flags) {
+#ifdef SYS_openat2
+  if (haveOpenat2) {
+    struct open_how how;
+    int fd;
+
+    memset(&how, 0, sizeof(how));
+    how.flags   = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    if ((fd = syscall(SYS_openat2, rootfd, path, &how, sizeof(how))) >= 0 ||
+        errno != ENOSYS) {
+      return fd;
+    }
+    haveOpenat2 = 0; /* an older kernel */
+  }
+#endif
+
+  return openat(rootfd, path, flags | O_CLOEXEC);
+}
+
+/* Adds an entry to a shard as its most recently used, replacing any
+ * existing entry for the same path and evicting the least recently
+ * used entries if the shard is full.
+ * NOTE: Lock the shard before calling this function!
+ */
+static void linkEntry(filecache* cache, cacheshard* shard, cacheentry* entry) {
+  cacheentry* old;
+  cacheentry** bucket;
+
+  /* another thread may have beaten us to it */
+  if ((old = findEntry(cache, shard, entry->path, entry->hash))) {
+    unlinkEntry(cache, shard, old);
+  }
+
+  bucket = &(shard->buckets[(entry->hash / cache->numShards) % cache->numBuckets]);
+  entry->chain = *bucket;
+  *bucket = entry;
+
+  entry->older = shard->newest;
+  entry->newer = NULL;
+  if (shard->newest) {
+    shard->newest->newer = entry;
+  } else {
+    shard->oldest = entry;
+  }
+  shard->newest = entry;
+  entry->linked = 1;
+  shard->numEntries++;
+
+  /* make room */
+  while (shard->numEntries > cache->maxEntries) {
+    unlinkEntry(cache, shard, shard->oldest);
+    shard->evictions++;
+  }
+}
+
+/* Takes an entry out of a shard.  The entry is freed right away unless
+ * somebody still holds it, in which case the last cacheRelease() does.
+ * NOTE: Lock the shard before calling this function!
+ */
+static void unlinkEntry(filecache* cache, cacheshard* shard, cacheentry* entry) {
+  cacheentry** link = &(shard->buckets[(entry->hash / cache->numShards) % cache->numBuckets]);
+
+  /* out of the hash chain */
+  while (*link && *link != entry) {
+    link = &((*link)->chain);
+  }
+  if (*link) {
+    *link = entry->chain;
+  }
+
+  /* out of the LRU list */
+  if (entry->newer) {
+    entry->newer->older = entry->older;
+  } else {
+    shard->newest = entry->older;
+  }
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    shard->oldest = entry->newer;
+  }
+
+  entry->linked = 0;
+  shard->numEntries--;
+  shard->memUsed -= entryMemory(entry);
+
+  if (entry->refs == 0) {
+    freeEntry(entry);
+  }
+}
+
+/* Marks an entry as the most recently used in its shard.
+ * NOTE: Lock the shard before calling this function!
+ */
+static void touchEntry(cacheshard* shard, cacheentry* entry) {
+  if (shard->newest == entry) { /* already there */
+    return;
+  }
+
+  /* unhook it (it has a newer neighbor, since it isn't the newest) */
+  entry->newer->older = entry->older;
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    shard->oldest = entry->newer;
+  }
+
+  /* and put it at the front */
+  entry->older = shard->newest;
+  entry->newer = NULL;
+  shard->newest->newer = entry;
+  shard->newest = entry;
+}
+
+/* Keeps a copy of a formatted header in one of an entry's header
+ * slots (the file's own, or one of its compressed copies').  If
+ * another thread got there first, its copy wins.
+ *
+ * @return The header in the slot, or NULL if it couldn't be stored.
+ */
+static char* keepHeader(filecache* cache, cacheentry* entry, char** slot,
+                        long int* slotLen, char* header, long int headerLen) {
+  cacheshard* shard = &(cache->shards[entry->hash % cache->numShards]);
+  char* copy;
+
+  if ((copy = cacheSlot(slot))) { /* somebody already did the work */
+    return copy;
+  }
+  if (!(copy = malloc(headerLen))) {
+    return NULL;
+  }
+  memcpy(copy, header, headerLen);
+
+  pthread_mutex_lock(&(shard->mutex));
+  if (*slot) {
+    free(copy);
+  } else {
+    *slotLen = headerLen;
+    __atomic_store_n(slot, copy, __ATOMIC_RELEASE);
+  }
+  copy = *slot;
+  pthread_mutex_unlock(&(shard->mutex));
+
+  return copy;
+}
+
+/* Reads a small regular file (or compressed copy) into one of an
+ * entry's contents slots.  The file is read without holding the shard.
+ *
+ * @return 1 if the slot is ready to be sent, 0 if the file is too big,
+ *         doesn't fit, or couldn't be read.
+ */
+static int fillContents(filecache* cache, cacheentry* entry, int fd,
+                        long int size, char** slot, long int* slotLen) {
+  char* contents;
+
+  if (cacheSlot(slot)) { /* somebody already did the work */
+    return 1;
+  }
+  if (fd < 0 || size > CACHE_FILEMAX || size > cache->memLimit) {
+    return 0;
+  }
+
+  contents = malloc(size > 0 ? size : 1);
+  if (!contents) {
+    return 0;
+  }
+  if (size > 0 && pread(fd, contents, size, 0) != size) {
+    free(contents); /* the file is changing under us; try again later */
+    return 0;
+  }
+
+  if (!keepContents(cache, entry, slot, slotLen, contents, size)) {
+    free(contents);
+    return (cacheSlot(slot) != NULL);
+  }
+
+  return 1;
+}
+
+/* Attaches contents to one of an entry's contents slots, dropping the
+ * contents of the least recently used entries if the shard's memory
+ * budget would otherwise be exceeded.  Only the contents go; the
+ * entries stay, descriptors, validators and all.  Entries somebody is
+ * holding may be sending from their contents, so they are passed over.
+ *
+ * @return 1 if the contents were attached, 0 if the slot is already
+ *         filled, there's no room, or the entry has been evicted (the
+ *         caller still owns contents).
+ */
+static int keepContents(filecache* cache, cacheentry* entry, char** slot,
+                        long int* slotLen, char* contents, long int size) {
+  cacheshard* shard = &(cache->shards[entry->hash % cache->numShards]);
+  cacheentry* victim;
+
+  pthread_mutex_lock(&(shard->mutex));
+  if (*slot || !entry->linked) { /* raced, or already evicted */
+    pthread_mutex_unlock(&(shard->mutex));
+    return 0;
+  }
+
+  /* make room, starting with the least recently used contents */
+  for (victim = shard->oldest; victim && shard->memUsed + size > cache->memLimit;
+       victim = victim->newer) {
+    if (victim != entry && victim->refs == 0 && entryMemory(victim) > 0) {
+      shard->memUsed -= dropContents(victim);
+      shard->evictions++;
+    }
+  }
+  if (shard->memUsed + size > cache->memLimit) { /* the rest are in use */
+    pthread_mutex_unlock(&(shard->mutex));
+    return 0;
+  }
+
+  *slotLen        = size;
+  __atomic_store_n(slot, contents, __ATOMIC_RELEASE);
+  shard->memUsed += size;
+  pthread_mutex_unlock(&(shard->mutex));
+
+  return 1;
+}
+
+/* Returns the bytes of contents an entry holds, its compressed copies'
+ * included, as counted against the memory budget.
+ */
+static long int entryMemory(cacheentry* entry) {
+  long int total = (entry->contents ? entry->contentsLen : 0);
+  int i;
+
+  for (i = 0; i < NUMCODINGS; i++) {
+    if (entry->variants[i].contents) {
+      total += entry->variants[i].contentsLen;
+    }
+  }
+
+  return total;
+}
+
+/* Frees an entry's contents, its compressed copies' included, leaving
+ * the rest of it be.  A gzip copy made in memory goes entirely, header
+ * and all, and can be made again once the file is popular again.
+ * NOTE: Lock the shard, and be sure nobody holds the entry, first!
+ *
+ * @return The bytes freed, as counted against the memory budget.
+ */
+static long int dropContents(cacheentry* entry) {
+  long int freed = entryMemory(entry);
+  cachevariant* variant;
+  int i;
+
+  free(entry->contents);
+  __atomic_store_n(&(entry->contents), NULL, __ATOMIC_RELEASE);
+  for (i = 0; i < NUMCODINGS; i++) {
+    variant = &(entry->variants[i]);
+    if (!variant->contents) {
+      continue;
+    }
+    free(variant->contents);
+    __atomic_store_n(&(variant->contents), NULL, __ATOMIC_RELEASE);
+    if (!variant->found) {
+      free(variant->header);
+      __atomic_store_n(&(variant->header), NULL, __ATOMIC_RELEASE);
+      __sync_sub_and_fetch(&(entry->numVariants), 1);
+      entry->compressHits = 0;
+    }
+  }
+
+  return freed;
+}
+
+/* Releases everything associated with an entry. */
+static void freeEntry(cacheentry* entry) {
+  int i;
+
+  if (entry->fd >= 0) {
+    close(entry->fd);
+  }
+  for (i = 0; i < NUMCODINGS; i++) {
+    if (entry->variants[i].fd >= 0) {
+      close(entry->variants[i].fd);
+    }
+    free(entry->variants[i].header);
+    free(entry->variants[i].contents);
+  }
+  free(entry->header);
+  free(entry->contents);
+  free(entry->path);
+  free(entry);
+}
@@ -0,0 +1,181 @@
+#ifndef _FILECACHE_
+#define _FILECACHE_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "constants.h" /* for cache defaults */
+
+/* This file stores everything regarding the file cache, which keeps
+ * the results of resolving a request path (the stat() information and
+ * an open file descriptor) so that hot files can be served without
+ * touching the file system at all.
+ *
+ * The type "cacheentry" is a single cached path.  Paths that could not
+ * be found are cached too, with error holding the errno, so repeated
+ * requests for missing files (index.html in a directory that doesn't
+ * have one, for instance) are just as cheap.  Directories are cached
+ * with a descriptor too, for listing them.
+ *
+ * Every path is resolved against a descriptor for the document root
+ * with openat2() and RESOLVE_BENEATH, so the kernel itself refuses any
+ * path (or symbolic link) that leads out of the root, and magic links
+ * such as /proc/self/fd/N.  Kernels without openat2() get a plain
+ * openat() against the same descriptor instead.
+ *
+ * Entries are handed out with a reference held; the caller must give
+ * it back with cacheRelease() when finished.  An entry pushed out of
+ * the cache while somebody still holds it stays alive (descriptor and
+ * all) until the last reference is released.
+ *
+ * Regular files keep their response header (everything up to the
+ * Connection line) once it has been formatted, by way of cacheHeader(),
+ * so that a hit does no formatting at all.  Small files can also have
+ * their contents kept in memory, so that a hit is sent straight from
+ * the cache with no file I/O whatsoever.  This is filled in on request
+ * by cacheFill() and is bounded by a memory budget (again split between
+ * the shards); the least recently used contents are dropped to make
+ * room, leaving their entries in place.  Both go away with the entry
+ * when the file changes.  Headers and contents are filled in while
+ * other threads may be sending from the entry, so read them with
+ * cacheSlot().
+ *
+ * Regular files also carry their validators, an ETag made from the
+ * inode, size, and modification time, and a Last-Modified date, both
+ * formatted once when the path is resolved, so that conditional
+ * requests can be answered without touching the file.
+ *
+ * Regular files also carry any precompressed copies found next to them
+ * when they are resolved ("file.br" and "file.gz", smaller than the
+ * file itself), each with an open descriptor, an ETag of its own, and
+ * room for a header and contents kept just like the file's.  Choosing
+ * one then costs no extra stat() or open() calls at all.  The copies
+ * are checked along with the file, so adding, changing, or removing
+ * one throws the entry out too.
+ *
+ * A gzip copy can also be made in memory, by the compression pool (see
+ * compressPool.h), and handed over with cacheCompressed().  It has no
+ * descriptor, and counts against the memory budget like any contents.
+ *
+ * Directories keep their rendered listing page the same way, in place
+ * of contents, by way of cacheListing().  Adding or removing a file
+ * changes the directory's modification time, which throws the entry
+ * (and the page with it) out at the next check.
+ *
+ * Every entry is checked against the disk again once it is more than
+ * "interval" seconds old.  If the inode, size, or modification time
+ * has changed, the entry is thrown out and the path resolved afresh.
+ *
+ * The type "cacheshard" is one independently locked slice of the cache:
+ * a hash table of entries plus a list of those entries ordered from
+ * most to least recently used.  Paths are spread over the shards by
+ * hash, so threads serving different files rarely contend.
+ *
+ * The type "filecache" is the whole cache, along with its limits.
+ */
+
+/* content codings with precompressed copies, in order of preference */
+#define CODING_BR 0
+#define CODING_GZIP 1
+#define NUMCODINGS 2
+#define CODING_NAMEMAX (sizeof("gzip") - 1) /* the longest coding name */
+
+/* an ETag is "ino-size-sec.nsec" in hex and quoted, each number as wide
+ * as an unsigned long gets; a copy's adds "-coding" before the quote */
+#define ETAG_MAX (2 + (4 * 2 * sizeof(unsigned long)) + 3 + 1)
+#define VARIANT_ETAG_MAX (ETAG_MAX + 1 + CODING_NAMEMAX)
+
+/* a compressed copy of a regular file */
+typedef struct cachevariant {
+  int found;                  /* is there a regular file by that name? */
+  int fd;                     /* open descriptor for it if usable, or -1 */
+  struct stat sb;
+  long int size;              /* bytes in the copy */
+  char etag[VARIANT_ETAG_MAX]; /* quoted; its own, not the file's */
+  char* header;               /* pre-rendered 200 header, or NULL */
+  long int headerLen;
+  char* contents;             /* the whole copy, or NULL */
+  long int contentsLen;
+} cachevariant;
+
+/* a single cached path */
+typedef struct cacheentry {
+  char* path;                 /* the decoded request path (the key) */
+  unsigned long hash;
+  int error;                  /* errno if the path couldn't be resolved */
+  int fd;                     /* open descriptor for files and directories, or -1 */
+  struct stat sb;
+  char etag[ETAG_MAX];        /* quoted; empty unless a regular file */
+  char lastModified[40];      /* HTTP-date of sb.st_mtime */
+  char* header;               /* pre-rendered 200 header, or NULL */
+  long int headerLen;
+  char* contents;             /* the whole file (or listing), or NULL */
+  long int contentsLen;
+  cachevariant variants[NUMCODINGS];
+  int numVariants;            /* variants on disk or in memory */
+  int compressHits;           /* requests that could have used gzip */
+  time_t validated;           /* when sb was last checked against the disk */
+  int refs;                   /* callers currently holding the entry */
+  int linked;                 /* still in the cache? */
+  struct cacheentry* chain;   /* next entry in the same hash bucket */
+  struct cacheentry* newer;   /* LRU neighbors */
+  struct cacheentry* older;
+} cacheentry;
+
+/* one independently locked slice of the cache */
+typedef struct cacheshard {
+  pthread_mutex_t mutex;
+  cacheentry** buckets;
+  cacheentry* newest;
+  cacheentry* oldest;
+  int numEntries;
+  long int memUsed;           /* bytes of cached contents */
+
+  /* counters, for sizing the cache */
+  long int hits;
+  long int misses;
+  long int evictions;
+  long int invalidations;
+} cacheshard;
+
+/* the whole cache */
+typedef struct filecache {
+  cacheshard* shards;
+  int numShards;
+  int maxEntries;             /* per shard; 0 disables caching */
+  int numBuckets;             /* per shard */
+  int interval;               /* seconds between revalidations */
+  long int memLimit;          /* per shard; bytes of cached contents */
+  int rootfd;                 /* the document root */
+} filecache;
+
+/* the name and file suffix of each coding */
+extern char* codingNames[NUMCODINGS];
+extern char* codingSuffixes[NUMCODINGS];
+
+/* cache functions */
+filecache* newFileCache(int numShards, int maxEntries, int interval,
+                        long int memLimit, int rootfd);
+cacheentry* cacheLookup(filecache* cache, char* path);
+char* cacheHeader(filecache* cache, cacheentry* entry, char* header,
+                  long int headerLen);
+int cacheFill(filecache* cache, cacheentry* entry);
+char* cacheVariantHeader(filecache* cache, cacheentry* entry, int coding,
+                         char* header, long int headerLen);
+int cacheFillVariant(filecache* cache, cacheentry* entry, int coding);
+int cacheCompressed(filecache* cache, cacheentry* entry, int coding,
+                    char* contents, long int len);
+void cacheHold(filecache* cache, cacheentry* entry);
+char* cacheSlot(char** slot);
+int cacheListing(filecache* cache, cacheentry* entry, char* page,
+                 long int pageLen);
+void cacheRelease(filecache* cache, cacheentry* entry);
+void printCacheStats(filecache* cache);
+void destroyFileCache(filecache* cache);
+
+#include "fileCache.c"
+#endif /* _FILECACHE_ */
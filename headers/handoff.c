@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "handoff.h"
+#include "returncodes.h"
+
+/* Starts a new copy of the server, from whatever binary is now at the
+ * path this one was started from.  It gets the same arguments, and a
+ * socket back to this process on HANDOFF_FD, but no other descriptors;
+ * in particular no client connections, which would otherwise be held
+ * open after this server closes them.
+ *
+ * @param argv The arguments this server was started with.
+ * @param chan Set to this end of the socket between the two.
+ * @return The new server's process ID, or -1 on failure.
+ */
+pid_t handoffSpawn(char** argv, int* chan) {
+  long int maxfd = sysconf(_SC_OPEN_MAX), fd;
+  char value[16];
+  int pair[2];
+  pid_t child;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+    return -1;
+  }
+
+  /* set here so the child needn't touch the environment after fork() */
+  snprintf(value, sizeof(value), "%d", HANDOFF_FD);
+  setenv(HANDOFF_ENV, value, 1);
+  fflush(stdout); /* or whatever is buffered gets printed twice */
+
+  if ((child = fork()) == 0) {
+    dup2(pair[1], HANDOFF_FD);
+    #ifdef SYS_close_range
+    if (syscall(SYS_close_range, HANDOFF_FD + 1, ~0U, 0) < 0)
+    #endif
+    {
+      for (fd = HANDOFF_FD + 1; fd < maxfd; fd++) {
+        close(fd);
+      }
+    }
+    execvp(argv[0], argv);
+    _exit(IO_FAILURE);
+  }
+
+  unsetenv(HANDOFF_ENV);
+  close(pair[1]);
+  if (child < 0) {
+    close(pair[0]);
+    return -1;
+  }
+
+  *chan = pair[0];
+  return child;
+}
+
+/* Sends descriptors down the handoff socket, all in one message.
+ *
+ * @param chan The handoff socket.
+ * @param fds The descriptors.
+ * @param count How many there are.
+ * @return 0 on success, -1 on failure.
+ */
+int handoffSend(int chan, int* fds, int count) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  size_t len = CMSG_SPACE(count * sizeof(int));
+  char* control;
+  int sent;
+
+  if (!(control = calloc(1, len))) {
+    return -1;
+  }
+
+  /* the count goes along too, so the other side can check it */
+  iov.iov_base = &count;
+  iov.iov_len  = sizeof(count);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = len;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+  sent = sendmsg(chan, &msg, MSG_NOSIGNAL);
+  free(control);
+
+  return (sent == sizeof(count) ? 0 : -1);
+}
+
+/* Receives the descriptors handoffSend() sent, waiting HANDOFF_WAIT
+ * seconds at most.  The copies received are closed on exec.
+ *
+ * @param chan The handoff socket.
+ * @param fds Filled in with the descriptors.
+ * @param count How many are expected.
+ * @return 0 on success, -1 if they didn't come, or there were the wrong
+ *         number of them (in which case any that did come are closed).
+ */
+int handoffRecv(int chan, int* fds, int count) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  struct pollfd p;
+  size_t len = CMSG_SPACE(count * sizeof(int));
+  char* control;
+  int sent = 0, received = 0, i;
+
+  p.fd = chan;
+  p.events = POLLIN;
+  if (poll(&p, 1, HANDOFF_WAIT * 1000) <= 0 || !(control = calloc(1, len))) {
+    return -1;
+  }
+
+  iov.iov_base = &sent;
+  iov.iov_len  = sizeof(sent);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = len;
+
+  if (recvmsg(chan, &msg, MSG_CMSG_CLOEXEC) == sizeof(sent) &&
+      (cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+  }
+  free(control);
+
+  if (sent != count || received != count || (msg.msg_flags & MSG_CTRUNC)) {
+    for (i = 0; i < received; i++) {
+      close(fds[i]);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Tells the old server that this one is up and accepting, and closes
+ * the handoff socket.
+ *
+ * @param chan The handoff socket.
+ * @return 0 on success, -1 on failure.
+ */
+int handoffReady(int chan) {
+  int ok = (write(chan, "!", 1) == 1);
+
+  close(chan);
+  return (ok ? 0 : -1);
+}
+
+/* Waits for the new server to say it's up.
+ *
+ * @param chan The handoff socket.
+ * @param timeout Seconds to wait at most.
+ * @return 0 once it is, -1 if it failed or took too long.
+ */
+int handoffWait(int chan, int timeout) {
+  struct pollfd p;
+  char ready;
+
+  p.fd = chan;
+  p.events = POLLIN;
+
+  return (poll(&p, 1, timeout * 1000) > 0 && read(chan, &ready, 1) == 1 ? 0 : -1);
+}
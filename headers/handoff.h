@@ -0,0 +1,38 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "constants.h" /* for HANDOFF_ENV and friends */
+
+/* This file stores everything regarding handoffs, how a running server
+ * passes its listening sockets to a new copy of itself, so a new build
+ * can take over without a single connection being refused.
+ *
+ * The old server starts the new one with handoffSpawn(), which runs
+ * whatever binary is now at the path the old one was started from,
+ * with the same arguments, and leaves a Unix socket between the two
+ * on HANDOFF_FD (which the new server finds named in HANDOFF_ENV).  The
+ * old server sends its listening sockets down it with handoffSend(),
+ * and the new one picks them up with handoffRecv() in place of binding
+ * its own.  Both servers are accepting on the same sockets from then
+ * on, so nothing waiting in the backlog is lost.  Once the new server
+ * is up, it says so with handoffReady(), and the old one, which has
+ * been sitting in handoffWait(), stops accepting and finishes what it
+ * has.  If the new server never says so, the old one carries on.
+ *
+ * Anything else the servers share, like shared memory, is found by
+ * name, and needs no handing over.
+ */
+
+/* handoff functions */
+pid_t handoffSpawn(char** argv, int* chan);
+int handoffSend(int chan, int* fds, int count);
+int handoffRecv(int chan, int* fds, int count);
+int handoffReady(int chan);
+int handoffWait(int chan, int timeout);
+
+#include "handoff.c"
+#endif /* HANDOFF_H */
@@ -0,0 +1,606 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SCAN
+#endif
+
+#include "httpParser.h"
+
+/* helpers */
+static long int findHeaderEnd(char* buf, long int len, long int* scanned);
+static char* nextLine(char* line, char* end);
+static span trim(char* start, char* end);
+static unsigned int scalarMasks(char* p, long int n, unsigned int* colons);
+#ifdef HAVE_X86_SCAN
+static unsigned int sse2Masks(char* p, unsigned int* colons);
+static unsigned int avx2Masks(char* p, unsigned int* colons);
+#endif
+
+/* the scanner in use, picked on first use */
+static int scanLevel = -1;
+
+/* Parses the request at the front of a buffer.  Nothing is copied; the
+ * spans in req point straight into buf.
+ *
+ * @param buf The received bytes.
+ * @param len The number of bytes in buf.
+ * @param scanned How far the end of the header has been looked for
+ *                already; 0 for a fresh request.  Updated on return.
+ * @param req Filled in with the request once it is complete.
+ * A request has to say plainly where it ends, since whatever follows it
+ * is taken as the next one: more than one Content-Length, an empty one,
+ * any Transfer-Encoding (chunked bodies aren't understood here), or
+ * more fields than there's room for are all refused.
+ *
+ * @return PARSE_DONE if a whole request is in the buffer, in which case
+ *         req->length says how many bytes it used; PARSE_INCOMPLETE if
+ *         more bytes are needed; PARSE_ERROR if it isn't HTTP at all, or
+ *         can't be framed safely.
+ */
+int parseRequest(char* buf, long int len, long int* scanned,
+                 httprequest* req) {
+  long int headerLen, bodyLen = 0;
+  char* line, *end, *p;
+  int i, lengths = 0;
+
+  if ((headerLen = findHeaderEnd(buf, len, scanned)) < 0) {
+    return PARSE_INCOMPLETE;
+  }
+  end = buf + headerLen;
+
+  /* empty lines ahead of a request are allowed, and ignored */
+  line = buf;
+  while (line < end && (*line == '\r' || *line == '\n')) {
+    line++;
+  }
+
+  /* the request line: method, path, and version, separated by spaces */
+  p = line;
+  req->method.start = p;
+  while (p < end && *p != ' ' && *p != '\r' && *p != '\n') p++;
+  req->method.len = p - req->method.start;
+  while (p < end && *p == ' ') p++;
+
+  req->path.start = p;
+  while (p < end && *p != ' ' && *p != '\r' && *p != '\n') p++;
+  req->path.len = p - req->path.start;
+  while (p < end && *p == ' ') p++;
+
+  req->version.start = p;
+  while (p < end && *p != ' ' && *p != '\r' && *p != '\n') p++;
+  req->version.len = p - req->version.start;
+
+  if (!req->method.len || !req->path.len || !req->version.len) {
+    return PARSE_ERROR;
+  }
+
+  /* the header fields, up to the blank line */
+  if ((req->numFields = scanFields(nextLine(p, end), end, req->fields,
+                                   MAXFIELDS)) < 0) {
+    return PARSE_ERROR;
+  }
+
+  /* a body (on a GET, of all things) belongs to this request too */
+  for (i = 0; i < req->numFields; i++) {
+    if (spanCaseEquals(req->fields[i].name, "Transfer-Encoding")) {
+      return PARSE_ERROR;
+    }
+    if (spanCaseEquals(req->fields[i].name, "Content-Length")) {
+      if (++lengths > 1 || req->fields[i].value.len == 0) {
+        return PARSE_ERROR;
+      }
+      for (p = req->fields[i].value.start;
+           p < req->fields[i].value.start + req->fields[i].value.len; p++) {
+        if (!isdigit((unsigned char)*p) || bodyLen > MAXREQUEST) {
+          return PARSE_ERROR;
+        }
+        bodyLen = (bodyLen * 10) + (*p - '0');
+      }
+    }
+  }
+
+  req->length = headerLen + bodyLen;
+  return (req->length <= len ? PARSE_DONE : PARSE_INCOMPLETE);
+}
+
+/* Finds the header field with the given name (case doesn't matter).
+ *
+ * @return The first such field, or NULL if the request has none.
+ */
+httpfield* findField(httprequest* req, char* name) {
+  int i;
+
+  for (i = 0; i < req->numFields; i++) {
+    if (spanCaseEquals(req->fields[i].name, name)) {
+      return &(req->fields[i]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Compares a span against a NULL-terminated string, ignoring case.
+ *
+ * @return 1 if they match, 0 otherwise.
+ */
+int spanCaseEquals(span s, char* str) {
+  return ((long int)strlen(str) == s.len &&
+          strncasecmp(s.start, str, s.len) == 0);
+}
+
+/* Checks a comma separated list, such as the value of a Connection
+ * field, for the given token (case doesn't matter).
+ *
+ * @return 1 if the token is in the list, 0 otherwise.
+ */
+int spanHasToken(span s, char* token) {
+  char* p = s.start, *end = s.start + s.len, *comma;
+
+  while (p < end) {
+    if (!(comma = memchr(p, ',', end - p))) {
+      comma = end;
+    }
+    if (spanCaseEquals(trim(p, comma), token)) {
+      return 1;
+    }
+    p = comma + 1;
+  }
+
+  return 0;
+}
+
+/* Checks the list of entity tags in an If-None-Match field for the
+ * given tag.  The comparison is the weak one (a "W/" prefix doesn't
+ * matter), and "*" matches anything.
+ *
+ * @param s The field's value.
+ * @param etag The tag, quotes and all.
+ * @return 1 if the tag is in the list, 0 otherwise.
+ */
+int spanHasETag(span s, char* etag) {
+  char* p = s.start, *end = s.start + s.len, *comma;
+  long int len = strlen(etag);
+  span tag;
+
+  while (p < end) {
+    if (!(comma = memchr(p, ',', end - p))) {
+      comma = end;
+    }
+    tag = trim(p, comma);
+    if (tag.len >= 2 && tag.start[0] == 'W' && tag.start[1] == '/') {
+      tag.start += 2;
+      tag.len   -= 2;
+    }
+    if ((tag.len == 1 && tag.start[0] == '*') ||
+        (tag.len == len && memcmp(tag.start, etag, len) == 0)) {
+      return 1;
+    }
+    p = comma + 1;
+  }
+
+  return 0;
+}
+
+/* Checks an Accept-Encoding field for the given content coding.  The
+ * coding is acceptable if it is listed, or "*" is, without "q=0";
+ * listing it with "q=0" rules it out even when "*" would let it in.
+ * Any other quality value counts the same.
+ *
+ * @param s The field's value.
+ * @param coding The coding, such as "gzip".
+ * @return 1 if the client takes the coding, 0 otherwise.
+ */
+int spanAcceptsCoding(span s, char* coding) {
+  char* p = s.start, *end = s.start + s.len, *comma, *semi, *q;
+  int star = 0, nonzero;
+  span item, name;
+
+  while (p < end) {
+    if (!(comma = memchr(p, ',', end - p))) {
+      comma = end;
+    }
+    item = trim(p, comma);
+    if (!(semi = memchr(item.start, ';', item.len))) {
+      semi = item.start + item.len;
+    }
+    name = trim(item.start, semi);
+
+    /* "q=0", "q=0.0" and so on are the only ways to say no */
+    nonzero = 1;
+    for (q = semi; q < item.start + item.len; q++) {
+      if ((*q == 'q' || *q == 'Q') && q + 1 < item.start + item.len &&
+          q[1] == '=') {
+        for (q += 2, nonzero = 0; q < item.start + item.len && *q != ';'; q++) {
+          if (*q >= '1' && *q <= '9') {
+            nonzero = 1;
+          }
+        }
+        break;
+      }
+    }
+
+    if (spanCaseEquals(name, coding)) {
+      return nonzero;
+    } else if (name.len == 1 && name.start[0] == '*') {
+      star = nonzero;
+    }
+    p = comma + 1;
+  }
+
+  return star;
+}
+
+/* Looks for a string inside a span, ignoring case.
+ *
+ * @return 1 if it's in there, 0 otherwise.
+ */
+int spanCaseContains(span s, char* str) {
+  long int n = strlen(str), i;
+
+  for (i = 0; i + n <= s.len; i++) {
+    if (strncasecmp(s.start + i, str, n) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Reads a span holding nothing but a decimal number, such as the value
+ * of a Content-Length field.
+ *
+ * @return The number, or -1 if the span isn't one.
+ */
+long int spanToLong(span s) {
+  long int value = 0, i;
+
+  if (s.len <= 0 || s.len > 18) { /* empty, or too big for a long */
+    return -1;
+  }
+  for (i = 0; i < s.len; i++) {
+    if (!isdigit((unsigned char)s.start[i])) {
+      return -1;
+    }
+    value = (value * 10) + (s.start[i] - '0');
+  }
+
+  return value;
+}
+
+/* Reads the value of a Range field, such as "bytes=0-99, -500", into
+ * spans of a file of the given size.  Open-ended ranges ("500-") run to
+ * the end of the file, suffix ranges ("-500") are the last so many
+ * bytes, and ranges running past the end are cut short.  Ranges that
+ * start past the end are skipped.
+ *
+ * A field that can't be read, isn't in bytes, or asks for more than max
+ * ranges is to be ignored, and the whole file sent instead.
+ *
+ * @param s The field's value.
+ * @param size The size of the file.
+ * @param ranges Filled in with the ranges, in the order given.
+ * @param max The most ranges to accept.
+ * @return The number of ranges; 0 if the field should be ignored; -1 if
+ *         none of the ranges overlap the file, which deserves a 416.
+ */
+int spanToRanges(span s, long int size, byterange* ranges, int max) {
+  char* p = s.start, *end = s.start + s.len, *comma, *dash;
+  long int first, last;
+  int n = 0, seen = 0;
+  span spec, part;
+
+  if (s.len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+    return 0;
+  }
+
+  for (p += 6; p < end; p = comma + 1) {
+    if (!(comma = memchr(p, ',', end - p))) {
+      comma = end;
+    }
+    spec = trim(p, comma);
+    if (spec.len == 0) { /* "bytes=0-1,,2-3" is allowed */
+      continue;
+    }
+    if (++seen > max || !(dash = memchr(spec.start, '-', spec.len))) {
+      return 0;
+    }
+
+    /* either number may be missing, but not both */
+    part.start = spec.start;
+    part.len   = dash - spec.start;
+    if ((first = (part.len ? spanToLong(part) : -1)) < 0 && part.len) {
+      return 0;
+    }
+    part.start = dash + 1;
+    part.len   = spec.start + spec.len - part.start;
+    if ((last = (part.len ? spanToLong(part) : -1)) < 0 && part.len) {
+      return 0;
+    }
+
+    if (first < 0 && last < 0) { /* "-" */
+      return 0;
+    } else if (first < 0) { /* the last so many bytes */
+      if (last == 0) {
+        continue;
+      }
+      first = (last < size ? size - last : 0);
+      last = size - 1;
+    } else if (last < 0) { /* all the rest */
+      last = size - 1;
+    } else if (last < first) {
+      return 0;
+    } else if (last >= size) {
+      last = size - 1;
+    }
+
+    if (first < size) {
+      ranges[n].first  = first;
+      ranges[n].length = last - first + 1;
+      n++;
+    }
+  }
+
+  if (seen == 0) {
+    return 0;
+  }
+  return (n > 0 ? n : -1);
+}
+
+/* Copies a span into a NULL-terminated string of its own.
+ *
+ * @return The copy, which the caller must free(), or NULL on failure.
+ */
+char* spanDup(span s) {
+  char* copy = malloc(s.len + 1);
+
+  if (copy) {
+    memcpy(copy, s.start, s.len);
+    copy[s.len] = '\0';
+  }
+
+  return copy;
+}
+
+/* Indexes a header that has been received in full.  Nothing is copied;
+ * the spans in idx point straight into buf.
+ *
+ * @param buf The header.
+ * @param len The number of bytes in the header.
+ * @param idx Filled in with the first line and the fields.
+ * @return The number of fields indexed, or -1 if there were more than
+ *         MAXFIELDS, in which case only the first MAXFIELDS are.
+ */
+int indexHeader(char* buf, long int len, headerindex* idx) {
+  char* end = buf + len, *line = buf;
+
+  /* empty lines ahead of the first line are allowed, and ignored */
+  while (line < end && (*line == '\r' || *line == '\n')) {
+    line++;
+  }
+  idx->first = trim(line, nextLine(line, end));
+  if ((idx->numFields = scanFields(nextLine(line, end), end, idx->fields,
+                                   MAXFIELDS)) < 0) {
+    idx->numFields = MAXFIELDS;
+    return -1;
+  }
+
+  return idx->numFields;
+}
+
+/* Finds the header field with the given name (case doesn't matter).
+ *
+ * @return The first such field, or NULL if the header has none.
+ */
+httpfield* indexFind(headerindex* idx, char* name) {
+  int i;
+
+  for (i = 0; i < idx->numFields; i++) {
+    if (spanCaseEquals(idx->fields[i].name, name)) {
+      return &(idx->fields[i]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Splits the lines of a header into fields, stopping at the blank line
+ * that ends it.  Every newline and colon is found in one pass, a block
+ * of SCAN_BLOCK bytes at a time: the block is turned into two bit masks,
+ * one bit per byte, and only the set bits are looked at.  Lines without
+ * a colon aren't fields, and are skipped.
+ *
+ * @param start The start of the first field's line.
+ * @param end The end of the header.
+ * @param fields Filled in with the fields found.
+ * @param max The most fields to fill in.
+ * @return The number of fields filled in, or -1 if there were more than
+ *         max, in which case the first max are filled in.
+ */
+int scanFields(char* start, char* end, httpfield* fields, int max) {
+  char* line = start, *colon = NULL, *p, *hit;
+  unsigned int newlines, colons, bits;
+  int count = 0;
+
+  if (scanLevel < 0) {
+    headerScanner(-1);
+  }
+
+  for (p = start; p < end; p += SCAN_BLOCK) {
+    if (end - p < SCAN_BLOCK) { /* never read past the end */
+      newlines = scalarMasks(p, end - p, &colons);
+    }
+#ifdef HAVE_X86_SCAN
+    else if (scanLevel == SCAN_AVX2) {
+      newlines = avx2Masks(p, &colons);
+    } else if (scanLevel == SCAN_SSE2) {
+      newlines = sse2Masks(p, &colons);
+    }
+#endif
+    else {
+      newlines = scalarMasks(p, SCAN_BLOCK, &colons);
+    }
+
+    /* walk the newlines and colons in order */
+    for (bits = newlines | colons; bits; bits &= bits - 1) {
+      hit = p + __builtin_ctz(bits);
+      if (*hit == ':') { /* only the first one on a line counts */
+        if (!colon) {
+          colon = hit;
+        }
+        continue;
+      }
+
+      if (hit == line || (hit == line + 1 && *line == '\r')) {
+        return (count > max ? -1 : count); /* the blank line */
+      }
+      if (colon && count++ < max) {
+        fields[count - 1].name  = trim(line, colon);
+        fields[count - 1].value = trim(colon + 1, hit);
+      }
+      line  = hit + 1;
+      colon = NULL;
+    }
+  }
+
+  /* a last line with no newline on it */
+  if (colon && count++ < max) {
+    fields[count - 1].name  = trim(line, colon);
+    fields[count - 1].value = trim(colon + 1, end);
+  }
+
+  return (count > max ? -1 : count);
+}
+
+/* Picks the header scanner, falling back to the best this processor
+ * can actually run.  There's normally no need to call this; SSE2 is
+ * picked on first use where there is one.  AVX2 has to be asked for:
+ * a typical header is only a few blocks long, and on some processors
+ * waking up the wider unit costs more than it saves.
+ *
+ * @param level SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2, or -1 for the default.
+ * @return The scanner now in use.
+ */
+int headerScanner(int level) {
+  int best = SCAN_SCALAR;
+
+#ifdef HAVE_X86_SCAN
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    best = SCAN_AVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    best = SCAN_SSE2;
+  }
+#endif
+
+  if (level < 0) {
+    level = SCAN_SSE2;
+  }
+  scanLevel = (level > best ? best : level);
+  return scanLevel;
+}
+
+/* Looks for the blank line ending the header, picking up the search
+ * where the last call left off.  Both "\r\n\r\n" and "\n\n" count.
+ *
+ * @return The length of the header including the blank line, or -1 if
+ *         it hasn't all arrived yet.
+ */
+static long int findHeaderEnd(char* buf, long int len, long int* scanned) {
+  char* p = buf + *scanned, *end = buf + len;
+
+  /* skip the empty lines allowed ahead of the request line */
+  if (*scanned == 0) {
+    while (p < end && (*p == '\r' || *p == '\n')) {
+      p++;
+    }
+  }
+
+  while ((p = memchr(p, '\n', end - p))) {
+    if (p + 1 < end && p[1] == '\n') {
+      *scanned = p - buf;
+      return (p + 2) - buf;
+    } else if (p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+      *scanned = p - buf;
+      return (p + 3) - buf;
+    } else if (p + 2 >= end) { /* can't tell yet; look here next time */
+      *scanned = p - buf;
+      return -1;
+    }
+    p++;
+  }
+
+  /* nothing so far; the newline could still be in what's left */
+  *scanned = (len > 0 ? len : 0);
+  return -1;
+}
+
+/* Returns the start of the line after the one containing "line". */
+static char* nextLine(char* line, char* end) {
+  char* newline = memchr(line, '\n', end - line);
+  return (newline ? newline + 1 : end);
+}
+
+/* Builds a span over [start, end) with whitespace cut off both ends. */
+static span trim(char* start, char* end) {
+  span s;
+
+  while (start < end && (*start == ' ' || *start == '\t')) {
+    start++;
+  }
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t' ||
+                         end[-1] == '\r' || end[-1] == '\n')) {
+    end--;
+  }
+  s.start = start;
+  s.len   = end - start;
+
+  return s;
+}
+
+/* Builds the newline and colon masks for n (at most SCAN_BLOCK) bytes,
+ * one byte at a time.
+ */
+static unsigned int scalarMasks(char* p, long int n, unsigned int* colons) {
+  unsigned int newlines = 0;
+  long int i;
+
+  *colons = 0;
+  for (i = 0; i < n; i++) {
+    if (p[i] == '\n') {
+      newlines |= (1u << i);
+    } else if (p[i] == ':') {
+      *colons |= (1u << i);
+    }
+  }
+
+  return newlines;
+}
+
+#ifdef HAVE_X86_SCAN
+/* Builds the masks for SCAN_BLOCK bytes, 16 at a time. */
+__attribute__((target("sse2")))
+static unsigned int sse2Masks(char* p, unsigned int* colons) {
+  __m128i lo = _mm_loadu_si128((__m128i*)p);
+  __m128i hi = _mm_loadu_si128((__m128i*)(p + 16));
+  __m128i nl = _mm_set1_epi8('\n'), co = _mm_set1_epi8(':');
+
+  *colons = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, co)) |
+            ((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, co)) << 16);
+  return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, nl)) |
+         ((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, nl)) << 16);
+}
+
+/* Builds the masks for SCAN_BLOCK bytes, all at once. */
+__attribute__((target("avx2")))
+static unsigned int avx2Masks(char* p, unsigned int* colons) {
+  __m256i block = _mm256_loadu_si256((__m256i*)p);
+
+  *colons = (unsigned int)_mm256_movemask_epi8(
+              _mm256_cmpeq_epi8(block, _mm256_set1_epi8(':')));
+  return (unsigned int)_mm256_movemask_epi8(
+           _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+}
+#endif
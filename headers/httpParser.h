@@ -0,0 +1,110 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <stdlib.h>
+
+#include "constants.h" /* for MAXFIELDS */
+
+/* This file stores everything regarding the request parser, which
+ * picks an HTTP request apart without copying any of it.
+ *
+ * The type "span" is a stretch of the caller's buffer: a pointer to
+ * its first byte and its length.  Spans are NOT NULL-terminated, and
+ * are only good for as long as the buffer they point into stays put.
+ *
+ * The type "httpfield" is a single header line, split into its name
+ * and its value (with surrounding whitespace trimmed off).
+ *
+ * The type "httprequest" is a parsed request: the three parts of the
+ * request line, the header fields, and the total number of bytes the
+ * request takes up in the buffer (header, blank line, and any body
+ * announced by Content-Length), so that whatever follows it can be
+ * parsed as the next, pipelined, request.
+ *
+ * Parsing is incremental.  The caller keeps a "scanned" offset for
+ * each buffer, starting at 0; parseRequest() records there how far it
+ * has already looked for the end of the header, so that feeding it a
+ * request a few bytes at a time doesn't cost a rescan of everything
+ * that came before.
+ *
+ * The type "headerindex" is the same split done on any header, request
+ * or response, that has already been received in full (a la the proxy):
+ * its first line and its fields.  Build it once with indexHeader(), and
+ * every lookup after that is a walk over the fields, with nothing copied
+ * or allocated.
+ *
+ * The type "byterange" is one span of a file asked for in a Range
+ * field, resolved against the file's size.
+ *
+ * Both are built by one pass over the header that picks out every
+ * newline and colon 32 bytes at a time, using SSE2 where the processor
+ * has it (AVX2 too, if asked for) and plain C everywhere else.
+ */
+
+/* parseRequest() results */
+#define PARSE_ERROR -1
+#define PARSE_INCOMPLETE 0
+#define PARSE_DONE 1
+
+/* header scanners, in order of the instructions they need */
+#define SCAN_SCALAR 0
+#define SCAN_SSE2 1
+#define SCAN_AVX2 2
+#define SCAN_BLOCK 32   /* bytes looked at per step */
+
+/* a stretch of the buffer */
+typedef struct span {
+  char* start;
+  long int len;
+} span;
+
+/* a single header field */
+typedef struct httpfield {
+  span name;
+  span value;
+} httpfield;
+
+/* a parsed request */
+typedef struct httprequest {
+  span method;
+  span path;
+  span version;
+  httpfield fields[MAXFIELDS];
+  int numFields;              /* a request with more than MAXFIELDS is refused */
+  long int length;            /* bytes of the buffer this request uses */
+} httprequest;
+
+/* an index of an already received header */
+typedef struct headerindex {
+  span first;                 /* the request or status line */
+  httpfield fields[MAXFIELDS];
+  int numFields;              /* fields beyond MAXFIELDS are dropped */
+} headerindex;
+
+/* one requested span of a file */
+typedef struct byterange {
+  long int first;             /* offset of the first byte */
+  long int length;            /* bytes in the span, at least 1 */
+} byterange;
+
+/* parser functions */
+int parseRequest(char* buf, long int len, long int* scanned,
+                 httprequest* req);
+httpfield* findField(httprequest* req, char* name);
+int spanCaseEquals(span s, char* str);
+int spanHasToken(span s, char* token);
+int spanHasETag(span s, char* etag);
+int spanAcceptsCoding(span s, char* coding);
+int spanCaseContains(span s, char* str);
+long int spanToLong(span s);
+int spanToRanges(span s, long int size, byterange* ranges, int max);
+char* spanDup(span s);
+
+/* header index functions */
+int indexHeader(char* buf, long int len, headerindex* idx);
+httpfield* indexFind(headerindex* idx, char* name);
+int scanFields(char* start, char* end, httpfield* fields, int max);
+int headerScanner(int level);
+
+#include "httpParser.c"
+#endif /* HTTPPARSER_H */
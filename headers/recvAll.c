@@ -2,11 +2,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <ctype.h>
+#include <string.h>
 
-#include "../functions/getHeaderField.c"
+#include "httpParser.h"
 #include "../functions/sendAll.c"
 #include "../functions/getStatusCode.c"
 
+/* helpers */
+static char* findHeaderTerminator(char* buf, long int from, long int length);
+
 /* Given a socket identifier and the address of an integer, 
  * this function will read everything possible from the socket
  * and return it, putting the size of the received block
@@ -32,11 +36,12 @@
  * @return A pointer to the received block of data, header AND body.
  */
 void* recvAll(int socket, long int* headerLength, long int* bodyLength) {
-  long int headerLen, bodyLen;
+  long int headerLen, bodyLen, extraLen;
   long int bytesReceived = 0;
   int bytes = 0;
+  void* grown;
 
-  void* header = recvHeader(socket, &headerLen, &bodyLen);
+  void* header = recvHeader(socket, &headerLen, &bodyLen, &extraLen);
   if (!header) {
     return NULL;
   }
@@ -47,9 +52,13 @@ void* recvAll(int socket, long int* headerLength, long int* bodyLength) {
     return header;
   }
 
-  /* it's a server response */
-  header = realloc(header, sizeof(char) * (headerLen + bodyLen));
-  if (!header) {
+  /* it's a server response; whatever came in with the header is the
+   * start of its body */
+  bytesReceived = (bodyLen > 0 && extraLen > bodyLen ? bodyLen : extraLen);
+  grown = realloc(header, sizeof(char) * (headerLen + 
+                                          (bodyLen > 0 ? bodyLen : extraLen)));
+  if (!grown) {
+    free(header);
 
     #ifdef DEBUG
       printf("Unable to allocate memory for expanded header + body!\n");
@@ -57,11 +66,16 @@ void* recvAll(int socket, long int* headerLength, long int* bodyLength) {
     
     return NULL;
   }
+  header = grown;
 
   while (bytesReceived < bodyLen) {
     char inputBuffer[20000];
+    long int want = bodyLen - bytesReceived; /* never past the body */
+    if (want > (long int)sizeof(inputBuffer) - 1) {
+      want = sizeof(inputBuffer) - 1;
+    }
     memset(&inputBuffer, 0, sizeof(inputBuffer));
-    bytes = recv(socket, inputBuffer, (sizeof(inputBuffer) - 1), 0);
+    bytes = recv(socket, inputBuffer, want, 0);
     if (bytes < 0) { /* error */
 
       #ifdef DEBUG
@@ -114,19 +128,23 @@ void* recvAll(int socket, long int* headerLength, long int* bodyLength) {
  * @return The number of bytes received over the socket connection.
  */
 long int recvAll_NoData(int socket, long int* bodyLength) {
-  long int bLen = 0, hLen = 0;
+  long int bLen = 0, hLen = 0, extra = 0;
   char inputBuffer[20000]; /* static input buffer */
   int bytes = 0;
   long int retVal = 0; /* initialize the return value */
 
   /* nab the header */
-  void* header = recvHeader(socket, &hLen, &bLen);
+  void* header = recvHeader(socket, &hLen, &bLen, &extra);
 
   free(header); /* that's it for memory allocations */
 
-  retVal = hLen; /* add up the header */
+  /* anything read past the header is the start of the body */
+  if (bLen >= 0 && extra > bLen) {
+    extra = bLen;
+  }
+  retVal = hLen + extra; /* add up the header */
 
-  (*bodyLength) = 0; /* set body length to 0 */
+  (*bodyLength) = extra; /* count the body read so far */
 
   #ifdef DEBUG
     printf("Advertised Content-Length: %ld\n", bLen);
@@ -152,12 +170,18 @@ long int recvAll_NoData(int socket, long int* bodyLength) {
 }
 
 /* To make receiving the body easier, this function retrieves only
- * the header, a single byte at a time, and returns that, along 
- * with setting the lengths of both the header and the body so
- * the caller will know exactly what they are dealing with.
+ * the header, and returns that, along with setting the lengths of both
+ * the header and the body so the caller will know exactly what they
+ * are dealing with.
  *
- * Using this function also prevents retrieving the header in chunks
- * and possibly splitting the \r\n\r\n delimeter.
+ * The header is read in chunks of up to HEADERCHUNK bytes rather than
+ * a byte at a time, so the last chunk will usually run past the end of
+ * the header and into the body.  Those bytes aren't lost: they are left
+ * in the returned buffer right behind the header, and extraLength says
+ * how many there are, so the caller can treat them as the start of the
+ * body (recvAll() and recvAll_Forward() both do).  The search for the
+ * \r\n\r\n delimeter backs up three bytes into what was already read,
+ * so a delimeter split across two chunks is still found.
  *
  * @param socket The socket identifier from which to receive.
  * @param headerLength Upon function exit, indicates the length in bytes
@@ -165,72 +189,82 @@ long int recvAll_NoData(int socket, long int* bodyLength) {
  * @param bodyLength Upon function exit, indicates the length in bytes
  *                   of the body (as specified by Content-Length). This
  *                   will be 0 if the header was a request from the client.
+ * @param extraLength Upon function exit, indicates how many bytes past
+ *                    the end of the header were read along with it.
  * @return A dynamically allocated buffer with the entire header's data
- *         in it.  Its length will be specified by headerLength. Caller
- *         will need to explicitly free() this buffer.
+ *         in it, followed by the extra bytes.  Its length will be
+ *         headerLength + extraLength. Caller will need to explicitly
+ *         free() this buffer.
  */
-void* recvHeader(int socket, long int* headerLength, long int* bodyLength) {
-  char inputChar[5];   /* array of 4 chars */
-  char* bLength;       /* will hold Content-Length: xxxxx */
-  int bytes = 0;       /* sanity check */
-  void* retVal = NULL; /* initialize return value */
-  (*headerLength) = 0; /* initialize length */
-  (*bodyLength) = 0;   /* initialize body size */
-
-  memset(&inputChar, 0, sizeof(inputChar));
-
-  /* start receiving, one byte at a time */
-  do {
-
-    /* move all the bytes down one */
-    inputChar[3] = inputChar[2];
-    inputChar[2] = inputChar[1];
-    inputChar[1] = inputChar[0];
-    
-    /* receive a byte on the socket ... goes in inputChar[0] */
-    bytes = recv(socket, inputChar, sizeof(char), 0);
+void* recvHeader(int socket, long int* headerLength, long int* bodyLength,
+                 long int* extraLength) {
+  httpfield* bLength;   /* will hold Content-Length: xxxxx */
+  headerindex index;    /* the header's fields */
+  char* retVal = NULL;  /* initialize return value */
+  char* end = NULL;     /* end of the header, once it's found */
+  long int size = 0;    /* bytes allocated */
+  long int length = 0;  /* bytes received */
+  long int bytes = 0;   /* sanity check */
+  (*headerLength) = 0;  /* initialize length */
+  (*bodyLength) = 0;    /* initialize body size */
+  (*extraLength) = 0;   /* initialize over-read size */
+
+  /* start receiving, a chunk at a time */
+  while (!end) {
+
+    /* make sure there's always a full chunk of room */
+    if (size - length < HEADERCHUNK) {
+      char* grown = realloc(retVal, sizeof(char) * (size + HEADERCHUNK));
+      if (!grown) {
+
+        #ifdef DEBUG
+          printf("Reallocation of header failed.\n");
+        #endif
+
+        free(retVal);
+        return NULL;
+      }
+      retVal = grown;
+      size += HEADERCHUNK;
+    }
+
+    bytes = recv(socket, retVal + length, size - length, 0);
     if (bytes < 0) { /* error */
 
       #ifdef DEBUG
         printf("A socket error occurred while receiving the header.\n");
-        printf("Bytes received: %ld\n", (*headerLength));
-        printf("Header received: %s\n", (char*)retVal);
+        printf("Bytes received: %ld\n", length);
       #endif
 
+      free(retVal);
       return NULL;
     } else if (bytes == 0) { /* connection closed */
+      if (length == 0) {
+        free(retVal);
+        return NULL;
+      }
+      (*headerLength) = length;
       return retVal;
     }
 
-    /* reallocate the buffer with enough room */
-    retVal = realloc(retVal, sizeof(char) * ((*headerLength) + bytes));
-    if (!retVal) {
-
-      #ifdef DEBUG
-        printf("Reallocation of header failed.\n");
-      #endif
-
-      return NULL;
-    }
-
-    /* copy over the new character */
-    memcpy((char*)retVal + (*headerLength), &inputChar, bytes);
-
-    /* we have a single character */
-    (*headerLength) += bytes;
-  } while (!strstr(inputChar, "\n\r\n\r")); /* end of header */
+    /* look for the blank line, starting just before the new bytes */
+    end = findHeaderTerminator(retVal, (length > 3 ? length - 3 : 0),
+                               length + bytes);
+    length += bytes;
+  }
 
-  /* this stumped me for a little while...gotta look for that
-   * string in the REVERSE one would normally expect, since I'll be
-   * retrieving it one character at a time and shifting it to the right,
-   * thereby reversing the string.
-   */
+  (*headerLength) = (end - retVal);
+  (*extraLength) = length - (*headerLength);
 
   /* now let's hunt for the Content-Length */
-  if ((bLength = getHeaderField(retVal, (*headerLength), "Content-Length"))) {
+  indexHeader(retVal, (*headerLength), &index);
+  if ((bLength = indexFind(&index, "Content-Length"))) {
     /* found Content-Length */
 
-    (*bodyLength) = atoi(bLength); /* word */
+    (*bodyLength) = spanToLong(bLength->value); /* word */
+    if ((*bodyLength) < 0) { /* not a number; take what comes */
+      (*bodyLength) = -1;
+    }
   } else if (getStatusCode(retVal, (*headerLength)) == 200) {
     /* got an OK from the server, nab that data! */
 
@@ -241,18 +275,31 @@ void* recvHeader(int socket, long int* headerLength, long int* bodyLength) {
     #endif
   }
 
-  /* free the temp string, if needed */
-  if (bLength) {
-    free(bLength);
-  }
-
   #ifdef DEBUG
-    printf("Header Length: %ld\n", (*headerLength));
+    printf("Header Length: %ld (%ld extra bytes read)\n", 
+           (*headerLength), (*extraLength));
   #endif
 
   return retVal;
 }
 
+/* Looks for the \r\n\r\n ending a header in buf[from, length).
+ *
+ * @return A pointer just past the delimeter, or NULL if it isn't there.
+ */
+static char* findHeaderTerminator(char* buf, long int from, long int length) {
+  char* p = buf + from, *last = buf + length - 4;
+
+  while (p <= last && (p = memchr(p, '\r', (last - p) + 1))) {
+    if (memcmp(p, "\r\n\r\n", 4) == 0) {
+      return p + 4;
+    }
+    p++;
+  }
+
+  return NULL;
+}
+
 /* This function is identical to recvHeader(), except that instead of reading
  * from a socket, this function will read directly from mapped memory, 
  * returning the header.
@@ -267,7 +314,9 @@ void* recvHeader(int socket, long int* headerLength, long int* bodyLength) {
  * @return A pointer to just the header. This must be freed by the caller!
  */
 void* recvHeader_Mem(void* mem, long int* headerLength, long int* bodyLength) {
-  char* bLength, *endOfHeader;
+  char* endOfHeader;
+  httpfield* bLength;
+  headerindex index;
   void* retval;
   (*headerLength) = 0;
   (*bodyLength) = 0;
@@ -298,8 +347,9 @@ void* recvHeader_Mem(void* mem, long int* headerLength, long int* bodyLength) {
   memcpy(retval, mem, (*headerLength));
 
   /* we have the header, now get the body length and get outta here */
-  if ((bLength = getHeaderField(retval, (*headerLength), "Content-Length"))) {
-    (*bodyLength) = atoi(bLength);
+  indexHeader(retval, (*headerLength), &index);
+  if ((bLength = indexFind(&index, "Content-Length"))) {
+    (*bodyLength) = spanToLong(bLength->value);
   } else if (getStatusCode(retval, (*headerLength)) == 200) {
     /* server returned with OK, but didn't supply a content-length? */
     (*bodyLength) = -1;
@@ -309,10 +359,6 @@ void* recvHeader_Mem(void* mem, long int* headerLength, long int* bodyLength) {
     #endif
   }
 
-  if (bLength) {
-    free(bLength);
-  }
-
   #ifdef DEBUG
     printf("recvAll.c: recvHeader_Mem reports header length: %ld\n", (*headerLength));
   #endif
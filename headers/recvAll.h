@@ -1,9 +1,12 @@
 #ifndef _RECVALL_
 #define _RECVALL_
 
+#include "httpParser.h" /* for headerindex */
+
 void* recvAll(int socket, long int* headerLength, long int* bodyLength);
 long int recvAll_NoData(int socket, long int* bodyLength);
-void* recvHeader(int socket, long int* headerLength, long int* bodyLength);
+void* recvHeader(int socket, long int* headerLength, long int* bodyLength,
+                 long int* extraLength);
 void* recvHeader_Mem(void* mem, long int* headerLength, 
                      long int* bodyLength);
 void* recvBody_Mem(void* mem, long int bodyLength, long int* bytesCopied,
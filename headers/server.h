@@ -8,7 +8,16 @@
 #include "constants.h"
 #include "returncodes.h"
 #include "conList.h"
+#include "conRing.h"
+#include "workerPool.h"
+#include "httpParser.h"
 #include "memList.h"
+#include "fileCache.h"
+#include "compressPool.h"
+#include "strBuilder.h"
+#include "arena.h"
+#include "uring.h"
+#include "handoff.h"
 
 /* implementations */
 
@@ -17,11 +26,12 @@
 #include "../functions/sendAll.c"
 #include "recvAll.h"
 #include "../functions/copyLength.c"
-#include "../functions/appendStr.c"
 #include "../functions/contentType.c"
 #include "../functions/fileContents.c"
 #include "../functions/strDecode.c"
+#include "../functions/normalizePath.c"
 #include "../functions/isOptimized.c"
+#include "../functions/getFlagValue.c"
 #include "../functions/printArgs.c"
 
 #endif /* _SERVER_ */
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "strBuilder.h"
+
+/* helpers */
+static int reserve(strbuilder* b, long int more);
+
+/* Starts an empty string.
+ *
+ * @param b The builder.
+ * @param size A guess at how many bytes the string will need.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int initBuilder(strbuilder* b, long int size) {
+  b->len    = 0;
+  b->size   = (size > 0 ? size : 64);
+  b->failed = 0;
+  if (!(b->str = malloc(b->size))) {
+    b->size   = 0;
+    b->failed = 1;
+    return -1;
+  }
+  b->str[0] = '\0';
+
+  return 0;
+}
+
+/* Adds bytes to the end of the string.
+ *
+ * @param b The builder.
+ * @param str The bytes to add.
+ * @param len How many; -1 to take strlen(str).
+ * @return 0 on success, -1 if the builder has failed.
+ */
+int builderAppend(strbuilder* b, char* str, long int len) {
+  if (len < 0) {
+    len = strlen(str);
+  }
+  if (reserve(b, len) < 0) {
+    return -1;
+  }
+
+  memcpy(b->str + b->len, str, len);
+  b->len += len;
+  b->str[b->len] = '\0';
+
+  return 0;
+}
+
+/* Adds formatted text to the end of the string, a la printf().
+ *
+ * @param b The builder.
+ * @param format The printf() format.
+ * @return 0 on success, -1 if the builder has failed.
+ */
+int builderPrintf(strbuilder* b, char* format, ...) {
+  va_list args;
+  long int len;
+
+  if (b->failed) {
+    return -1;
+  }
+
+  /* try to fit it in what's left, and make room if it didn't */
+  va_start(args, format);
+  len = vsnprintf(b->str + b->len, b->size - b->len, format, args);
+  va_end(args);
+  if (len < 0) {
+    b->failed = 1;
+    return -1;
+  }
+  if (len >= b->size - b->len) {
+    if (reserve(b, len) < 0) {
+      return -1;
+    }
+    va_start(args, format);
+    vsnprintf(b->str + b->len, b->size - b->len, format, args);
+    va_end(args);
+  }
+  b->len += len;
+
+  return 0;
+}
+
+/* Hands the finished string over to the caller, who must free() it,
+ * and leaves the builder empty.
+ *
+ * @param b The builder.
+ * @param len Set to the length of the string.
+ * @return The string, or NULL if the builder failed along the way.
+ */
+char* builderTake(strbuilder* b, long int* len) {
+  char* str = b->str;
+
+  if (b->failed) {
+    freeBuilder(b);
+    return NULL;
+  }
+  *len = b->len;
+  b->str  = NULL;
+  b->len  = 0;
+  b->size = 0;
+
+  return str;
+}
+
+/* Throws away the string. */
+void freeBuilder(strbuilder* b) {
+  free(b->str);
+  b->str  = NULL;
+  b->len  = 0;
+  b->size = 0;
+}
+
+/* Makes sure there's room for "more" bytes plus the NULL, at least
+ * doubling the buffer when it has to grow.
+ *
+ * @return 0 on success, -1 if the builder has failed.
+ */
+static int reserve(strbuilder* b, long int more) {
+  long int size = b->size;
+  char* grown;
+
+  if (b->failed) {
+    return -1;
+  }
+  if (b->len + more < b->size) { /* already fits */
+    return 0;
+  }
+
+  while (size <= b->len + more) {
+    size = (size > 0 ? size * 2 : 64);
+  }
+  if (!(grown = realloc(b->str, size))) {
+    b->failed = 1;
+    return -1;
+  }
+  b->str  = grown;
+  b->size = size;
+
+  return 0;
+}
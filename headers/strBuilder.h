@@ -0,0 +1,37 @@
+#ifndef STRBUILDER_H
+#define STRBUILDER_H
+
+#include <stdlib.h>
+
+/* This file stores everything regarding string builders, which put a
+ * string together a piece at a time (a directory listing, say) without
+ * copying or measuring what's already there for every piece added.
+ *
+ * The type "strbuilder" is the string so far: the buffer, the number of
+ * bytes in use, and the number allocated.  The buffer at least doubles
+ * whenever it runs out, so building a string of n bytes costs O(n) no
+ * matter how many pieces it arrives in.  The string is always kept
+ * NULL-terminated.
+ *
+ * If memory ever runs out, the builder remembers, ignores anything
+ * else appended, and reports the failure from then on; the caller only
+ * needs to check once, at the end.
+ */
+
+/* a string under construction */
+typedef struct strbuilder {
+  char* str;        /* the string so far */
+  long int len;     /* bytes in use, not counting the NULL */
+  long int size;    /* bytes allocated */
+  int failed;       /* did an allocation fail along the way? */
+} strbuilder;
+
+/* builder functions */
+int initBuilder(strbuilder* b, long int size);
+int builderAppend(strbuilder* b, char* str, long int len);
+int builderPrintf(strbuilder* b, char* format, ...);
+char* builderTake(strbuilder* b, long int* len);
+void freeBuilder(strbuilder* b);
+
+#include "strBuilder.c"
+#endif /* STRBUILDER_H */
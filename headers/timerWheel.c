@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "timerWheel.h"
+
+/* helpers */
+static unsigned long int wheelClock(long int tick);
+static void place(timerwheel* w, timer* t);
+static void cascade(timerwheel* w, int level, int slot);
+static void* watchLoop(void* args);
+
+/* Sets up an empty wheel.
+ *
+ * @param w The wheel.
+ * @param tick Milliseconds in a tick, the finest a deadline can be.
+ */
+void initWheel(timerwheel* w, long int tick) {
+  int i, j;
+
+  for (i = 0; i < WHEEL_LEVELS; i++) {
+    for (j = 0; j < WHEEL_SLOTS; j++) {
+      w->slots[i][j].next = &(w->slots[i][j]);
+      w->slots[i][j].prev = &(w->slots[i][j]);
+    }
+  }
+  w->tick = tick;
+  w->now  = wheelClock(tick);
+}
+
+/* Sets up a timer that isn't running.
+ *
+ * @param t The timer.
+ * @param data What it belongs to, for the expiry function.
+ */
+void initTimer(timer* t, void* data) {
+  t->next    = NULL;
+  t->prev    = NULL;
+  t->expires = 0;
+  t->kind    = 0;
+  t->data    = data;
+}
+
+/* Starts a timer, or moves it if it's already running.
+ *
+ * @param w The wheel.
+ * @param t The timer.
+ * @param kind What the deadline is for; anything but 0.
+ * @param ms Milliseconds from now.  It runs out on the first tick after.
+ */
+void wheelSet(timerwheel* w, timer* t, int kind, long int ms) {
+  long int ticks = (ms + w->tick - 1) / w->tick;
+
+  wheelCancel(w, t);
+  t->expires = wheelClock(w->tick) + (ticks > 0 ? ticks : 1); /* not w->now, which lags */
+  t->kind = kind;
+  place(w, t);
+}
+
+/* Stops a timer, if it's running.
+ *
+ * @param w The wheel.
+ * @param t The timer.
+ */
+void wheelCancel(timerwheel* w, timer* t) {
+  if (t->next) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+  }
+  t->kind = 0;
+}
+
+/* Brings the wheel up to the present, calling the expiry function for
+ * every timer that ran out along the way.  Each is stopped before its
+ * expiry function sees it, so the function is free to set it again, or
+ * to free whatever it's kept in.
+ *
+ * @param w The wheel.
+ * @param expire The expiry function, given the timer, what it was for,
+ *               and arg.
+ * @param arg Passed to the expiry function.
+ * @return The number of timers that ran out.
+ */
+int wheelTurn(timerwheel* w, expirefn expire, void* arg) {
+  unsigned long int target = wheelClock(w->tick);
+  timer* head, *t;
+  int level, fired = 0, kind;
+
+  while (w->now < target) {
+    w->now++;
+
+    /* a ring that's come round takes the next slot from the one above */
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+      if (w->now & ((1UL << (WHEEL_BITS * level)) - 1)) {
+        break;
+      }
+      cascade(w, level, (w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    }
+
+    head = &(w->slots[0][w->now & (WHEEL_SLOTS - 1)]);
+    while ((t = head->next) != head) {
+      kind = t->kind;
+      wheelCancel(w, t);
+      expire(t, kind, arg);
+      fired++;
+    }
+  }
+
+  return fired;
+}
+
+/* Builds a watchdog, and starts the thread that turns it.
+ *
+ * @param tick Milliseconds in a tick.
+ * @param expire Called, with the lock held, for each timer that runs out.
+ * @param arg Passed to the expiry function.
+ * @return A new watchdog, or NULL on failure.
+ */
+watchdog* newWatchdog(long int tick, expirefn expire, void* arg) {
+  watchdog* d;
+
+  if (!(d = calloc(1, sizeof(watchdog)))) {
+    return NULL;
+  }
+  initWheel(&(d->wheel), tick);
+  pthread_mutex_init(&(d->mutex), NULL);
+  d->expire = expire;
+  d->arg = arg;
+
+  if (pthread_create(&(d->thread), NULL, watchLoop, d) != 0) {
+    pthread_mutex_destroy(&(d->mutex));
+    free(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+/* wheelSet(), for a watchdog. */
+void watchSet(watchdog* d, timer* t, int kind, long int ms) {
+  pthread_mutex_lock(&(d->mutex));
+  wheelSet(&(d->wheel), t, kind, ms);
+  pthread_mutex_unlock(&(d->mutex));
+}
+
+/* wheelCancel(), for a watchdog.  Once this returns, the timer can't
+ * run out, even if it was just about to.
+ */
+void watchCancel(watchdog* d, timer* t) {
+  pthread_mutex_lock(&(d->mutex));
+  wheelCancel(&(d->wheel), t);
+  pthread_mutex_unlock(&(d->mutex));
+}
+
+/* Stops a watchdog's thread and frees it.  Any timers still running
+ * are forgotten.
+ */
+void destroyWatchdog(watchdog* d) {
+  __atomic_store_n(&(d->stopping), 1, __ATOMIC_SEQ_CST);
+  pthread_join(d->thread, NULL);
+  pthread_mutex_destroy(&(d->mutex));
+  free(d);
+}
+
+/* The current tick, counted from some fixed point in the past. */
+static unsigned long int wheelClock(long int tick) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec * 1000UL + now.tv_nsec / 1000000) / tick;
+}
+
+/* Puts a timer in the slot it belongs in, given how far off it is. */
+static void place(timerwheel* w, timer* t) {
+  unsigned long int delta = (t->expires > w->now ? t->expires - w->now : 0);
+  unsigned long int limit = (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  timer* head;
+  int level = 0;
+
+  /* nothing's that patient; it'll just be put off again when it comes up */
+  if (delta > limit) {
+    delta = limit;
+    t->expires = w->now + limit;
+  }
+  while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+
+  /* overdue timers go in the slot being handled right now */
+  head = &(w->slots[level][((delta ? t->expires : w->now) >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+/* Empties one slot of a higher ring into the rings below it. */
+static void cascade(timerwheel* w, int level, int slot) {
+  timer* head = &(w->slots[level][slot]);
+  timer* t, *next;
+
+  t = head->next;
+  head->next = head;
+  head->prev = head;
+  while (t != head) {
+    next = t->next;
+    place(w, t);
+    t = next;
+  }
+}
+
+/* The watchdog's thread: turns the wheel once a tick until stopped. */
+static void* watchLoop(void* args) {
+  watchdog* d = (watchdog*)args;
+  struct timespec pause;
+
+  pause.tv_sec  = d->wheel.tick / 1000;
+  pause.tv_nsec = (d->wheel.tick % 1000) * 1000000L;
+
+  while (!__atomic_load_n(&(d->stopping), __ATOMIC_SEQ_CST)) {
+    nanosleep(&pause, NULL);
+    pthread_mutex_lock(&(d->mutex));
+    wheelTurn(&(d->wheel), d->expire, d->arg);
+    pthread_mutex_unlock(&(d->mutex));
+  }
+
+  return NULL;
+}
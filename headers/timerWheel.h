@@ -0,0 +1,81 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "constants.h" /* for the wheel's shape */
+
+/* This file stores everything regarding timer wheels, which keep track
+ * of when every connection's current deadline runs out.
+ *
+ * A wheel is WHEEL_LEVELS rings of WHEEL_SLOTS slots each.  A timer due
+ * within WHEEL_SLOTS ticks goes in the bottom ring, in the slot for the
+ * tick it's due on; one due later goes in a higher ring, whose slots
+ * each cover a whole turn of the ring below.  Every time a ring comes
+ * round to its start, the next slot of the ring above is emptied into
+ * it.  Setting, moving, or cancelling a timer is a constant amount of
+ * work, however many there are, and so is each tick; nothing is ever
+ * searched or sorted.  A timer that's cancelled before it's due, which
+ * is what almost all of them are, costs next to nothing.
+ *
+ * A wheel isn't thread-safe on its own.  An event loop owns one and
+ * turns it with wheelTurn() as it goes around.  Threads that block on
+ * their sockets share a watchdog instead, a wheel with a lock and a
+ * thread of its own to turn it, whose expiry function is called with
+ * the lock held; a timer cancelled with watchCancel() is guaranteed not
+ * to fire after it returns.
+ *
+ * The type "timer" is one deadline, kept inside whatever it's for.
+ *
+ * The type "timerwheel" is the wheel.
+ *
+ * The type "watchdog" is a wheel shared between threads.
+ */
+
+/* what to do with a timer that runs out */
+struct timer;
+typedef void (*expirefn)(struct timer* t, int kind, void* arg);
+
+/* one deadline */
+typedef struct timer {
+  struct timer* next;         /* NULL when not set */
+  struct timer* prev;
+  unsigned long int expires;  /* the tick it runs out on */
+  int kind;                   /* what it's for; 0 when not set */
+  void* data;                 /* whatever it belongs to */
+} timer;
+
+/* the wheel */
+typedef struct timerwheel {
+  timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; /* each the head of a list */
+  unsigned long int now;      /* the last tick handled */
+  long int tick;              /* milliseconds in a tick */
+} timerwheel;
+
+/* a wheel shared between threads */
+typedef struct watchdog {
+  timerwheel wheel;
+  pthread_mutex_t mutex;
+  pthread_t thread;
+  int stopping;
+  expirefn expire;
+  void* arg;
+} watchdog;
+
+/* wheel functions */
+void initWheel(timerwheel* w, long int tick);
+void initTimer(timer* t, void* data);
+void wheelSet(timerwheel* w, timer* t, int kind, long int ms);
+void wheelCancel(timerwheel* w, timer* t);
+int wheelTurn(timerwheel* w, expirefn expire, void* arg);
+
+/* watchdog functions */
+watchdog* newWatchdog(long int tick, expirefn expire, void* arg);
+void watchSet(watchdog* d, timer* t, int kind, long int ms);
+void watchCancel(watchdog* d, timer* t);
+void destroyWatchdog(watchdog* d);
+
+#include "timerWheel.c"
+#endif /* TIMERWHEEL_H */
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* the one group of provided buffers each uring has */
+#define URING_GROUP 0
+
+/* helpers */
+static int uringEnter(uring* r, unsigned wait, unsigned flags, void* arg,
+                      size_t argLen);
+static int uringProbe(uring* r);
+static int uringProbeRecv(uring* r);
+
+/* Checks whether the kernel can do everything the event loops need
+ * from io_uring: multishot accepts straight into registered files,
+ * multishot receives into provided buffer rings, and splicing.  That
+ * means Linux 6.0 or newer, with io_uring not switched off.
+ *
+ * @return 1 if it can, 0 otherwise.
+ */
+int uringAvailable(void) {
+  uring r;
+  int ok;
+
+  if (initUring(&r, 8) < 0) {
+    return 0;
+  }
+  ok = (uringProbe(&r) == 0 && uringFiles(&r, 1) == 0 &&
+        uringBuffers(&r, 1, 64) == 0 && uringProbeRecv(&r) == 0);
+  freeUring(&r);
+
+  return ok;
+}
+
+/* Sets up a uring for the calling thread, which must be the only one
+ * that ever submits to it.
+ *
+ * @param r The uring.
+ * @param entries The most requests that can be waiting to be submitted.
+ * @return 0 on success, -1 if io_uring is unavailable or too old.
+ */
+int initUring(uring* r, unsigned entries) {
+  struct io_uring_params p;
+  unsigned i;
+
+  memset(r, 0, sizeof(uring));
+  memset(&p, 0, sizeof(p));
+
+  /* nobody else submits, so the kernel can skip some locking and save
+   * completion work for when we ask for it; older kernels don't know
+   * these flags */
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  }
+  if (r->fd < 0) {
+    return -1;
+  }
+  r->features = p.features;
+  if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+    close(r->fd);
+    return -1;
+  }
+
+  /* map the queues; newer kernels share one mapping between them */
+  r->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cqMapLen > r->sqMapLen) {
+      r->sqMapLen = r->cqMapLen;
+    }
+    r->cqMapLen = 0;
+  }
+  r->sqMap = mmap(NULL, r->sqMapLen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sqMap == MAP_FAILED) {
+    close(r->fd);
+    return -1;
+  }
+  r->cqMap = r->sqMap;
+  if (r->cqMapLen && (r->cqMap = mmap(NULL, r->cqMapLen, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, r->fd,
+                                      IORING_OFF_CQ_RING)) == MAP_FAILED) {
+    munmap(r->sqMap, r->sqMapLen);
+    close(r->fd);
+    return -1;
+  }
+  r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    if (r->cqMapLen) {
+      munmap(r->cqMap, r->cqMapLen);
+    }
+    munmap(r->sqMap, r->sqMapLen);
+    close(r->fd);
+    return -1;
+  }
+
+  r->sqHead    = (unsigned*)((char*)r->sqMap + p.sq_off.head);
+  r->sqTail    = (unsigned*)((char*)r->sqMap + p.sq_off.tail);
+  r->sqArray   = (unsigned*)((char*)r->sqMap + p.sq_off.array);
+  r->sqMask    = *(unsigned*)((char*)r->sqMap + p.sq_off.ring_mask);
+  r->sqEntries = *(unsigned*)((char*)r->sqMap + p.sq_off.ring_entries);
+  r->sqLocal   = *(r->sqTail);
+  r->cqHead    = (unsigned*)((char*)r->cqMap + p.cq_off.head);
+  r->cqTail    = (unsigned*)((char*)r->cqMap + p.cq_off.tail);
+  r->cqMask    = *(unsigned*)((char*)r->cqMap + p.cq_off.ring_mask);
+  r->cqes      = (struct io_uring_cqe*)((char*)r->cqMap + p.cq_off.cqes);
+
+  /* entries are always used in order, so the indirection is fixed */
+  for (i = 0; i < r->sqEntries; i++) {
+    r->sqArray[i] = i;
+  }
+
+  return 0;
+}
+
+/* Gives a uring a table of registered files, all empty to begin with,
+ * for accepts to fill with IORING_FILE_INDEX_ALLOC.
+ *
+ * @param r The uring.
+ * @param count The size of the table.
+ * @return 0 on success, -1 on failure.
+ */
+int uringFiles(uring* r, unsigned count) {
+  struct io_uring_rsrc_register reg;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.nr    = count;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+  return (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES2,
+                  &reg, sizeof(reg)) < 0 ? -1 : 0);
+}
+
+/* Gives a uring a ring of provided buffers, for receives that set
+ * IOSQE_BUFFER_SELECT with URING_GROUP as their group.
+ *
+ * @param r The uring.
+ * @param count The number of buffers; must be a power of two.
+ * @param size The size of each.
+ * @return 0 on success, -1 on failure.
+ */
+int uringBuffers(uring* r, unsigned count, unsigned size) {
+  struct io_uring_buf_reg reg;
+  size_t ringLen = count * sizeof(struct io_uring_buf);
+  unsigned i;
+
+  /* the ring has to be page aligned, which mmap() always is */
+  r->bufRing = mmap(NULL, ringLen, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->bufRing == MAP_FAILED) {
+    r->bufRing = NULL;
+    return -1;
+  }
+  if (!(r->bufs = malloc((size_t)count * size))) {
+    munmap(r->bufRing, ringLen);
+    r->bufRing = NULL;
+    return -1;
+  }
+  r->bufCount = count;
+  r->bufSize  = size;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uintptr_t)r->bufRing;
+  reg.ring_entries = count;
+  reg.bgid         = URING_GROUP;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    return -1; /* freeUring() cleans up */
+  }
+
+  /* hand every buffer to the kernel */
+  for (i = 0; i < count; i++) {
+    r->bufRing->bufs[i].addr = (uintptr_t)(r->bufs + (size_t)i * size);
+    r->bufRing->bufs[i].len  = size;
+    r->bufRing->bufs[i].bid  = i;
+  }
+  r->bufTail = count;
+  __atomic_store_n(&(r->bufRing->tail), r->bufTail, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Hands out the next free submission queue entry, cleared.  If the
+ * queue is full, what's in it is submitted first.
+ *
+ * @param r The uring.
+ * @return The entry, or NULL if the kernel wouldn't take any more.
+ */
+struct io_uring_sqe* uringSqe(uring* r) {
+  struct io_uring_sqe* sqe;
+
+  if (r->sqLocal - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries) {
+    uringEnter(r, 0, 0, NULL, 0);
+    if (r->sqLocal - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries) {
+      return NULL;
+    }
+  }
+
+  sqe = &(r->sqes[r->sqLocal & r->sqMask]);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sqLocal++;
+
+  return sqe;
+}
+
+/* Submits everything filled in since last time, then waits until
+ * something has completed or the timeout passes.  This is the only
+ * system call a busy uring makes.
+ *
+ * @param r The uring.
+ * @param timeout Milliseconds to wait at most.
+ * @return 0 on success (including a timeout), -1 on failure.
+ */
+int uringWait(uring* r, int timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned wait;
+
+  ts.tv_sec  = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000L;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uintptr_t)&ts;
+
+  /* don't sleep if there are completions to read already */
+  wait = (*(r->cqHead) == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE));
+
+  if (uringEnter(r, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                 &arg, sizeof(arg)) < 0 &&
+      errno != ETIME && errno != EINTR && errno != EBUSY) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Returns the oldest completion not yet seen, or NULL if there isn't one.
+ * Call uringSeen() once done with it.
+ */
+struct io_uring_cqe* uringPeek(uring* r) {
+  unsigned head = *(r->cqHead);
+
+  if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return &(r->cqes[head & r->cqMask]);
+}
+
+/* Lets go of the completion uringPeek() returned, so the kernel can
+ * reuse its slot.
+ */
+void uringSeen(uring* r) {
+  __atomic_store_n(r->cqHead, *(r->cqHead) + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the provided buffer a completion's data was put in.
+ *
+ * @param r The uring.
+ * @param cqe A completion with IORING_CQE_F_BUFFER set.
+ * @return The buffer.
+ */
+char* uringBuffer(uring* r, struct io_uring_cqe* cqe) {
+  return r->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * r->bufSize;
+}
+
+/* Gives a completion's provided buffer back to the kernel, once its
+ * contents have been copied out.
+ *
+ * @param r The uring.
+ * @param cqe A completion with IORING_CQE_F_BUFFER set.
+ */
+void uringRecycle(uring* r, struct io_uring_cqe* cqe) {
+  unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  struct io_uring_buf* buf = &(r->bufRing->bufs[r->bufTail & (r->bufCount - 1)]);
+
+  buf->addr = (uintptr_t)(r->bufs + (size_t)id * r->bufSize);
+  buf->len  = r->bufSize;
+  buf->bid  = id;
+  r->bufTail++;
+  __atomic_store_n(&(r->bufRing->tail), r->bufTail, __ATOMIC_RELEASE);
+}
+
+/* Empties one slot of the registered file table right away, closing
+ * what was in it.  For when there's no submission entry to do it with.
+ *
+ * @param r The uring.
+ * @param index The slot.
+ * @return 0 on success, -1 on failure.
+ */
+int uringDrop(uring* r, unsigned index) {
+  struct io_uring_rsrc_update2 up;
+  int fd = -1;
+
+  memset(&up, 0, sizeof(up));
+  up.offset = index;
+  up.data   = (uintptr_t)&fd;
+  up.nr     = 1;
+
+  return (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE2,
+                  &up, sizeof(up)) < 0 ? -1 : 0);
+}
+
+/* Tears a uring down.  Closing it cancels whatever was still pending,
+ * and closes every registered file.
+ */
+void freeUring(uring* r) {
+  close(r->fd);
+  munmap(r->sqes, r->sqesLen);
+  if (r->cqMapLen) {
+    munmap(r->cqMap, r->cqMapLen);
+  }
+  munmap(r->sqMap, r->sqMapLen);
+  if (r->bufRing) {
+    munmap(r->bufRing, r->bufCount * sizeof(struct io_uring_buf));
+  }
+  free(r->bufs);
+}
+
+/* Publishes the submission queue and calls into the kernel. */
+static int uringEnter(uring* r, unsigned wait, unsigned flags, void* arg,
+                      size_t argLen) {
+  unsigned submit;
+
+  __atomic_store_n(r->sqTail, r->sqLocal, __ATOMIC_RELEASE);
+  submit = r->sqLocal - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+
+  return syscall(__NR_io_uring_enter, r->fd, submit, wait, flags, arg, argLen);
+}
+
+/* Makes sure the kernel knows every opcode the event loops use.
+ *
+ * @return 0 if it does, -1 otherwise.
+ */
+static int uringProbe(uring* r) {
+  int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                IORING_OP_SPLICE, IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL };
+  struct io_uring_probe* probe;
+  int i, ok = 0;
+
+  if (!(probe = calloc(1, sizeof(struct io_uring_probe) +
+                          256 * sizeof(struct io_uring_probe_op)))) {
+    return -1;
+  }
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+    ok = 1;
+    for (i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+      if (ops[i] > probe->last_op ||
+          !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+        ok = 0;
+      }
+    }
+  }
+  free(probe);
+
+  return (ok ? 0 : -1);
+}
+
+/* Makes sure the kernel can keep a receive armed across completions,
+ * which the opcode probe can't tell, by arming one on a socket pair and
+ * seeing what comes back.  Kernels before 6.0 refuse it.
+ *
+ * @return 0 if it can, -1 otherwise.
+ */
+static int uringProbeRecv(uring* r) {
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  int sv[2], ok = 0;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return -1;
+  }
+  if ((sqe = uringSqe(r))) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    if (write(sv[1], "x", 1) == 1 && uringWait(r, 1000) == 0 &&
+        (cqe = uringPeek(r))) {
+      ok = (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE));
+      uringSeen(r);
+    }
+  }
+  close(sv[0]);
+  close(sv[1]);
+
+  return (ok ? 0 : -1);
+}
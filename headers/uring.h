@@ -0,0 +1,84 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <linux/io_uring.h>
+
+#include "constants.h" /* for URING_ENTRIES and friends */
+
+/* This file stores everything regarding urings, a thin layer over the
+ * kernel's io_uring interface for the event loops that use it.  There
+ * is no liburing here; the rings are set up with the raw system calls
+ * and mapped into memory, and submissions and completions are read and
+ * written in place.
+ *
+ * A uring belongs to one thread.  Requests are described by filling in
+ * submission queue entries from uringSqe(); nothing reaches the kernel
+ * until uringWait(), which submits everything at once and waits for at
+ * least one completion, so a busy loop does a single system call for
+ * everything it has to do in one pass.  Completions are then read with
+ * uringPeek() and let go of with uringSeen().
+ *
+ * A uring can also have a table of registered files, so sockets can be
+ * accepted straight into it and used without the kernel looking up a
+ * descriptor on every request, and a ring of provided buffers, which
+ * the kernel fills as data arrives instead of needing a buffer handed
+ * to every receive up front.  Once a completion's buffer has been read,
+ * uringRecycle() gives it back.
+ *
+ * The type "uring" is the ring itself: the mapped queues, and the
+ * provided buffers, if any.
+ */
+
+/* a uring */
+typedef struct uring {
+  int fd;
+  unsigned features;
+
+  /* submission queue */
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqArray;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned sqLocal;           /* our tail, not yet published */
+  struct io_uring_sqe* sqes;
+
+  /* completion queue */
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+
+  /* the mappings, for freeUring() */
+  void* sqMap;
+  void* cqMap;
+  size_t sqMapLen;
+  size_t cqMapLen;
+  size_t sqesLen;
+
+  /* provided buffers */
+  struct io_uring_buf_ring* bufRing;
+  char* bufs;
+  unsigned bufCount;
+  unsigned bufSize;
+  unsigned short bufTail;
+} uring;
+
+/* uring functions */
+int uringAvailable(void);
+int initUring(uring* r, unsigned entries);
+int uringFiles(uring* r, unsigned count);
+int uringBuffers(uring* r, unsigned count, unsigned size);
+struct io_uring_sqe* uringSqe(uring* r);
+int uringWait(uring* r, int timeout);
+struct io_uring_cqe* uringPeek(uring* r);
+void uringSeen(uring* r);
+char* uringBuffer(uring* r, struct io_uring_cqe* cqe);
+void uringRecycle(uring* r, struct io_uring_cqe* cqe);
+int uringDrop(uring* r, unsigned index);
+void freeUring(uring* r);
+
+#include "uring.c"
+#endif /* URING_H */
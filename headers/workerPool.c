@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <time.h>
+
+#include "workerPool.h"
+
+/* helpers */
+static void poolGrow(workerpool* pool);
+static int startThread(workerpool* pool);
+static long int poolClock(void);
+
+/* Builds a worker pool and starts its first threads.
+ *
+ * @param ring The queue the threads take their work from.
+ * @param min The fewest threads the pool keeps.
+ * @param max The most threads the pool grows to.
+ * @param work The function each thread runs, given the pool.
+ * @param arg Kept in the pool for the threads.
+ * @return A new pool, or NULL on failure.
+ */
+workerpool* newWorkerPool(conring* ring, int min, int max,
+                          void* (*work)(void*), void* arg) {
+  workerpool* pool;
+  int i;
+
+  if (min <= 0 || max < min) { /* sanity check */
+    return NULL;
+  }
+
+  if (!(pool = calloc(1, sizeof(workerpool)))) {
+    return NULL;
+  }
+  pool->ring = ring;
+  pool->work = work;
+  pool->arg  = arg;
+  pool->min  = min;
+  pool->max  = max;
+  pool->lastEmpty = poolClock();
+
+  /* nobody joins a thread that retires, so they clean up after themselves */
+  pthread_attr_init(&(pool->attr));
+  pthread_attr_setscope(&(pool->attr), PTHREAD_SCOPE_SYSTEM);
+  pthread_attr_setdetachstate(&(pool->attr), PTHREAD_CREATE_DETACHED);
+  pthread_mutex_init(&(pool->mutex), NULL);
+  pthread_cond_init(&(pool->gone), NULL);
+
+  pthread_mutex_lock(&(pool->mutex));
+  for (i = 0; i < min; i++) {
+    if (startThread(pool) < 0) {
+      #ifdef DEBUG
+        printf("workerPool.c: Unable to start worker %d!\n", i);
+      #endif
+
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+
+  if (pool->live == 0) {
+    destroyWorkerPool(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+/* Called by each thread as it starts.
+ *
+ * @param pool The pool.
+ * @return An ID for the thread, unique within the pool.
+ */
+int poolEnter(workerpool* pool) {
+  int ID;
+
+  pthread_mutex_lock(&(pool->mutex));
+  pool->growing = 0;
+  ID = pool->numbered++;
+  pthread_mutex_unlock(&(pool->mutex));
+
+  return ID;
+}
+
+/* Takes the next connection off the pool's queue, sleeping until one
+ * arrives.  The connection's wait tells the pool whether it needs to
+ * grow, or, if it's shedding, whether the connection should be turned
+ * away; and a thread left with nothing to do for POOL_IDLE seconds is
+ * told to retire.
+ *
+ * @param pool The pool.
+ * @param conID Set to the socket connection identifier.
+ * @param a Set to the connection's instruction.  TERMINATE means the
+ *          calling thread must clean up and call poolLeave(); SHED
+ *          means it should refuse the client, and close its socket.
+ */
+void poolTake(workerpool* pool, int* conID, instruction* a) {
+  int timeout = (pool->min < pool->max ? POOL_IDLE * 1000 : -1);
+  long int waited, target, now;
+
+  while (1) {
+    __atomic_add_fetch(&(pool->idle), 1, __ATOMIC_SEQ_CST);
+    waited = ringTimedPop(pool->ring, conID, a, timeout);
+    __atomic_sub_fetch(&(pool->idle), 1, __ATOMIC_SEQ_CST);
+    if (waited >= 0) {
+      break;
+    }
+
+    /* nothing to do for a while; leave, if the pool can spare us */
+    pthread_mutex_lock(&(pool->mutex));
+    if (!pool->stopping && pool->live - pool->exiting > pool->min) {
+      pool->exiting++;
+      pool->retired++;
+
+      #ifdef DEBUG
+        printf("workerPool.c: Worker retiring, %d left.\n",
+               pool->live - pool->exiting);
+      #endif
+
+      pthread_mutex_unlock(&(pool->mutex));
+      *a = TERMINATE;
+      return;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+  }
+
+  if (*a == TERMINATE) { /* pass it on; this has to get through */
+    while (ringPush(pool->ring, 0, TERMINATE) < 0) {
+      sched_yield();
+    }
+    pthread_mutex_lock(&(pool->mutex));
+    pool->exiting++;
+    pthread_mutex_unlock(&(pool->mutex));
+    return;
+  }
+
+  __atomic_add_fetch(&(pool->taken), 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&(pool->waited), waited, __ATOMIC_RELAXED);
+  if (waited > POOL_GROW_WAIT * 1000L &&
+      __atomic_load_n(&(pool->idle), __ATOMIC_SEQ_CST) == 0) {
+    poolGrow(pool);
+  }
+
+  /* has the queue been standing for too long, and did this one wait? */
+  if ((target = __atomic_load_n(&(pool->target), __ATOMIC_RELAXED)) > 0) {
+    now = poolClock();
+    if (ringDepth(pool->ring) == 0) {
+      __atomic_store_n(&(pool->lastEmpty), now, __ATOMIC_RELAXED);
+    } else if (*a == PROCESS && waited > target &&
+               now - __atomic_load_n(&(pool->lastEmpty), __ATOMIC_RELAXED) >
+               __atomic_load_n(&(pool->interval), __ATOMIC_RELAXED)) {
+      __atomic_add_fetch(&(pool->shed), 1, __ATOMIC_RELAXED);
+      *a = SHED;
+    }
+  }
+}
+
+/* Called by each thread as the last thing it does.
+ *
+ * @param pool The pool.
+ */
+void poolLeave(workerpool* pool) {
+  pthread_mutex_lock(&(pool->mutex));
+  pool->live--;
+  pool->exiting--;
+  if (pool->live == 0) {
+    pthread_cond_broadcast(&(pool->gone));
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+/* Called after a connection is queued, to grow the pool if every thread
+ * is busy and the queue is getting long.  This is cheap when it doesn't.
+ * For a pool that's shedding, it also notes a queue that was empty up to
+ * now, which may have sat that way since the last connection was taken.
+ * NOTE: Takes a lock when it grows, so don't call it from a signal handler!
+ *
+ * @param pool The pool.
+ */
+void poolCheck(workerpool* pool) {
+  long int depth = ringDepth(pool->ring);
+
+  if (depth <= 1 && __atomic_load_n(&(pool->target), __ATOMIC_RELAXED) > 0) {
+    __atomic_store_n(&(pool->lastEmpty), poolClock(), __ATOMIC_RELAXED);
+  }
+  if (__atomic_load_n(&(pool->idle), __ATOMIC_SEQ_CST) == 0 &&
+      depth > POOL_GROW_DEPTH) {
+    poolGrow(pool);
+  }
+}
+
+/* Starts the pool shedding connections from a standing queue, or stops
+ * it.  Safe to call while the pool is running.
+ *
+ * @param pool The pool.
+ * @param target Milliseconds a connection may wait in a standing queue
+ *               before it's turned away, or 0 to never turn any away.
+ * @param interval Milliseconds the queue has to go without emptying
+ *                 before it counts as standing.
+ */
+void poolShed(workerpool* pool, long int target, long int interval) {
+  __atomic_store_n(&(pool->interval), interval * 1000, __ATOMIC_RELAXED);
+  __atomic_store_n(&(pool->target), target * 1000, __ATOMIC_RELAXED);
+}
+
+/* Tells every thread in the pool to finish up and leave.  This takes no
+ * locks, so it is safe from a signal handler.
+ *
+ * @param pool The pool.
+ */
+void stopWorkerPool(workerpool* pool) {
+  __atomic_store_n(&(pool->stopping), 1, __ATOMIC_SEQ_CST);
+  while (ringPush(pool->ring, 0, TERMINATE) < 0) {
+    sched_yield();
+  }
+}
+
+/* Prints the pool's size and counters.
+ *
+ * @param pool The pool.
+ * @param name What to call it.
+ */
+void printPoolStats(workerpool* pool, char* name) {
+  long int taken = __atomic_load_n(&(pool->taken), __ATOMIC_RELAXED);
+  long int waited = __atomic_load_n(&(pool->waited), __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&(pool->mutex));
+  printf("Workers (%s): %d threads (%d idle, %d-%d allowed, peak %d), %ld added, %ld retired, %ld connections waited %.2f ms on average, %ld shed\n",
+         name, pool->live, __atomic_load_n(&(pool->idle), __ATOMIC_RELAXED),
+         pool->min, pool->max, pool->peak, pool->grown, pool->retired, taken,
+         (taken ? waited / 1000.0 / taken : 0.0),
+         __atomic_load_n(&(pool->shed), __ATOMIC_RELAXED));
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+/* Waits for every thread in the pool to leave, then frees it.
+ * NOTE: Call stopWorkerPool() first, or this will wait forever!
+ */
+void destroyWorkerPool(workerpool* pool) {
+  pthread_mutex_lock(&(pool->mutex));
+  while (pool->live > 0) {
+    pthread_cond_wait(&(pool->gone), &(pool->mutex));
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+
+  pthread_cond_destroy(&(pool->gone));
+  pthread_mutex_destroy(&(pool->mutex));
+  pthread_attr_destroy(&(pool->attr));
+  free(pool);
+}
+
+/* Adds a thread to the pool, if it is allowed another and isn't already
+ * waiting on one to start.
+ */
+static void poolGrow(workerpool* pool) {
+  pthread_mutex_lock(&(pool->mutex));
+  if (!pool->stopping && !pool->growing && pool->live < pool->max &&
+      startThread(pool) == 0) {
+    pool->growing = 1;
+    pool->grown++;
+
+    #ifdef DEBUG
+      printf("workerPool.c: Pool grown to %d workers.\n", pool->live);
+    #endif
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+/* Starts one thread.  The pool's mutex must be held.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int startThread(workerpool* pool) {
+  pthread_t thread;
+
+  if (pthread_create(&thread, &(pool->attr), pool->work, pool) != 0) {
+    return -1;
+  }
+  pool->live++;
+  if (pool->live > pool->peak) {
+    pool->peak = pool->live;
+  }
+
+  return 0;
+}
+
+/* The time, in microseconds, on the same clock the ring stamps with. */
+static long int poolClock(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
@@ -0,0 +1,91 @@
+#ifndef _WORKERPOOL_
+#define _WORKERPOOL_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "constants.h" /* for pool defaults */
+#include "conRing.h"
+
+/* This file stores everything regarding worker pools, the threads that
+ * take connections off a conring, and how many of them there are.
+ *
+ * A pool starts with its minimum number of threads, and grows by one
+ * thread at a time, up to its maximum, whenever its workers are all busy
+ * and either more than POOL_GROW_DEPTH connections are queued, or a
+ * worker finds that the connection it just took waited longer than
+ * POOL_GROW_WAIT milliseconds.  Only one new thread is ever on its way
+ * at once, so a burst adds threads about as fast as they can start
+ * rather than all in one go.  A thread that has had nothing to do for
+ * POOL_IDLE seconds retires, unless the pool is at its minimum.  A pool
+ * whose minimum and maximum are the same never changes size.
+ *
+ * A pool can also be told, with poolShed(), to turn connections away
+ * once its queue is more than it can keep up with, rather than make
+ * every one of them wait longer and longer.  This is CoDel's idea, as
+ * applied to request queues: a queue that empties now and then is just
+ * absorbing bursts, and is left alone, but one that hasn't emptied for
+ * a whole interval is a standing queue, and while it stands, any
+ * connection that waited longer than the target is handed out as SHED
+ * instead of PROCESS, to be answered with a quick refusal.  Since the
+ * queue is first in, first out, the oldest go first, and the wait for
+ * the rest stays near the target however long the spike lasts.
+ *
+ * The pool's threads are detached; each one runs the function the pool
+ * was built with, handed the pool itself (whose arg is whatever else
+ * the caller wants its threads to have).  That function is expected to
+ * call poolEnter() first, take its work with poolTake(), and call
+ * poolLeave() as the last thing it does once poolTake() hands it
+ * TERMINATE.  Stopping the pool takes a single
+ * TERMINATE, which every thread passes along to the next on its way out.
+ *
+ * The type "workerpool" is the pool: its queue, its bounds, and its
+ * counters.
+ */
+
+/* the pool */
+typedef struct workerpool {
+  conring* ring;              /* where the work comes from */
+  void* (*work)(void*);       /* what each thread runs */
+  void* arg;                  /* ...and what else they need */
+  pthread_attr_t attr;
+  pthread_mutex_t mutex;
+  pthread_cond_t gone;        /* signaled when the last thread leaves */
+  int min;
+  int max;
+  int live;                   /* threads started and not yet left */
+  int exiting;                /* ...of which are on their way out */
+  int idle;                   /* threads waiting on the ring */
+  int growing;                /* a new thread hasn't started yet */
+  int stopping;
+  int numbered;               /* IDs handed out by poolEnter() */
+
+  /* counters */
+  int peak;
+  long int grown;
+  long int retired;
+  long int taken;
+  long int waited;            /* microseconds, over everything taken */
+  long int shed;
+
+  /* shedding; times in microseconds */
+  long int target;            /* longest wait in a standing queue, or 0 */
+  long int interval;          /* how long a queue stands before it counts */
+  long int lastEmpty;         /* when the queue was last seen empty */
+} workerpool;
+
+/* pool functions */
+workerpool* newWorkerPool(conring* ring, int min, int max,
+                          void* (*work)(void*), void* arg);
+int poolEnter(workerpool* pool);
+void poolTake(workerpool* pool, int* conID, instruction* a);
+void poolLeave(workerpool* pool);
+void poolCheck(workerpool* pool);
+void poolShed(workerpool* pool, long int target, long int interval);
+void stopWorkerPool(workerpool* pool);
+void printPoolStats(workerpool* pool, char* name);
+void destroyWorkerPool(workerpool* pool);
+
+#include "workerPool.c"
+#endif /* _WORKERPOOL_ */
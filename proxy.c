@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -9,6 +10,7 @@
 #include <signal.h>
 #include <netdb.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "headers/proxy.h"
 
@@ -17,31 +19,34 @@
 static void initializeGlobals(void);
 static void cleanUpGlobals(void);
 static void catchInterrupt(int signum);
+static void catchStats(int signum);
+static void proxyExpire(timer* t, int kind, void* arg);
 static void* handleClient(void* args);
 static int sharedProxy(const char* server, struct hostent* h, 
                        connection* client, void* header,
-                       long int headerLength, int compression, 
-                       xmlrpc_env* environment);
+                       long int headerLength, headerindex* index,
+                       int compression, xmlrpc_env* environment);
 static int isCompressed(int numargs, char** arguments);
 static int rpcFault(xmlrpc_env* const environment);
 
 /* global variables */
 
-pthread_t* workers;		/* pool of worker threads */
-pthread_attr_t scope;		/* set system scope for thread scheduling */
-pthread_mutex_t mConList;	/* protects connections list */
-pthread_cond_t freeConn;	/* signaled when a connection is ready */
-conlist* list;			/* list of client connections */
-int numThreads;			/* number of proxy threads */
+workerpool* pool;		/* pool of worker threads */
+conring* ring;			/* client connections waiting for a worker */
+int numThreads;			/* fewest proxy threads */
+int maxThreads;			/* most proxy threads */
 int serverSock;			/* TRANSMITS and LISTENS to SERVER */
 int clientSock;			/* TRANSMITS to CLIENTS */
 int LOOP;			/* infinite main loop */
+int STATS;			/* print statistics at the next chance */
 int OPTIMIZED;			/* is this proxy optimized? */
 int COMPRESS;			/* are we compressing images? */
 char* distserver;		/* distributed image compression server */
 int distport;			/* distributed image compression port */
 memnode* shList;		/* shared memory list */
 metanode* shMeta;		/* shared metanode */
+watchdog* reaper;		/* the workers' deadlines */
+long int timeouts[DEADLINES];	/* sockets shut down, by what they ran out on */
 xmlrpc_env environment;		/* the RPC environment */
 
 /* Let's get started! */
@@ -51,10 +56,10 @@ int main(int argc, char** argv) {
   struct sockaddr_in localaddr;	/* local address struct */
   struct sockaddr_in clientaddr;/* client address struct */
   struct sigaction sa;		/* traps signals */
-  int i;
+  char* poolArg;		/* most worker threads, if given */
 
   /* check command line arguments */
-  if (argc < 3 || argc > 7) {
+  if (argc < 3 || argc > 9) {
     printArgs(PROXY);
     exit(INCORRECT_ARGS);
   }
@@ -79,6 +84,16 @@ int main(int argc, char** argv) {
     exit(INCORRECT_ARGS);
   }
 
+  /* room to grow? */
+  maxThreads = numThreads;
+  if ((poolArg = getFlagValue(argc, argv, "-w"))) {
+    maxThreads = atoi(poolArg);
+    if (maxThreads < numThreads) {
+      printf("Invalid maximum thread count \"%s\"; it can't be less than %d.  Exiting...\n", poolArg, numThreads);
+      exit(INCORRECT_ARGS);
+    }
+  }
+
   /*****************\
   * Initializations *
   \*****************/
@@ -116,16 +131,26 @@ int main(int argc, char** argv) {
   sa.sa_flags = 0;
   sigaction(SIGINT, &sa, NULL);
 
+  /* SIGUSR1 prints statistics */
+  sa.sa_handler = catchStats;
+  sigaction(SIGUSR1, &sa, NULL);
+
   /* set up the global variables */
   initializeGlobals();
 
+  /* the error pages sent most often */
+  prerenderError(404, "Not Found", "Server not found.\n");
+  prerenderError(408, "Request Timeout", "The server did not respond to proxy requests.\n");
+  prerenderError(500, "Internal Server Error", "The proxy encountered an error.\n");
+
   /*************************************\
   |* Thread creation and infinite loop *|
   \*************************************/
 
-  /* allocate thread memory */
-  for (i = 0; i < numThreads; i++) {
-    pthread_create(&workers[i], &scope, handleClient, (void *)i);
+  /* start the workers */
+  if (!(pool = newWorkerPool(ring, numThreads, maxThreads, handleClient, NULL))) {
+    printf("Error starting worker threads.  Exiting...\n");
+    exit(MEMALLOC_FAILURE);
   }
 
   /* loop until the interrupt handler changes this value */
@@ -136,9 +161,21 @@ int main(int argc, char** argv) {
       printf("Waiting for an incoming connection...\n");
     #endif
 
+    /* asked for statistics? */
+    if (STATS) {
+      STATS = 0;
+      printPoolStats(pool, "proxy");
+      printf("Timeouts: %ld reading headers, %ld writing responses, %ld waiting on origin servers\n",
+             timeouts[DEADLINE_HEADER], timeouts[DEADLINE_WRITE],
+             timeouts[DEADLINE_ORIGIN]);
+      fflush(stdout);
+    }
+
     if ((clientSock = accept(listenSock, (struct sockaddr *) &clientaddr, &clientLength)) < 0) {
       if (!LOOP) { /* loop was broken, don't worry 'bout it */
         break;
+      } else if (errno == EINTR) { /* SIGUSR1 */
+        continue;
       }
 
       /* ok, got here not because of LOOP, but an actual error */
@@ -150,11 +187,13 @@ int main(int argc, char** argv) {
         printf("Proxy: Connection from %s\n", inet_ntoa(clientaddr.sin_addr));
       #endif
 
-      /* add the new connection */
-      pthread_mutex_lock(&mConList);
-      addTail(clientSock, PROCESS, list);
-      pthread_cond_broadcast(&freeConn);
-      pthread_mutex_unlock(&mConList);
+      /* add the new connection; if the workers are that far behind,
+       * turn the client away */
+      if (ringPush(ring, clientSock, PROCESS) < 0) {
+        close(clientSock);
+      } else {
+        poolCheck(pool);
+      }
     }
     /* keep on truggin' */
   }
@@ -175,19 +214,32 @@ int main(int argc, char** argv) {
  * for them to service. 
  */
 static void* handleClient(void* args) {
-  connection* client;
+  connection node;		/* the client being served */
+  connection* client = &node;
+  connection origin;		/* ...and the server it wants */
+  struct timeval patience;	/* how long connecting to it may take */
+  instruction action;
+  int sock;
   struct hostent *he, *hp;
   struct sockaddr_in serveraddr;
   char buf[1000];
   int error;
-  int ID = (int)args;
+  workerpool* workers = (workerpool*)args; /* main() may not have it yet */
+  int ID = poolEnter(workers);
   xmlrpc_env environment;
   char serverURL[1000];
+  arena scratch;		/* for the responses sent from here */
 
   #ifdef DEBUG
     printf("Thread %d starting!\n", ID);
   #endif
 
+  if (initArena(&scratch, ARENA_SIZE) < 0) {
+    printf("Error allocating memory for thread %d.  Exiting...\n", ID);
+    exit(MEMALLOC_FAILURE);
+  }
+  useArena(&scratch);
+
   /* set up RPC environment */
   if (COMPRESS) {
     xmlrpc_env_init(&environment);
@@ -200,18 +252,20 @@ static void* handleClient(void* args) {
   while (1) { /* loop until forever */
     void* header, *tHeader;
     char* fullServer, *uriServer;
-    long int headerLen = 0;
+    long int headerLen = 0, oldLen, toSend;
     long int bodyLen = 0;
+    long int extraLen = 0; /* bytes read past the header */
+    headerindex index;     /* the request's fields */
+    httpfield* host;
     int bytes;
     int compression;
 
+    /* whatever the last client needed is done with */
+    arenaReset(&scratch);
+
     /* wait until a connection makes itself available */
-    pthread_mutex_lock(&mConList);
-    while (isEmpty(list)) {
-      pthread_cond_wait(&freeConn, &mConList);
-    }
-    client = removeHead(list);
-    pthread_mutex_unlock(&mConList);
+    poolTake(workers, &sock, &action);
+    initConnection(client, sock, action);
 
     #ifdef DEBUG
       if (client->action == PROCESS) {
@@ -222,7 +276,6 @@ static void* handleClient(void* args) {
     #endif
 
     if (client->action == TERMINATE) { /* time to quit */
-      free(client);
 
       if (COMPRESS) {
         xmlrpc_env_clean(&environment);
@@ -233,11 +286,15 @@ static void* handleClient(void* args) {
         printf("Thread %d terminated.\n", ID);
       #endif
 
+      freeArena(&scratch);
+      poolLeave(workers);
       pthread_exit(0);
     }
 
     /* by getting here, we have a connection to process */
-    header = recvHeader(client->conn, &headerLen, &bodyLen);
+    watchSet(reaper, &(client->deadline), DEADLINE_HEADER, HEADER_TIMEOUT * 1000L);
+    header = recvHeader(client->conn, &headerLen, &bodyLen, &extraLen);
+    watchCancel(reaper, &(client->deadline));
     if (!header) { /* badness */
 
       #ifdef DEBUG
@@ -246,7 +303,6 @@ static void* handleClient(void* args) {
 
       sendError(500, "Internal Server Error", (char*)0, "The proxy encountered an error.", client, 0);
       close(client->conn);
-      free(client);
       continue;
     }
 
@@ -255,10 +311,12 @@ static void* handleClient(void* args) {
     #endif
 
     /* sets whether the server response will be compressed */
-    compression = (COMPRESS && isJPG(header, headerLen) ? 1 : 0);
+    indexHeader(header, headerLen, &index);
+    compression = (COMPRESS && isJPG(header, headerLen, &index) ? 1 : 0);
 
     /* extract the destination server */
-    fullServer = getHeaderField(header, headerLen, "\nHost");
+    host = indexFind(&index, "Host");
+    fullServer = (host ? spanDup(host->value) : NULL);
     if (!fullServer) { /* oy */
 
       #ifdef DEBUG
@@ -268,7 +326,6 @@ static void* handleClient(void* args) {
       sendError(500, "Internal Server Error", (char*)0, "The proxy encountered an error.", client, 0);
       close(client->conn);
       free(header);
-      free(client);
       continue;
     }
 
@@ -294,7 +351,6 @@ static void* handleClient(void* args) {
       printf("Memory allocation error.  Continuing.\n");
       sendError(500, "Internal Server Error", (char*)0, "The proxy has encountered an error.\n", client, 0);
       close(client->conn);
-      free(client);
       free(uriServer);
       free(fullServer);
       free(header);
@@ -306,7 +362,6 @@ static void* handleClient(void* args) {
       printf("Error retrieving host name for \"%s\". Skipping.\n", uriServer);
       sendError(404, "Not Found", (char*)0, "Server not found.\n", client, 0);
       close(client->conn);
-      free(client);
       free(uriServer);
       free(fullServer);
       free(header);
@@ -315,7 +370,7 @@ static void* handleClient(void* args) {
 
     /* ---=SHARED MEMORY=--- */
     /* usage successful! no further processing needed */
-    if (sharedProxy(uriServer, he, client, header, headerLen, compression, &environment) == 0) {
+    if (sharedProxy(uriServer, he, client, header, headerLen, &index, compression, &environment) == 0) {
 
       /* free up resources, close socket */
       free(uriServer);
@@ -323,7 +378,6 @@ static void* handleClient(void* args) {
       free(he);
       /*free(header);*/
       close(client->conn);
-      free(client);
 
       #ifdef DEBUG
         printf("proxy.c: Shared memory request completed by thread %d!\n", ID);
@@ -352,18 +406,24 @@ static void* handleClient(void* args) {
       sendError(500, "Internal Server Error", (char*)0, "The proxy encountered an error.\n", client, 0);
       close(client->conn);
       free(header);
-      free(client);
       continue;
     }
 
-    /* establish the connection */
-    if (connect(serverSock, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
+    /* establish the connection; a shutdown() can't interrupt connect(),
+     * but a send timeout can */
+    initConnection(&origin, serverSock, PROCESS);
+    patience.tv_sec = ORIGIN_TIMEOUT;
+    patience.tv_usec = 0;
+    setsockopt(origin.conn, SOL_SOCKET, SO_SNDTIMEO, &patience, sizeof(patience));
+    if (connect(origin.conn, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
+      if (errno == EINPROGRESS) { /* that's the timeout */
+        __sync_fetch_and_add(&timeouts[DEADLINE_ORIGIN], 1);
+      }
       printf("Error establishing connection with server.  Skipping.\n");
       sendError(408, "Request Timeout", (char*)0, "The server did not respond to proxy requests.\n", client, 0);
       close(client->conn);
       close(serverSock);
       free(header);
-      free(client);
       continue;
     }
 
@@ -373,13 +433,22 @@ static void* handleClient(void* args) {
     
 
     /* strip out the absolute URL */
-    tHeader = stripAbsURL(header, headerLen, &headerLen);
+    oldLen = headerLen;
+    tHeader = stripAbsURL(header, headerLen, &index, &headerLen);
+    if (tHeader && extraLen > 0) { /* carry over what followed the header */
+      void* grown = realloc(tHeader, headerLen + extraLen);
+      if (!grown) {
+        free(tHeader);
+      } else {
+        memcpy((char*)grown + headerLen, (char*)header + oldLen, extraLen);
+      }
+      tHeader = grown;
+    }
     if (!tHeader) { /* ughhhhhhhasdjkfhasdfj */
       printf("Error stripping out absolute URL from header.  Skipping.\n");
       sendError(500, "Internal Server Error", (char*)0, "The proxy encountered an error.\n", client, 0);
       close(client->conn);
       close(serverSock);
-      free(client);
       continue;
     }
 
@@ -397,8 +466,14 @@ static void* handleClient(void* args) {
       }
     #endif
 
-    /* send the client header */
-    if (sendAll(serverSock, header, &headerLen) < 0) { /* doh */
+    /* send the client header, and whatever body came in with it; the
+     * server then has ORIGIN_TIMEOUT seconds to start answering */
+    patience.tv_sec = 0;
+    setsockopt(origin.conn, SOL_SOCKET, SO_SNDTIMEO, &patience, sizeof(patience));
+    watchSet(reaper, &(origin.deadline), DEADLINE_ORIGIN, ORIGIN_TIMEOUT * 1000L);
+    toSend = headerLen + extraLen;
+    if (sendAll(serverSock, header, &toSend) < 0) { /* doh */
+      watchCancel(reaper, &(origin.deadline));
  
       #ifdef DEBUG
         printf("Thread %d: ", ID);
@@ -408,7 +483,6 @@ static void* handleClient(void* args) {
       sendError(500, "Internal Server Error", (char*)0, "The proxy encountered an error.\n", client, 0);
       close(client->conn);
       close(serverSock);
-      free(client);
       free(header);
       continue;
     }
@@ -419,9 +493,10 @@ static void* handleClient(void* args) {
 
     /* receive the server's response, WITH the body */
     free(tHeader);
-    header = recvHeader(serverSock, &headerLen, &bodyLen);
+    header = recvHeader(serverSock, &headerLen, &bodyLen, &extraLen);
 
     if (!header) { /* christ */
+      watchCancel(reaper, &(origin.deadline));
 
       #ifdef DEBUG
         printf("Thread %d: ", ID);
@@ -431,7 +506,6 @@ static void* handleClient(void* args) {
       sendError(500, "Internal Server Error", (char*)0, "The proxy encountered an error.\n", client, 0);
       close(client->conn);
       close(serverSock);
-      free(client);
       continue;
     }
 
@@ -447,14 +521,18 @@ static void* handleClient(void* args) {
     }
     #endif
 
-    if ((bytes = recvAll_Forward(serverSock, client->conn, header, 
-                                 headerLen, bodyLen, 
-                                 compression, &environment, serverURL)) < 0) {
+    /* from here on, both ends have to keep the response moving */
+    watchSet(reaper, &(client->deadline), DEADLINE_WRITE, WRITE_TIMEOUT * 1000L);
+    bytes = recvAll_Forward(serverSock, client->conn, header,
+                            headerLen, extraLen, bodyLen,
+                            compression, &environment, serverURL);
+    watchCancel(reaper, &(origin.deadline));
+    watchCancel(reaper, &(client->deadline));
+    if (bytes < 0) {
       printf("Error forwarding server response to client.  Skipping.\n");
       sendError(500, "Internal Server Error", (char*)0, "The proxy encountered an error.\n", client, 0);
       close(client->conn);
       close(serverSock);
-      free(client);
       free(header);
       continue;
     }
@@ -466,7 +544,6 @@ static void* handleClient(void* args) {
     /* that should be it!  free the resources */
     close(serverSock);
     close(client->conn);
-    free(client);
     free(header);
     
   } /* end infinite loop */
@@ -478,33 +555,16 @@ static void* handleClient(void* args) {
  */
 static void initializeGlobals(void) {
 
-  /* initialize mutex */
-  if (pthread_mutex_init(&mConList, NULL) != 0) {
-    printf("Error initializing mutex.  Exiting...\n");
-    exit(MUTEX_FAILURE);
-  }
-
-  /* initialize condition variable */
-  if (pthread_cond_init(&freeConn, NULL) != 0) {
-    printf("Error initializing condition variable.  Exiting...\n");
-    exit(MUTEX_FAILURE);
-  }
-
-  /* allocate worker pool */
-  if (!(workers = malloc(sizeof(pthread_t) * numThreads))) {
-    printf("Error allocating memory for thread pool.  Exiting...\n");
+  /* set up connection queue */
+  ring = newConRing(CONRING_SIZE);
+  if (!ring) {
+    printf("Error allocating memory for connection queue.  Exiting...\n");
     exit(MEMALLOC_FAILURE);
   }
 
-  /* set up thread attributes */
-  pthread_attr_init(&scope);
-  pthread_attr_setscope(&scope, PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setdetachstate(&scope, PTHREAD_CREATE_JOINABLE);
-
-  /* set up connections list */
-  list = newConList();
-  if (!list) {
-    printf("Error allocating memory for connections list.  Exiting...\n");
+  /* the workers' deadlines are kept by a thread of their own */
+  if (!(reaper = newWatchdog(WHEEL_TICK, proxyExpire, NULL))) {
+    printf("Error starting the watchdog thread.  Exiting...\n");
     exit(MEMALLOC_FAILURE);
   }
 
@@ -536,7 +596,6 @@ static void initializeGlobals(void) {
 /* Catches and handles clean-up with SIGINT
  */
 static void catchInterrupt(int signum) {
-  int i;
 
   #ifdef DEBUG
     if (LOOP) {
@@ -553,75 +612,68 @@ static void catchInterrupt(int signum) {
   }
 
   LOOP = 0; /* terminates the infinite loop listening for clients */
-  for (i = 0; i < numThreads; i++) {
-    /* add termination tokens */
-    pthread_mutex_lock(&mConList);
-    addTail(0, TERMINATE, list);
-    pthread_cond_broadcast(&freeConn);
-    pthread_mutex_unlock(&mConList);
-  }
+
+  /* one termination token; each worker passes it along */
+  stopWorkerPool(pool);
 
   #ifdef DEBUG
-    printf("All termination tokens added.  Waiting for exit...\n");
+    printf("Termination token added.  Waiting for exit...\n");
   #endif
 
   /* let the termination tokens and main() take it from here */
 }
 
-/* This will deallocate the memory allocated by the global variables.
+/* Catches SIGUSR1, asking for statistics to be printed.  The printing
+ * itself happens back in main(), where it's safe to do.
  */
-static void cleanUpGlobals(void) {
-  int i;
-  void* status;
-
-  /* first, clean up the threads so the mutex doesn't lock itself */
-  for (i = 0; i < numThreads; i++) {
-    int retval = pthread_join(workers[i], &status);
-    if (retval) { /* joined with an error */
-      printf("Error joining thread %d. Code: %d\n", i, retval);
-    }
+static void catchStats(int signum) {
+  STATS = 1;
+}
 
-    #ifdef DEBUG
-      printf("Thread %d successfully joined! Status: %ld\n", i, (long)status);
-    #endif
+/* Shuts down a socket that has run out of time, which wakes the worker
+ * blocked on it with an error or the end of the stream.  Called by the
+ * watchdog, with its lock held.  A response still moving, however
+ * slowly, is given more time: the origin server has to have sent
+ * something, or the client taken something, in the last timeout's worth.
+ */
+static void proxyExpire(timer* t, int kind, void* arg) {
+  connection* c = (connection*)t->data;
+  long int limit = (kind == DEADLINE_ORIGIN ? ORIGIN_TIMEOUT : WRITE_TIMEOUT) * 1000L;
+  long int idle = limit;
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+
+  if (kind != DEADLINE_HEADER &&
+      getsockopt(c->conn, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+    idle = (kind == DEADLINE_ORIGIN ? info.tcpi_last_data_recv : info.tcpi_last_data_sent);
+  }
+  if (idle < limit) {
+    wheelSet(&(reaper->wheel), t, kind, limit - idle);
+    return;
   }
 
-  /* threads are joined, now destroy the mutex */
-  if (pthread_mutex_destroy(&mConList) != 0) {
-    printf("Error destroying connection mutex!\n");
-  }
   #ifdef DEBUG
-    else {
-      printf("Connection mutex successfully destroyed.\n");
-  }
+    printf("proxy.c: Socket %d ran out of time (deadline %d).\n", c->conn, kind);
   #endif
 
-  /* destory condition variable */
-  if (pthread_cond_destroy(&freeConn) != 0) {
-    printf("Error destroying condition variable!\n");
-  }
-  #ifdef DEBUG
-    else {
-      printf("Condition variable successfully destroyed.\n");
-  }
-  #endif
+  __sync_fetch_and_add(&timeouts[kind], 1);
+  shutdown(c->conn, SHUT_RDWR);
+}
+
+/* This will deallocate the memory allocated by the global variables.
+ */
+static void cleanUpGlobals(void) {
+
+  /* first, wait for the threads to pass on the termination token */
+  destroyWorkerPool(pool);
+  destroyWatchdog(reaper);
 
-  /* destroy thread attributes */
-  if (pthread_attr_destroy(&scope) != 0) {
-    printf("Error destroying thread attributes!\n");
-  }
   #ifdef DEBUG
-    else {
-      printf("Thread attributes successfully destroyed.\n");
-  }
+    printf("All threads finished!\n");
   #endif
 
-  /* destroy connections list */
-  destroyAll(list);
-  free(list);
-
-  /* destroy list of workers */
-  free(workers);
+  /* destroy connection queue */
+  destroyConRing(ring);
 
   /* shared memory? */
   /* normally, it should be the server's job to eliminate the shared
@@ -662,14 +714,15 @@ static void cleanUpGlobals(void) {
  * @param client The socket connection to the client.
  * @param header The header received from the client.
  * @param headerLength The length, in bytes, of the header.
+ * @param index The header's index, from indexHeader().
  * @param compression Flag indicating whether this request is for a JPG.
  * @param environment The XMLRPC environment for this thread.
  * @return -1 on failure, 0 on success.
  */
 static int sharedProxy(const char* server, struct hostent* h, 
                        connection* client, void* header,
-                       long int headerLength, int compression,
-                       xmlrpc_env* environment) {
+                       long int headerLength, headerindex* index,
+                       int compression, xmlrpc_env* environment) {
   char* ip;
   char buf[100], buffer[1000];
   struct hostent* he, *hp;
@@ -749,7 +802,7 @@ static int sharedProxy(const char* server, struct hostent* h,
   }
 
   /* strip out the absolute URL */
-  tHeader = stripAbsURL(header, headerLength, &headerLength);
+  tHeader = stripAbsURL(header, headerLength, index, &headerLength);
   #ifdef DEBUG
     printf("--NEW HEADER--\n%s|\n--END--\n", (char*)tHeader);
   #endif
@@ -12,30 +12,144 @@
 #include <pthread.h>
 #include <signal.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
 
 #include "headers/server.h"
 
+/* older kernels lack exclusive wakeups; every loop then races to accept */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+
+/* what each io_uring request is for, kept in the low bits of its
+ * user_data; the rest is the connection it belongs to */
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_FILL 3		/* file into the connection's pipe */
+#define OP_DRAIN 4		/* pipe onto the socket */
+#define OP_CLOSE 5
+#define OP_CANCEL 6
+#define OP_MASK 7
+
+/* an event loop, along with the connections it currently owns */
+typedef struct eventloop {
+  pthread_t thread;
+  int epfd;			/* -1 when using io_uring */
+  uring ring;			/* ...in which case, this instead */
+  int accepting;		/* accept armed (1), to arm (0), or held off (-1) */
+  connection* live;
+  timerwheel timers;		/* the connections' deadlines */
+  arena scratch;		/* for the request being answered */
+} eventloop;
+
+/* one slice of the server, with its own listening socket (when sharded),
+ * queue, and workers, so shards never touch each other's locks */
+typedef struct shard {
+  pthread_t acceptor;		/* only when sharded */
+  workerpool* pool;		/* takes connections off the ring */
+  int sock;			/* listening socket */
+  int cpu;			/* CPU the shard is pinned to, or -1 */
+  conring* ring;		/* connections waiting for a worker */
+} shard;
+
 /* function headers */
 
 static void* handleClient(void* args);
+static void* acceptLoop(void* args);
+static int acceptFailed(void);
+static int enqueue(shard* s, int sock, instruction action);
+static void turnAway(int sock);
+static int openListener(struct sockaddr_in* localaddr);
+static void pinThread(int cpu);
 static void checkAndSend(void* conn, int shared);
+static void processRequest(httprequest* req, void* conn, int shared);
+static int sendEntry(cacheentry* entry, char* file, httprequest* req,
+                     void* conn, int shared);
+static int pickCoding(cacheentry* entry, httprequest* req);
+static int sendVariant(cacheentry* entry, int coding, char* file,
+                       httprequest* req, void* conn, int shared);
+static int isNotModified(cacheentry* entry, char* etag, httprequest* req);
+static int outOfScratch(void* conn, int shared);
+static int ifRangeMatches(cacheentry* entry, httprequest* req);
+static int sendRanges(cacheentry* entry, char* file, byterange* ranges,
+                      int count, char* headers, void* conn, int shared);
+static int sendListing(cacheentry* entry, char* file, void* conn, int shared);
+static int readDirectory(int dirfd, char*** names);
+static int compareNames(const void* a, const void* b);
+static void* eventLoop(void* args);
+static int acceptConnections(eventloop* loop);
+static void driveConnection(eventloop* loop, connection* c);
+static void closeConnection(eventloop* loop, connection* c);
+static void expireIdle(eventloop* loop);
+static void setDeadline(eventloop* loop, connection* c, int kind);
+static void loopExpire(timer* t, int kind, void* arg);
+static void workerExpire(timer* t, int kind, void* arg);
+static void* ringLoop(void* args);
+static void loopUp(void);
+static struct io_uring_sqe* ringOp(eventloop* loop, connection* c, int op,
+                                   int opcode);
+static void ringReap(eventloop* loop);
+static void ringAccept(eventloop* loop);
+static void ringRecv(eventloop* loop, connection* c);
+static void ringComplete(eventloop* loop, struct io_uring_cqe* cqe);
+static void ringReceived(eventloop* loop, connection* c, struct io_uring_cqe* cqe);
+static void ringRefill(eventloop* loop, connection* c);
+static void ringDrive(eventloop* loop, connection* c);
+static void ringSend(eventloop* loop, connection* c);
+static void ringSplice(eventloop* loop, connection* c);
+static void ringClose(eventloop* loop, connection* c);
+static void ringRelease(eventloop* loop, connection* c);
+static int awaitRequest(connection* c);
+static int upgradeServer(char** argv);
 static void catchInterrupt(int signum);
+static void catchStats(int signum);
+static void catchUpgrade(int signum);
+static void printStats(void);
 static void initializeGlobals(void);
 static void cleanUpGlobals(void);
 
 /* global variables */
 
-pthread_t* workers;		/* pool of worker threads */
 pthread_attr_t scope;		/* set system scope of thread scheduling */
-conlist* list;			/* the list of active clients' connections */
-pthread_mutex_t mConList;	/* protects connection list */
-pthread_cond_t free_conn;	/* a pending connection waits to be serviced */
-int numThreads;			/* size of thread pool */
-int serverSock;			/* local socket identifier */
+shard* shards;			/* the workers, in one or more slices */
+int numShards;			/* number of shards (1 = one shared listener) */
+int numThreads;			/* fewest workers each shard keeps */
+int maxThreads;			/* most workers each shard grows to */
+int backlog;			/* connections the kernel holds for accept() */
+int queueSize;			/* connections each shard holds for its workers */
+long int refused;		/* turned away with the queue full */
+int serverSock;			/* local socket identifier (shard 0's) */
 int LOOP;			/* indicates if the main loop continues */
 int OPTIMIZED;			/* is this server optimized? */
 memnode* shList;		/* shared memory list */
 metanode* shMeta;		/* shared metadata */
+eventloop* loops;		/* event loops, if any */
+int numLoops;			/* number of event loops (0 = none) */
+int URING;			/* do the event loops use io_uring? */
+int loopsUp;			/* event loops done setting up */
+pthread_mutex_t loopsMutex;	/* ...which is guarded by this */
+pthread_cond_t loopsCond;	/* ...and signalled as it goes up */
+int keepAliveTimeout;		/* seconds an idle connection is kept open */
+int maxRequests;		/* requests served per connection */
+int headerTimeout;		/* seconds a client has to send a whole header */
+int writeTimeout;		/* seconds a response can go without progress */
+watchdog* reaper;		/* the worker threads' deadlines */
+long int timeouts[DEADLINES];	/* connections closed, by what they ran out on */
+filecache* fileCache;		/* open files and their stat() results */
+compresspool* compressPool;	/* gzips popular text files, or NULL */
+int STATS;			/* print statistics at the next chance */
+int UPGRADE;			/* hand over to a new server at the next chance */
+int HANDEDOFF;			/* ...which has happened */
+time_t drainUntil;		/* when a replaced server gives up on its clients */
 
 /* LET'S GET TO WORK */
 
@@ -45,6 +159,25 @@ int main(int argc, char** argv) {
   struct sockaddr_in localaddr;	/* local address struct */
   struct sockaddr_in clientaddr;	/* client address struct */
   struct sigaction sa;		/* responsible for trapping SIGINT */ 
+  char* docroot;		/* document root */
+  int rootfd;			/* ...and a descriptor for it */
+  char* loopArg;		/* event loop count, if given */
+  char* shardArg;		/* shard count, if given */
+  char* poolArg;		/* most worker threads, if given */
+  char* queueArg;		/* backlog and queue settings, if given */
+  long int shedTarget;		/* longest wait in a standing queue */
+  int pinShards;		/* pin each shard to a CPU? */
+  long int numCPUs;		/* CPUs to spread pinned shards over */
+  char* keepArg;		/* keep-alive settings, if given */
+  char* timeoutArg;		/* deadlines, if given */
+  char* cacheArg;		/* file cache settings, if given */
+  int cacheEntries;		/* size of the file cache */
+  int cacheInterval;		/* seconds between cache revalidations */
+  long int cacheMemory;		/* bytes of file contents to keep in memory */
+  int compressThreads;		/* background compression threads */
+  char* handoffArg;		/* handoff socket, if replacing a server */
+  int chan = -1;		/* ...as a descriptor */
+  int* socks = NULL;		/* the listening sockets it handed over */
   int i;
 
   if (argc == 2 && strcmp(argv[1], "DELETE") == 0) {
@@ -68,12 +201,125 @@ int main(int argc, char** argv) {
   /* optimization? */
   OPTIMIZED = isOptimized(argc, argv);
 
-  if (((argc == 5 && chdir(argv[3]) < 0) || /* specified */
-       (argc == 4 && OPTIMIZED && chdir(".") < 0) || /* not specified */
-       (argc == 4 && !OPTIMIZED && chdir(argv[3]) < 0)) || /* specified */
-       (argc == 3 && chdir(".") < 0)) { /* not specified */
+  /* the document root is the first optional argument that isn't a flag */
+  docroot = (argc > 3 && argv[3][0] != '-' ? argv[3] : ".");
+  if ((rootfd = open(docroot, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    printf("Unable to read from document directory \"%s\".  Exiting...\n", docroot);
+    exit(INCORRECT_ARGS);
+  }
+
+  /* persistent connection settings */
+  keepAliveTimeout = KEEPALIVE_TIMEOUT;
+  maxRequests = KEEPALIVE_MAX;
+  if ((keepArg = getFlagValue(argc, argv, "-k"))) {
+    keepAliveTimeout = atoi(keepArg); /* 0 turns keep-alive off */
+  }
+  if ((keepArg = getFlagValue(argc, argv, "-r"))) {
+    maxRequests = atoi(keepArg);
+    if (maxRequests <= 0) {
+      printf("Invalid request limit \"%s\".  Exiting...\n", keepArg);
+      exit(INCORRECT_ARGS);
+    }
+  }
+
+  /* how long a slow client gets; 0 lets it take forever */
+  headerTimeout = HEADER_TIMEOUT;
+  writeTimeout = WRITE_TIMEOUT;
+  if ((timeoutArg = getFlagValue(argc, argv, "-h")) &&
+      (headerTimeout = atoi(timeoutArg)) < 0) {
+    printf("Invalid header timeout \"%s\".  Exiting...\n", timeoutArg);
+    exit(INCORRECT_ARGS);
+  }
+  if ((timeoutArg = getFlagValue(argc, argv, "-b")) &&
+      (writeTimeout = atoi(timeoutArg)) < 0) {
+    printf("Invalid write timeout \"%s\".  Exiting...\n", timeoutArg);
+    exit(INCORRECT_ARGS);
+  }
+
+  /* file cache settings */
+  cacheEntries = CACHE_ENTRIES;
+  cacheInterval = CACHE_INTERVAL;
+  cacheMemory = CACHE_MEMORY;
+  if ((cacheArg = getFlagValue(argc, argv, "-f"))) {
+    cacheEntries = atoi(cacheArg); /* 0 turns the cache off */
+    if (cacheEntries < 0) {
+      printf("Invalid file cache size \"%s\".  Exiting...\n", cacheArg);
+      exit(INCORRECT_ARGS);
+    }
+  }
+  if ((cacheArg = getFlagValue(argc, argv, "-v"))) {
+    cacheInterval = atoi(cacheArg);
+  }
+  if ((cacheArg = getFlagValue(argc, argv, "-m"))) {
+    cacheMemory = atol(cacheArg); /* 0 keeps no contents in memory */
+    if (cacheMemory < 0) {
+      printf("Invalid file cache memory \"%s\".  Exiting...\n", cacheArg);
+      exit(INCORRECT_ARGS);
+    }
+  }
+
+  /* background compression settings */
+  compressThreads = COMPRESS_THREADS;
+  if ((cacheArg = getFlagValue(argc, argv, "-z"))) {
+    compressThreads = atoi(cacheArg); /* 0 turns it off */
+    if (compressThreads < 0) {
+      printf("Invalid compression thread count \"%s\".  Exiting...\n", cacheArg);
+      exit(INCORRECT_ARGS);
+    }
+  }
+
+  /* event loops? */
+  numLoops = 0;
+  if ((loopArg = getFlagValue(argc, argv, "-e"))) {
+    numLoops = atoi(loopArg);
+    if (numLoops <= 0) {
+      printf("Invalid event loop argument \"%s\".  Exiting...\n", loopArg);
+      exit(INCORRECT_ARGS);
+    }
+  }
+
+  /* ...on io_uring? */
+  URING = 0;
+  if (hasFlag(argc, argv, "-u")) {
+    if (!numLoops) {
+      printf("io_uring (-u) needs event loops (-e).  Exiting...\n");
+      exit(INCORRECT_ARGS);
+    } else if (!(URING = uringAvailable())) {
+      printf("io_uring is unavailable; the event loops will use epoll.\n");
+    }
+  }
 
-    printf("Unable to read from document directory \"%s\".  Exiting...\n", (argc == 5 ? argv[3] : (argc == 4 ? (OPTIMIZED ? "." : argv[3]) : ".")));
+  /* shards? */
+  numShards = 1;
+  if ((shardArg = getFlagValue(argc, argv, "-s"))) {
+    numShards = atoi(shardArg);
+    if (numShards <= 0) {
+      printf("Invalid shard argument \"%s\".  Exiting...\n", shardArg);
+      exit(INCORRECT_ARGS);
+    } else if (numShards > 1 && numLoops) {
+      printf("Shards (-s) and event loops (-e) can't be combined.  Exiting...\n");
+      exit(INCORRECT_ARGS);
+    }
+  }
+  pinShards = hasFlag(argc, argv, "-p");
+
+  /* how much waiting is allowed, in the kernel and then in the queue */
+  backlog = MAXCONNECTIONS_SERVER;
+  queueSize = CONRING_SIZE;
+  shedTarget = SHED_TARGET;
+  if ((queueArg = getFlagValue(argc, argv, "-l")) &&
+      (backlog = atoi(queueArg)) <= 0) {
+    printf("Invalid listen backlog \"%s\".  Exiting...\n", queueArg);
+    exit(INCORRECT_ARGS);
+  }
+  if ((queueArg = getFlagValue(argc, argv, "-q")) &&
+      (queueSize = atoi(queueArg)) <= 0) {
+    printf("Invalid queue size \"%s\".  Exiting...\n", queueArg);
+    exit(INCORRECT_ARGS);
+  }
+  if ((queueArg = getFlagValue(argc, argv, "-d")) &&
+      (shedTarget = atol(queueArg)) < 0) { /* 0 turns shedding off */
+    printf("Invalid queueing target \"%s\".  Exiting...\n", queueArg);
     exit(INCORRECT_ARGS);
   }
 
@@ -91,26 +337,68 @@ int main(int argc, char** argv) {
     exit(INCORRECT_ARGS);
   }
 
+  /* room to grow? */
+  maxThreads = numThreads;
+  if ((poolArg = getFlagValue(argc, argv, "-w"))) {
+    maxThreads = atoi(poolArg);
+    if (maxThreads < numThreads) {
+      printf("Invalid maximum thread count \"%s\"; it can't be less than %d.  Exiting...\n", poolArg, numThreads);
+      exit(INCORRECT_ARGS);
+    }
+  }
+
   /* do everything else */
   initializeGlobals();
 
+  /* the error pages sent most often */
+  prerenderError(400, "Bad Request", "No request found.\n");
+  prerenderError(400, "Bad Request", "Can't parse request.\n");
+  prerenderError(400, "Bad Request", "Bad filename.\n");
+  prerenderError(400, "Bad Request", "Illegal filename.\n");
+  prerenderError(403, "Forbidden", "File is protected.\n");
+  prerenderError(404, "Not Found", "File not found.\n");
+  prerenderError(500, "Internal Server Error", "The server encountered an error.\n");
+  prerenderError(501, "Not Implemented", "That method is not implemented.\n");
+  prerenderError(503, "Service Unavailable", "The server is too busy; try again shortly.\n");
+
+  /* the file cache */
+  if (!(fileCache = newFileCache(CACHE_SHARDS, cacheEntries, cacheInterval, cacheMemory * 1024 * 1024, rootfd))) {
+    printf("Error allocating memory for file cache.  Exiting...\n");
+    exit(MEMALLOC_FAILURE);
+  }
+
+  /* compressed copies live in the file cache, so they need room there */
+  if (compressThreads > 0 && cacheEntries > 0 && cacheMemory > 0 &&
+      !(compressPool = newCompressPool(fileCache, compressThreads, COMPRESS_QUEUE))) {
+    printf("Error starting compression threads.  Exiting...\n");
+    exit(MEMALLOC_FAILURE);
+  }
+
   /* construct the server information */
   memset(&localaddr, 0, sizeof(localaddr));
   localaddr.sin_family 		= AF_INET;
   localaddr.sin_addr.s_addr	= htonl(INADDR_ANY);
   localaddr.sin_port		= htons(atoi(argv[1])); 
   
-  /* bind the server socket */
-  if (bind(serverSock, (struct sockaddr *) &localaddr, sizeof(localaddr)) < 0) {
-    printf("Error binding port to local address.  Exiting...\n");
-    exit(SOCKET_FAILURE);
+  /* replacing a running server?  then its listening sockets are ours */
+  if ((handoffArg = getenv(HANDOFF_ENV))) {
+    chan = atoi(handoffArg);
+    unsetenv(HANDOFF_ENV);
+    if (!(socks = malloc(numShards * sizeof(int))) ||
+        handoffRecv(chan, socks, numShards) < 0) {
+      printf("Unable to take over the listening sockets.  Exiting...\n");
+      exit(SOCKET_FAILURE);
+    }
   }
 
-  /* listen... */
-  if (listen(serverSock, MAXCONNECTIONS_SERVER) < 0) {
-    printf("Error listening for incoming connections.  Exiting...\n");
-    exit(SOCKET_FAILURE);
+  /* bind and listen; every shard gets its own socket on the same port */
+  numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+  for (i = 0; i < numShards; i++) {
+    shards[i].sock = (socks ? socks[i] : openListener(&localaddr));
+    shards[i].cpu  = (pinShards && numCPUs > 0 ? i % numCPUs : -1);
   }
+  serverSock = shards[0].sock;
+  free(socks);
 
   /* everything is set up, so establish the interrupt handler */
   sa.sa_handler = catchInterrupt;
@@ -118,13 +406,47 @@ int main(int argc, char** argv) {
   sa.sa_flags = 0;
   sigaction(SIGINT, &sa, NULL);
 
+  /* SIGUSR1 prints statistics */
+  sa.sa_handler = catchStats;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  /* SIGUSR2 hands over to a new build */
+  sa.sa_handler = catchUpgrade;
+  sigaction(SIGUSR2, &sa, NULL);
+
+  /* writev() and sendfile() have no MSG_NOSIGNAL; a client hanging up
+   * mid-response should cost us an EPIPE, not the whole server */
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
   /*************************************\
   |* here's where the magic happens... *|
   \*************************************/
 
-  /* start the worker threads */
-  for (i = 0; i < numThreads; i++) {
-    pthread_create(&workers[i], &scope, handleClient, (void *)i);
+  /* the worker threads' deadlines are kept by a thread of their own */
+  if (!(reaper = newWatchdog(WHEEL_TICK, workerExpire, NULL))) {
+    printf("Error starting the watchdog thread.  Exiting...\n");
+    exit(MEMALLOC_FAILURE);
+  }
+
+  /* start the worker threads; each is handed its shard */
+  for (i = 0; i < numShards; i++) {
+    if (!(shards[i].pool = newWorkerPool(shards[i].ring, numThreads, maxThreads, handleClient, &shards[i]))) {
+      printf("Error starting worker threads.  Exiting...\n");
+      exit(MEMALLOC_FAILURE);
+    }
+    poolShed(shards[i].pool, shedTarget, SHED_INTERVAL);
+  }
+
+  /* sharded?  then every shard accepts on its own */
+  if (numShards > 1) {
+    for (i = 0; i < numShards; i++) {
+      if (fcntl(shards[i].sock, F_SETFL, fcntl(shards[i].sock, F_GETFL) | O_NONBLOCK) < 0) {
+        printf("Unable to set server socket as nonblocking.  Exiting...\n");
+        exit(SOCKET_FAILURE);
+      }
+      pthread_create(&shards[i].acceptor, &scope, acceptLoop, &shards[i]);
+    }
   }
 
   /* make the socket NONBLOCKING */
@@ -134,6 +456,42 @@ int main(int argc, char** argv) {
     #endif
   }
 
+  /* start the event loops; from here on they own the server socket */
+  if (numLoops) {
+    if (fcntl(serverSock, F_SETFL, fcntl(serverSock, F_GETFL) | O_NONBLOCK) < 0) {
+      printf("Unable to set server socket as nonblocking.  Exiting...\n");
+      exit(SOCKET_FAILURE);
+    }
+
+    for (i = 0; i < numLoops; i++) {
+      loops[i].live = NULL;
+      if (URING) { /* each loop sets up its own uring */
+        loops[i].epfd = -1;
+        pthread_create(&loops[i].thread, &scope, ringLoop, &loops[i]);
+        continue;
+      }
+      if ((loops[i].epfd = epoll_create1(0)) < 0) {
+        printf("Error creating event loop.  Exiting...\n");
+        exit(SOCKET_FAILURE);
+      }
+      pthread_create(&loops[i].thread, &scope, eventLoop, &loops[i]);
+    }
+
+    /* a loop that can't set up exits, and this has to be sure none
+     * will before telling the server we replaced to stop */
+    pthread_mutex_lock(&loopsMutex);
+    while (loopsUp < numLoops) {
+      pthread_cond_wait(&loopsCond, &loopsMutex);
+    }
+    pthread_mutex_unlock(&loopsMutex);
+  }
+
+  /* everything is accepting, so the server we replaced can stop */
+  if (chan >= 0) {
+    handoffReady(chan);
+    printf("Took over from the previous server.\n");
+  }
+
   while (LOOP) { /* loop until this variable changes by way of SIGINT */
     unsigned int clientLength = sizeof(clientaddr);
 
@@ -143,6 +501,20 @@ int main(int argc, char** argv) {
       }
     #endif
 
+    /* asked for statistics? */
+    if (STATS) {
+      STATS = 0;
+      printStats();
+    }
+
+    /* asked to hand over to a new build? */
+    if (UPGRADE) {
+      UPGRADE = 0;
+      if (upgradeServer(argv) == 0) {
+        break;
+      }
+    }
+
     /* ---=SHARED MEMORY=--- */
     if (OPTIMIZED) {
       if (shMeta->proxyFlag == ONLINE) { /* possibility for use! */
@@ -150,25 +522,27 @@ int main(int argc, char** argv) {
         memnode* node = findState(shList, shMeta->numNodes, WAITING_INIT_SRVR);
         if (node && node->serverState == IDLE) { /* GOT A REQUEST */
           node->serverState = BUSY;
-          pthread_mutex_lock(&mConList);
-          addTail(0, SHARED, list);
-          pthread_cond_broadcast(&free_conn);
-          pthread_mutex_unlock(&mConList);
+          enqueue(&shards[0], 0, SHARED);
         }  
       }
     }
     /* ---=END SHARED MEMORY=--- */
 
+    /* the event loops or shards are accepting, so there's nothing left
+     * to do here */
+    if (numLoops || numShards > 1) {
+      if (!OPTIMIZED) {
+        sleep(1); /* woken early by SIGINT */
+      }
+      continue;
+    }
+
     if ((clientSock = accept(serverSock, (struct sockaddr *) &clientaddr, &clientLength)) < 0) {
       if (!LOOP) { /* the loop was broken, so the socket is closed! */
         break;
-      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        continue; /* we're just fine */
+      } else if (acceptFailed()) { /* give connections a chance to close */
+        poll(NULL, 0, ACCEPT_BACKOFF);
       }
-
-      /* if we get here, then there's an actual problem */
-      printf("Error accepting incoming connection.  Exiting...\n");
-      exit(SOCKET_FAILURE);
     } else {
 
       #ifdef DEBUG
@@ -176,10 +550,7 @@ int main(int argc, char** argv) {
         printf("Server: Connection from %s\n", client_Addr);
       #endif
     
-      pthread_mutex_lock(&mConList);
-      addTail(clientSock, PROCESS, list);
-      pthread_cond_broadcast(&free_conn);
-      pthread_mutex_unlock(&mConList);
+      enqueue(&shards[0], clientSock, PROCESS);
     }
     /* keep it goin' */
   }
@@ -201,25 +572,36 @@ int main(int argc, char** argv) {
  * is not honored), constructs a valid HTTP response, and sends it on its
  * merry way to the client.
  *
- * args is the unique thread ID corresponding to the position in the "available" array
+ * args is the worker pool of the shard the thread works for
  */
 static void* handleClient(void* args) {
-  connection* c;
-  int ID = (int)args;
+  connection node;		/* the connection being served */
+  connection* c = &node;
+  char input[MAXREQUEST];	/* its requests, as they arrive */
+  arena scratch;		/* everything else a request needs */
+  instruction action;
+  int sock;
+  workerpool* pool = (workerpool*)args;
+  shard* s = (shard*)pool->arg;
+  int ID = poolEnter(pool);
   
   #ifdef DEBUG
     printf("Thread %d executing\n", ID);
   #endif 
+
+  pinThread(s->cpu);
+  if (initArena(&scratch, ARENA_SIZE) < 0) {
+    printf("Error allocating memory for worker %d.  Exiting...\n", ID);
+    exit(MEMALLOC_FAILURE);
+  }
+  useArena(&scratch);
  
   while (1) { /* loop indefinitely, or until this thread quits */
  
     /* sit and wait until there's a connection available, then nab it */
-    pthread_mutex_lock(&mConList);
-    while (isEmpty(list)) {
-      pthread_cond_wait(&free_conn, &mConList);
-    }
-    c = removeHead(list);
-    pthread_mutex_unlock(&mConList);
+    poolTake(pool, &sock, &action);
+    initConnection(c, sock, action);
+    c->inBuf = input;
 
     #ifdef DEBUG
       if (c->action == PROCESS) {
@@ -232,13 +614,16 @@ static void* handleClient(void* args) {
     #endif
 
     if (c->action == TERMINATE) { /* time to exit! */
-      free(c);
-
       #ifdef DEBUG
         printf("Thread %d terminated.\n", ID);
       #endif
 
+      freeArena(&scratch);
+      poolLeave(pool);
       pthread_exit(0);
+    } else if (c->action == SHED) { /* waited too long; a quick no is kinder */
+      turnAway(c->conn);
+      continue;
     }
 
     /* now process this connection! */
@@ -253,28 +638,209 @@ static void* handleClient(void* args) {
 
       /* process the connection */ 
       checkAndSend(node, 1);
-      free(c);
+      arenaReset(&scratch);
 
       #ifdef DEBUG
         printf("server.c: Shared connection successfully processed and closed!\n");
       #endif
       node->serverState = IDLE;
     } else {
-      checkAndSend(c, 0);
+      /* keep serving the socket for as long as the client wants it,
+       * starting right away on any requests it has pipelined */
+      do {
+        checkAndSend(c, 0);
+        watchCancel(reaper, &(c->deadline));
+        arenaReset(&scratch);
+      } while (c->keepAlive && LOOP && (c->inLen > 0 || awaitRequest(c)));
       close(c->conn);
-      free(c);
     }
   } /* end while loop */
   /* no need for a return statement, since execution will never get here */
 }
 
+/*
+ * The accept loop for one shard of a sharded server.  Each shard has
+ * its own listening socket bound to the same port with SO_REUSEPORT,
+ * so the kernel spreads incoming connections over the shards and no
+ * lock is shared between them.  The socket is nonblocking, so the loop
+ * wakes up regularly to notice LOOP.
+ *
+ * @param args The shard to accept for.
+ */
+static void* acceptLoop(void* args) {
+  shard* s = (shard*)args;
+  struct pollfd pfd;
+  int clientSock;
+
+  pinThread(s->cpu);
+
+  pfd.fd = s->sock;
+  pfd.events = POLLIN;
+  while (LOOP) {
+    if (poll(&pfd, 1, EPOLL_TIMEOUT) <= 0) {
+      continue; /* timed out, or interrupted */
+    }
+
+    /* take everything that's waiting */
+    while ((clientSock = accept(s->sock, NULL, NULL)) >= 0) {
+      enqueue(s, clientSock, PROCESS);
+    }
+    if (acceptFailed()) { /* give connections a chance to close */
+      poll(NULL, 0, ACCEPT_BACKOFF);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Decides what to do about a failed accept().  Running out of
+ * descriptors or memory passes as connections close, and a connection
+ * that died waiting in the backlog is only that client's problem; only
+ * a listening socket that is itself broken ends the server.
+ *
+ * @return 1 if the caller should hold off accepting for a moment, 0 if
+ *         it can carry on (usually because there was nothing to accept).
+ */
+static int acceptFailed(void) {
+  switch (errno) {
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+      printf("Out of resources accepting connections (%s).  Backing off...\n",
+             strerror(errno));
+      return 1;
+
+    case EBADF:
+    case EINVAL:
+    case ENOTSOCK:
+    case EFAULT:
+      printf("Error accepting incoming connection.  Exiting...\n");
+      exit(SOCKET_FAILURE);
+
+    default: /* EAGAIN, EINTR, ECONNABORTED, and pending network errors */
+      return 0;
+  }
+}
+
+/*
+ * Hands a connection to one of a shard's workers, waking exactly one
+ * if they're all asleep, or adding a worker if they're all busy and
+ * the queue is backing up.
+ *
+ * @param s The shard.
+ * @param sock The socket identifier, if any.
+ * @param action What the worker should do with it.
+ * @return 0 on success, -1 if the shard was too backed up to take a
+ *         new client, in which case it has been turned away.
+ */
+static int enqueue(shard* s, int sock, instruction action) {
+  while (ringPush(s->ring, sock, action) < 0) {
+    if (action == PROCESS) { /* overloaded; turn the client away */
+      #ifdef DEBUG
+        printf("server.c: Queue full, refusing connection %d!\n", sock);
+      #endif
+      __sync_fetch_and_add(&refused, 1);
+      turnAway(sock);
+      return -1;
+    }
+    sched_yield(); /* anything else has to get through */
+  }
+  poolCheck(s->pool);
+  return 0;
+}
+
+/*
+ * Refuses a client the server has no room for, with the 503 rendered at
+ * startup, so it can try again or go elsewhere rather than wait.  What
+ * it has already sent is read and thrown away first, since closing a
+ * socket with unread data resets the connection, and the 503 could go
+ * with it.  Nothing here waits on the client.
+ *
+ * @param sock The client's socket, which is closed.
+ */
+static void turnAway(int sock) {
+  char discard[HEADERCHUNK];
+  connection c;
+
+  /* a client that isn't reading just doesn't get the page */
+  if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == 0) {
+    recv(sock, discard, sizeof(discard), 0);
+    initConnection(&c, sock, PROCESS);
+    sendError(503, "Service Unavailable", (char*)0, "The server is too busy; try again shortly.\n", &c, 0);
+  }
+  close(sock);
+}
+
+/*
+ * Opens, binds, and listens on a server socket.  Sharded servers bind
+ * several of these to the same port, which SO_REUSEPORT allows.
+ *
+ * @param localaddr The address to bind to.
+ * @return The listening socket.  Exits on failure.
+ */
+static int openListener(struct sockaddr_in* localaddr) {
+  int sock, on = 1;
+
+  if ((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+    printf("Error opening socket for listening.  Exiting...\n");
+    exit(SOCKET_FAILURE);
+  }
+
+  if (numShards > 1 &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+    printf("Unable to share the listening port between shards.  Exiting...\n");
+    exit(SOCKET_FAILURE);
+  }
+
+  /* bind the server socket */
+  if (bind(sock, (struct sockaddr *) localaddr, sizeof(*localaddr)) < 0) {
+    printf("Error binding port to local address.  Exiting...\n");
+    exit(SOCKET_FAILURE);
+  }
+
+  /* listen... */
+  if (listen(sock, backlog) < 0) {
+    printf("Error listening for incoming connections.  Exiting...\n");
+    exit(SOCKET_FAILURE);
+  }
+
+  return sock;
+}
+
+/*
+ * Pins the calling thread to a single CPU.  This goes straight to the
+ * system call, since the pthread and glibc wrappers need _GNU_SOURCE.
+ *
+ * @param cpu The CPU to run on, or -1 to leave the thread alone.
+ */
+static void pinThread(int cpu) {
+  unsigned long mask[CPU_MASK_WORDS];
+  int bits = 8 * sizeof(unsigned long);
+
+  if (cpu < 0 || cpu >= CPU_MASK_WORDS * bits) {
+    return;
+  }
+
+  memset(mask, 0, sizeof(mask));
+  mask[cpu / bits] = 1UL << (cpu % bits);
+  if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0) {
+    #ifdef DEBUG
+      printf("server.c: Unable to pin thread to CPU %d!\n", cpu);
+    #endif
+  }
+}
+
 /*
  * The connection type has been abstracted out via a "void*" cast, and
  * only when a message is send by way of sendResponse will the abstraction
  * be cast aside.
  *
  * This function takes care of processing the incoming connection, checking
- * for any errors, and generating a response.
+ * for any errors, and generating a response.  Over a socket, exactly one
+ * request is handled per call; anything the client sent after it stays
+ * in the connection's buffer for the next call.
  *
  * NOTE: This function makes the HORRIBLE TERRIBLE AWFUL assumption that
  *       no request header will EVER exceed 20,0000 bytes.  This size
@@ -289,22 +855,45 @@ static void* handleClient(void* args) {
  *               is to take place through shared memory or sockets.
  */
 static void checkAndSend(void* conn, int shared) {
-  struct stat sb;
-  char line[20000], method[10000], path[10000], protocol[10000], location[10000], idx[10000];
-  void* contents;
-  int fileLen;
-  char* file;
-
-  memset(&line, 0, sizeof(line));
+  httprequest req;
+  int parsed;
 
   /* this is the ONLY TIME this function will specifically check shared */
   if (!shared) {
     connection* c = (connection*)conn;
-    if (recv(c->conn, line, sizeof(line) - 1, 0) < 0) {
-      sendError(400, "Bad Request", (char*)0, "No request found.\n", conn, shared);
-      return; /* nothing else to do here */
+    long int bytes;
+
+    c->keepAlive = 0; /* until a good request says otherwise */
+    setDeadline(NULL, c, DEADLINE_HEADER); /* however slowly it trickles in */
+
+    /* read until there's a whole request, however it was split up */
+    while ((parsed = parseRequest(c->inBuf, c->inLen, &(c->inScanned), &req)) == PARSE_INCOMPLETE &&
+           c->inLen < MAXREQUEST) {
+      if ((bytes = recv(c->conn, c->inBuf + c->inLen, MAXREQUEST - c->inLen, 0)) < 0) {
+        sendError(400, "Bad Request", (char*)0, "No request found.\n", conn, shared);
+        return; /* nothing else to do here */
+      } else if (bytes == 0) { /* client hung up */
+        return;
+      }
+      c->inLen += bytes;
+    }
+    setDeadline(NULL, c, DEADLINE_WRITE);
+
+    if (parsed != PARSE_DONE) { /* garbage, or too big to ever fit */
+      sendError(400, "Bad Request", (char*)0, "Can't parse request.\n", conn, shared);
+      return;
     }
+
+    #ifdef DEBUG
+      printf("server.c: Request received, processing.\n");
+    #endif
+
+    processRequest(&req, conn, shared);
+    consumeInput(c, req.length);
+    c->headOnly = 0;
   } else { /* shared memory */
+    char* line = scratchAlloc(MAXREQUEST);
+    long int scanned = 0;
     void* request;
     long int bytes = 0;
     memnode* node = (memnode*)conn;
@@ -313,6 +902,11 @@ static void checkAndSend(void* conn, int shared) {
       printf("server.c: Beginning shared memory read of request.\n");
     #endif
 
+    if (!line) {
+      printf("FATAL SERVER ERROR: NO MEMORY FOR SHARED MEMORY REQUEST!\n");
+      exit(MEMALLOC_FAILURE);
+    }
+
     /* now signal the proxy */
     pthread_cond_signal(&(node->condition));
 
@@ -348,26 +942,74 @@ static void checkAndSend(void* conn, int shared) {
 
     /* mutex was locked prior to calling checkAndSend - unlock it */
     node->serverState = BUSY;
-  }
-
-  #ifdef DEBUG
-    printf("server.c: Request received, processing.\n");
-  #endif
 
-  /* from here on, abstraction will be used */
-  /* continue checks against input */
+    #ifdef DEBUG
+      printf("server.c: Request received, processing.\n");
+    #endif
 
-  /* CHECK FOR SUCCESSFUL PARSING */
-  if (sscanf(line, "%[^ ] %[^ ] %[^ ]", method, path, protocol) != 3) {
-    sendError(400, "Bad Request", (char*)0, "Can't parse request.\n", conn, shared);
-    return;
+    /* from here on, abstraction will be used */
+    if (parseRequest(line, bytes, &scanned, &req) != PARSE_DONE) {
+      sendError(400, "Bad Request", (char*)0, "Can't parse request.\n", conn, shared);
+      return;
+    }
+    processRequest(&req, conn, shared);
   }
+}
+
+/*
+ * Given a complete request, this function does the actual work of
+ * checking it for errors, locating the requested resource, and
+ * generating a response.  It is shared by checkAndSend(), which
+ * receives requests itself, and by the event loops, which accumulate
+ * requests a piece at a time.
+ *
+ * @param req The parsed request.  Its path is decoded and normalized in
+ *            place, so the buffer underneath it is modified.
+ * @param conn The abstracted connection data type.
+ * @param shared A flag indicating whether this conection's communication
+ *               is to take place through shared memory or sockets.
+ */
+static void processRequest(httprequest* req, void* conn, int shared) {
+  struct stat sb;
+  cacheentry* entry;
+  char* location, *idx;
+  int fileLen;
+  char* file, *path;
+
+  /* continue checks against input; sendError() closes the connection */
 
   /* CHECK FOR CORRECT HTML METHOD */
-  if (strcasecmp(method, "get") != 0) {
+  /* HEAD is GET without the body; shared memory only does GET */
+  if (!spanCaseEquals(req->method, "get") &&
+      (shared || !spanCaseEquals(req->method, "head"))) {
     sendError(501, "Not Implemented", (char*)0, "That method is not implemented.\n", conn, shared);
     return;
   }
+  if (!shared) {
+    ((connection*)conn)->headOnly = spanCaseEquals(req->method, "head");
+  }
+
+  /* DECIDE WHETHER THE CONNECTION STAYS OPEN */
+  /* HTTP/1.1 persists unless told to close; HTTP/1.0 only if asked */
+  if (!shared) {
+    connection* c = (connection*)conn;
+    httpfield* persist = findField(req, "Connection");
+
+    if (spanCaseEquals(req->version, "HTTP/1.1")) {
+      c->keepAlive = !(persist && spanHasToken(persist->value, "close"));
+    } else {
+      c->keepAlive = (persist && spanHasToken(persist->value, "keep-alive"));
+    }
+    if (keepAliveTimeout <= 0 || ++(c->requests) >= maxRequests ||
+        !LOOP) { /* on our way out */
+      c->keepAlive = 0;
+    }
+  }
+
+  /* the path is used as a string from here on; the byte after it is
+   * the space before the version, so it's safe to overwrite */
+  path = req->path.start;
+  path[req->path.len] = '\0';
 
   /* CHECK FOR CORRECT PATHNAME SYNTAX */
   if (path[0] != '/') {
@@ -375,100 +1017,79 @@ static void checkAndSend(void* conn, int shared) {
     return;
   }
 
-  /* SET UP FILE ACCESS */
+  /* SET UP FILE ACCESS, CHECKING FOR ATTEMPTS AT FORBIDDEN FILE READS */
+  /* decoded and made canonical in place; the result is the cache key */
   file = &(path[1]); /* first character, aside from forward slash */
-  strDecode(file, file); /* get rid of HTML encodings in file */
-  if (file[0] == '\0') { /* this means only the root was requested */ 
-    file = "./";
-  }
-  fileLen = strlen(file);
-
-  /* CHECK FOR ATTEMPS AT FORBIDDEN FILE READS */
-  if (file[0] == '/' || strcmp(file, "..") == 0 || 
-      strncmp(file, "../", 3) == 0 || strstr(file, "/../") != (char*)0 ||
-      strcmp(&(file[fileLen - 3]), "/..") == 0) { /* evil */
-
+  if ((fileLen = normalizePath(file, file, req->path.len - 1)) < 0) { /* evil */
     sendError(400, "Bad Request", (char*)0, "Illegal filename.\n", conn, shared);
     return;
   }
+  if (fileLen == 0) { /* this means only the root was requested */ 
+    file = "./";
+    fileLen = 2;
+  }
 
   /* CHECK FOR LEGAL REQUESTED FILE */
-  if (stat(file, &sb) < 0) {
-    sendError(404, "Not Found", (char*)0, "File not found.\n", conn, shared);
+  if (!(entry = cacheLookup(fileCache, file))) {
+    sendError(500, "Internal Server Error", (char*)0, "The server encountered an error.\n", conn, shared);
+    return;
+  }
+  if (entry->error && !S_ISREG(entry->sb.st_mode)) { /* couldn't open it */
+    if (entry->error == EACCES) { /* there, but not for us (a directory, say) */
+      sendError(403, "Forbidden", (char*)0, "File is protected.\n", conn, shared);
+    } else { /* ENOENT, ENOTDIR, or EXDEV for a path leading out of the root */
+      sendError(404, "Not Found", (char*)0, "File not found.\n", conn, shared);
+    }
+    cacheRelease(fileCache, entry);
     return;
   }
+  sb = entry->sb;
 
   /* DETERMINE IF REQUEST IS FOR A FILE OR DIRECTORY */
   if (S_ISDIR(sb.st_mode)) { /* request is for a directory */
+    cacheentry* index;
+
     if (file[fileLen - 1] != '/') { /* append trailing slash to URL */
-      snprintf(location, sizeof(location) - 1, "Location: %s/%s", path, EOL);
-      sendError(302, "Found", location, "Directories must end with a slash.\n", conn, shared);
+      if ((location = scratchAlloc(strlen(path) + 16))) {
+        sprintf(location, "Location: %s/%s", path, EOL);
+        sendError(302, "Found", location, "Directories must end with a slash.\n", conn, shared);
+      } else {
+        sendError(500, "Internal Server Error", (char*)0, "The server encountered an error.\n", conn, shared);
+      }
+      cacheRelease(fileCache, entry);
       return;
     }
 
-    snprintf(idx, sizeof(idx) - 1, "%sindex.html", file);
-    if (stat(idx, &sb) >= 0) { /* this file exists */
-      int filedesc;
+    if (!(idx = scratchAlloc(fileLen + sizeof("index.html")))) {
+      sendError(500, "Internal Server Error", (char*)0, "The server encountered an error.\n", conn, shared);
+      cacheRelease(fileCache, entry);
+      return;
+    }
+    sprintf(idx, "%sindex.html", (strcmp(file, "./") == 0 ? "" : file));
+    if ((index = cacheLookup(fileCache, idx)) && 
+        (!index->error || S_ISREG(index->sb.st_mode))) { /* this file exists */
       file = idx;
-      filedesc = open(file, O_RDONLY);
-      if (!(contents = fileContents(filedesc, sb.st_size))) {
+      if (sendEntry(index, file, req, conn, shared) < 0) {
         sendError(403, "Forbidden", (char*)0, "File is protected.\n", conn, shared);
-        return;
       }
-      sendResponse(200, "OK", (char*)0, contentType(file), sb.st_size, contents, conn, shared);
-      if (munmap(contents, sb.st_size) < 0) {
-        printf("server.c: Cannot unmap file contents!\n");
-      }
-      close(filedesc);
+      cacheRelease(fileCache, index);
     } else { /* print out directory contents */
-      struct dirent **dl;
-      long int size;
-      char buf[10000];
-      int k, n = scandir(file, &dl, NULL, alphasort);
-      contents = NULL;
-      if (n < 0) { /* didn't find any files */
+      if (index) {
+        cacheRelease(fileCache, index);
+      }
+      if (sendListing(entry, file, conn, shared) < 0) {
         sendError(500, "Internal Server Error", (char*)0, "The server encountered an error.\n", conn, shared);
-        return;
       }
-      snprintf(buf, sizeof(buf) - 1, "<html><head><title>Index of %s</title></head>\n<body bgcolor=\"#99CC99\"><h3>Index of %s</h3>\n<pre>\n", file, file);
-      contents = appendStr(contents, buf);
-      size = strlen(buf);
-      for (k = 0; k < n; k++) {
-        int before, after;
-        before = strlen((char*)contents);
-        contents = appendStr(contents, dl[k]->d_name);
-        after = strlen((char*)contents);
-        size += (after - before);
-        free(dl[k]);
-      }
-      memset(&buf, 0, sizeof(buf));
-      snprintf(buf, sizeof(buf) - 1, "</pre>\n<hr /><address><a href=\"%s\">%s</a></address>\n</body></html>\n", SERVER_URL, SERVER_NAME);
-      contents = appendStr(contents, buf);
-      size += strlen(buf);
-
-      #ifdef DEBUG
-        printf("SIZE: %ld\nLENGTH: %d\nSTRING: %s\n", size, strlen((char*)contents), (char*)contents);
-      #endif
-
-      sendResponse(200, "OK", (char*)0, "text/html", size, contents, conn, shared);
-      free(contents);
-      free(dl);
     }
   } else { /* request is for a flat file */
-    int filedesc = open(file, O_RDONLY);
-    contents = fileContents(filedesc, sb.st_size);
-    if (!contents) { /* assuming bad file permissions */
-      sendError(403, "Forbidden", (char*)0, "File is protected.\n", conn, shared);
-      return;
-    }
 
     /* send everything on its merry way */
-    sendResponse(200, "OK", (char*)0, contentType(file), sb.st_size, contents, conn, shared);
-    if (munmap(contents, sb.st_size) < 0) {
-      printf("server.c: Cannot unmap file contents!\n");
+    if (sendEntry(entry, file, req, conn, shared) < 0) {
+      /* assuming bad file permissions */
+      sendError(403, "Forbidden", (char*)0, "File is protected.\n", conn, shared);
     }
-    close(filedesc);
   }
+  cacheRelease(fileCache, entry);
 
   /* everything was successful! */
   #ifdef DEBUG
@@ -476,12 +1097,1457 @@ static void checkAndSend(void* conn, int shared) {
   #endif
 }
 
-/*
- * Responsible for catching a CTRL+C action and cleaning up gracefully.
+/* Sends a regular file from the cache as a 200 response, or as a bare
+ * 304 if the request's validators show the client already has it, or
+ * as a 206 if it only asked for part of the file.  The 200 header, ETag
+ * and Last-Modified included, is formatted the first time the file is
+ * sent and kept with the entry from then on.  Small files
+ * are answered straight from memory, loading them in on first use;
+ * anything else is sent from the cached descriptor.  If the file has
+ * a precompressed copy the client accepts, that goes out instead.
+ *
+ * @param entry The cache entry for the file.
+ * @param file The file's name, for its MIME type.
+ * @param req The request, for its validators.
+ * @param conn The abstracted connection data type.
+ * @param shared A flag indicating whether this conection's communication
+ *               is to take place through shared memory or sockets.
+ * @return 0 on success, -1 if the file could not be read.
  */
-static void catchInterrupt(int signum) {
-  int i;
+static int sendEntry(cacheentry* entry, char* file, httprequest* req,
+                     void* conn, int shared) {
+  char validators[300];
+  char* prefix = cacheSlot(&(entry->header)), *header, *contents;
+  long int prefixLen;
+  byterange ranges[MAXRANGES];
+  httpfield* field;
+  int n, compressible = (compressPool && isCompressible(contentType(file)));
+
+  if (entry->fd < 0) { /* couldn't open it */
+    return -1;
+  }
 
+  /* a compressed copy, if there's one the client takes */
+  if ((n = pickCoding(entry, req)) >= 0) {
+    return sendVariant(entry, n, file, req, conn, shared);
+  }
+
+  /* if not, popular text files get one made in the background */
+  if (compressible && !findField(req, "Range") &&
+      (field = findField(req, "Accept-Encoding")) &&
+      spanAcceptsCoding(field->value, codingNames[CODING_GZIP])) {
+    compressHit(compressPool, entry);
+  }
+
+  snprintf(validators, sizeof(validators), "ETag: %s%sLast-Modified: %s%sAccept-Ranges: bytes%s%s",
+           entry->etag, EOL, entry->lastModified, EOL, EOL,
+           (entry->numVariants || compressible ? "Vary: Accept-Encoding" EOL : ""));
+
+  /* the client's copy is still good; nothing to read */
+  if (isNotModified(entry, entry->etag, req)) {
+    if (!(header = scratchHeader(&prefixLen, 304, "Not Modified", validators, (char*)0, 0))) {
+      return outOfScratch(conn, shared);
+    }
+    sendPrebuilt(header, prefixLen, NULL, 0, conn, shared);
+    return 0;
+  }
+
+  /* only part of it, if the client's copy is the one we have */
+  if ((field = findField(req, "Range")) && ifRangeMatches(entry, req) &&
+      (n = spanToRanges(field->value, entry->sb.st_size, ranges, MAXRANGES)) &&
+      (n = sendRanges(entry, file, ranges, n, validators, conn, shared)) <= 0) {
+    return n;
+  }
+
+  if (prefix) {
+    prefixLen = entry->headerLen;
+  } else {
+    if (!(header = scratchHeader(&prefixLen, 200, "OK", validators, contentType(file), entry->sb.st_size))) {
+      return outOfScratch(conn, shared);
+    }
+    if (!(prefix = cacheHeader(fileCache, entry, header, prefixLen))) {
+      prefix = header;
+    }
+  }
+
+  if ((contents = cacheSlot(&(entry->contents))) ||
+      (entry->sb.st_size <= CACHE_FILEMAX && fileCache->memLimit > 0 &&
+       cacheFill(fileCache, entry) && (contents = cacheSlot(&(entry->contents))))) {
+    sendPrebuilt(prefix, prefixLen, contents, entry->sb.st_size, conn, shared);
+    return 0;
+  }
+
+  return sendFilePrebuilt(prefix, prefixLen, entry->sb.st_size, entry->fd, 0, conn, shared);
+}
+
+/* Answers a request whose response couldn't get scratch memory from the
+ * arena.  The 500 page was rendered at startup, so it needs none.
+ *
+ * @return 0, for the caller to pass along as "response sent".
+ */
+static int outOfScratch(void* conn, int shared) {
+  sendError(500, "Internal Server Error", (char*)0, "The server encountered an error.\n", conn, shared);
+  return 0;
+}
+
+/* Picks the smallest of a file's precompressed copies that the
+ * request's Accept-Encoding field allows.  Range requests always get
+ * the file itself, since their offsets are into the uncompressed bytes.
+ *
+ * @return CODING_BR or CODING_GZIP, or -1 to send the file as it is.
+ */
+static int pickCoding(cacheentry* entry, httprequest* req) {
+  httpfield* field;
+  int best = -1, k;
+
+  if (!entry->numVariants || findField(req, "Range") ||
+      !(field = findField(req, "Accept-Encoding"))) {
+    return -1;
+  }
+
+  for (k = 0; k < NUMCODINGS; k++) {
+    if ((entry->variants[k].fd >= 0 || cacheSlot(&(entry->variants[k].contents))) &&
+        spanAcceptsCoding(field->value, codingNames[k]) &&
+        (best < 0 || entry->variants[k].size < entry->variants[best].size)) {
+      best = k;
+    }
+  }
+
+  return best;
+}
+
+/* Sends one of a file's precompressed copies as a 200 response, or a
+ * bare 304 if the client already has it.  It goes out like the file
+ * would, with the file's MIME type, the copy's own ETag, and its header
+ * kept with the entry, from memory if small.  Ranges aren't offered,
+ * since they'd be answered from the uncompressed file.
+ *
+ * @param entry The cache entry for the file.
+ * @param coding The copy to send, from pickCoding().
+ * @param file The file's name, for its MIME type.
+ * @param req The request, for its validators.
+ * @param conn The abstracted connection data type.
+ * @param shared A flag indicating whether this conection's communication
+ *               is to take place through shared memory or sockets.
+ * @return 0 on success, -1 if the copy could not be read.
+ */
+static int sendVariant(cacheentry* entry, int coding, char* file,
+                       httprequest* req, void* conn, int shared) {
+  cachevariant* variant = &(entry->variants[coding]);
+  char validators[300];
+  char* prefix = cacheSlot(&(variant->header)), *header, *contents;
+  long int prefixLen;
+
+  snprintf(validators, sizeof(validators), "ETag: %s%sLast-Modified: %s%sContent-Encoding: %s%sVary: Accept-Encoding%s",
+           variant->etag, EOL, entry->lastModified, EOL, codingNames[coding], EOL, EOL);
+
+  if (isNotModified(entry, variant->etag, req)) {
+    if (!(header = scratchHeader(&prefixLen, 304, "Not Modified", validators, (char*)0, 0))) {
+      return outOfScratch(conn, shared);
+    }
+    sendPrebuilt(header, prefixLen, NULL, 0, conn, shared);
+    return 0;
+  }
+
+  if (prefix) {
+    prefixLen = variant->headerLen;
+  } else {
+    if (!(header = scratchHeader(&prefixLen, 200, "OK", validators, contentType(file), variant->size))) {
+      return outOfScratch(conn, shared);
+    }
+    if (!(prefix = cacheVariantHeader(fileCache, entry, coding, header, prefixLen))) {
+      prefix = header;
+    }
+  }
+
+  if ((contents = cacheSlot(&(variant->contents))) ||
+      (variant->size <= CACHE_FILEMAX && fileCache->memLimit > 0 &&
+       cacheFillVariant(fileCache, entry, coding) &&
+       (contents = cacheSlot(&(variant->contents))))) {
+    sendPrebuilt(prefix, prefixLen, contents, variant->size, conn, shared);
+    return 0;
+  }
+
+  return sendFilePrebuilt(prefix, prefixLen, variant->size, variant->fd, 0, conn, shared);
+}
+
+/* Checks a request's validators against a file.  If-None-Match wins if
+ * both are given.  If-Modified-Since has to match the file's
+ * Last-Modified exactly (it is, after all, just that date handed back),
+ * which saves parsing dates and can't be fooled by clock skew.
+ *
+ * @param entry The cache entry for the file.
+ * @param etag The ETag of what would be sent: the file's, or a copy's.
+ * @return 1 if a 304 will do, 0 if the file has to be sent.
+ */
+static int isNotModified(cacheentry* entry, char* etag, httprequest* req) {
+  httpfield* field;
+
+  if ((field = findField(req, "If-None-Match"))) {
+    return spanHasETag(field->value, etag);
+  }
+  if ((field = findField(req, "If-Modified-Since"))) {
+    return spanCaseEquals(field->value, entry->lastModified);
+  }
+
+  return 0;
+}
+
+/* Checks the If-Range field, if any, which makes a Range field count
+ * only if the client's partial copy is of the file we have now.  Its
+ * value is either an ETag, which must match exactly (a weak one never
+ * does), or a date, which must be our Last-Modified.
+ *
+ * @return 1 if the Range field should be honored, 0 otherwise.
+ */
+static int ifRangeMatches(cacheentry* entry, httprequest* req) {
+  httpfield* field;
+
+  if (!(field = findField(req, "If-Range"))) {
+    return 1;
+  }
+  if (field->value.len > 0 && field->value.start[0] == '"') {
+    return (field->value.len == (long int)strlen(entry->etag) &&
+            memcmp(field->value.start, entry->etag, field->value.len) == 0);
+  }
+  return spanCaseEquals(field->value, entry->lastModified);
+}
+
+/* Sends the parts of a file asked for in a Range field as a 206.  A
+ * single range goes out like a whole file would, from memory or with
+ * sendfile() starting at its offset; several are put together as a
+ * multipart/byteranges body, unless they add up to more than
+ * RANGE_MULTIMAX bytes, in which case the caller sends the whole file.
+ * Ranges that all fall past the end of the file get a 416.
+ *
+ * @param entry The cache entry for the file.
+ * @param file The file's name, for its MIME type.
+ * @param ranges The ranges, as read by spanToRanges().
+ * @param count The number of ranges, or -1 if none could be satisfied.
+ * @param headers The validators to send along.
+ * @param conn The abstracted connection data type.
+ * @param shared A flag indicating whether this conection's communication
+ *               is to take place through shared memory or sockets.
+ * @return 0 if a response was sent, 1 if the whole file should be sent
+ *         instead, -1 if the file could not be read.
+ */
+static int sendRanges(cacheentry* entry, char* file, byterange* ranges,
+                      int count, char* headers, void* conn, int shared) {
+  char extra[400], mime[200];
+  long int size = entry->sb.st_size, total = 0, bodyLen;
+  char* body, *window, *header, *contents;
+  off_t slack;
+  strbuilder parts;
+  int k;
+
+  if (count < 0) {
+    snprintf(extra, sizeof(extra), "Content-Range: bytes */%ld%s", size, EOL);
+    sendError(416, "Range Not Satisfiable", extra, "The requested range is not available.\n", conn, shared);
+    return 0;
+  }
+
+  for (k = 0; k < count; k++) {
+    total += ranges[k].length;
+  }
+  if (count > 1 && total > RANGE_MULTIMAX) { /* not worth the copying */
+    return 1;
+  }
+
+  /* small files come from memory, same as when sent whole */
+  if (!cacheSlot(&(entry->contents)) && size <= CACHE_FILEMAX &&
+      fileCache->memLimit > 0) {
+    cacheFill(fileCache, entry);
+  }
+  contents = cacheSlot(&(entry->contents));
+
+  if (count == 1) {
+    snprintf(extra, sizeof(extra), "%sContent-Range: bytes %ld-%ld/%ld%s", headers, ranges[0].first, ranges[0].first + ranges[0].length - 1, size, EOL);
+    if (!(header = scratchHeader(&bodyLen, 206, "Partial Content", extra, contentType(file), ranges[0].length))) {
+      return outOfScratch(conn, shared);
+    }
+    if (contents) {
+      sendPrebuilt(header, bodyLen, contents + ranges[0].first,
+                   ranges[0].length, conn, shared);
+      return 0;
+    }
+    return sendFilePrebuilt(header, bodyLen, ranges[0].length, entry->fd, ranges[0].first, conn, shared);
+  }
+
+  /* the boundary is the ETag, which the file's bytes can't depend on */
+  snprintf(mime, sizeof(mime), "multipart/byteranges; boundary=squinn-%.*s",
+           (int)strlen(entry->etag) - 2, entry->etag + 1);
+  if (initBuilder(&parts, total + (count * 200)) < 0) {
+    return -1;
+  }
+  for (k = 0; k < count; k++) {
+    builderPrintf(&parts, "%s--%s%sContent-Type: %s%sContent-Range: bytes %ld-%ld/%ld%s%s", EOL, strchr(mime, '=') + 1, EOL, contentType(file), EOL, ranges[k].first, ranges[k].first + ranges[k].length - 1, size, EOL, EOL);
+    if (contents) {
+      builderAppend(&parts, contents + ranges[k].first, ranges[k].length);
+    } else if ((window = fileWindow(entry->fd, ranges[k].first, ranges[k].length, &slack))) {
+      builderAppend(&parts, window + slack, ranges[k].length);
+      munmap(window, ranges[k].length + slack);
+    } else {
+      freeBuilder(&parts);
+      return -1;
+    }
+  }
+  builderPrintf(&parts, "%s--%s--%s", EOL, strchr(mime, '=') + 1, EOL);
+  if (!(body = builderTake(&parts, &bodyLen))) {
+    return -1;
+  }
+
+  sendResponse(206, "Partial Content", headers, mime, bodyLen, body, conn, shared);
+  free(body);
+
+  return 0;
+}
+
+/* Sends the listing page for a directory as a 200 response.  The page
+ * is rendered once and kept with the directory's cache entry (memory
+ * budget permitting), along with its header, so until the directory
+ * changes a listing costs no more than a small cached file.
+ *
+ * @param entry The cache entry for the directory.
+ * @param file The directory's name, ending in a slash.
+ * @param conn The abstracted connection data type.
+ * @param shared A flag indicating whether this conection's communication
+ *               is to take place through shared memory or sockets.
+ * @return 0 on success, -1 if the directory could not be read.
+ */
+static int sendListing(cacheentry* entry, char* file, void* conn, int shared) {
+  char* prefix = cacheSlot(&(entry->header)), *header;
+  long int prefixLen, pageLen;
+  strbuilder page;
+  char** dl;
+  char* html, *contents;
+  int k, n;
+
+  if (!cacheSlot(&(entry->contents))) { /* render it */
+    if (entry->fd < 0 || (n = readDirectory(entry->fd, &dl)) < 0) {
+      return -1;
+    }
+
+    initBuilder(&page, 512 + (n * 64));
+    builderPrintf(&page, "<html><head><title>Index of %s</title></head>\n<body bgcolor=\"#99CC99\"><h3>Index of %s</h3>\n<pre>\n", file, file);
+    for (k = 0; k < n; k++) {
+      builderPrintf(&page, "<a href=\"%s\">%s</a><br />\n", dl[k], dl[k]);
+    }
+    builderPrintf(&page, "</pre>\n<hr /><address><a href=\"%s\">%s</a></address>\n</body></html>\n", SERVER_URL, SERVER_NAME);
+    if (!(html = builderTake(&page, &pageLen))) {
+      return -1;
+    }
+
+    #ifdef DEBUG
+      printf("SIZE: %ld\nSTRING: %s\n", pageLen, html);
+    #endif
+
+    /* keep it; failing that, send it this once */
+    if (!cacheListing(fileCache, entry, html, pageLen)) {
+      if (!cacheSlot(&(entry->contents))) {
+        sendResponse(200, "OK", (char*)0, "text/html", pageLen, html, conn, shared);
+        free(html);
+        return 0;
+      }
+      free(html); /* another thread kept one first */
+    }
+  }
+
+  /* the kept page, with its header formatted just the once */
+  contents = cacheSlot(&(entry->contents));
+  if (prefix) {
+    prefixLen = entry->headerLen;
+  } else {
+    if (!(header = scratchHeader(&prefixLen, 200, "OK", (char*)0, "text/html", entry->contentsLen))) {
+      return -1;
+    }
+    if (!(prefix = cacheHeader(fileCache, entry, header, prefixLen))) {
+      prefix = header;
+    }
+  }
+  sendPrebuilt(prefix, prefixLen, contents, entry->contentsLen, conn, shared);
+
+  return 0;
+}
+
+/* Reads the names in a directory, sorted, a la scandir() with
+ * alphasort().  The directory is reopened through the cache's
+ * descriptor rather than by name, so no path is walked again, and each
+ * caller gets a read position of its own.
+ *
+ * The names and the array are taken from the thread's arena, so there
+ * is nothing to free.
+ *
+ * @param dirfd The directory's descriptor, from the file cache.
+ * @param names Set to the names, good until the arena is reset.
+ * @return The number of names, or -1 on failure.
+ */
+static int readDirectory(int dirfd, char*** names) {
+  struct dirent* de;
+  DIR* dir;
+  char** list = NULL, **grown;
+  int n = 0, size = 0, fd;
+  long int len;
+
+  if ((fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    return -1;
+  }
+  if (!(dir = fdopendir(fd))) {
+    close(fd);
+    return -1;
+  }
+
+  while ((de = readdir(dir))) {
+    if (n == size) { /* the old array is left behind in the arena */
+      size = (size ? size * 2 : 64);
+      if (!(grown = scratchAlloc(sizeof(char*) * size))) {
+        closedir(dir);
+        return -1; /* half a listing would be cached as the whole thing */
+      }
+      if (n > 0) {
+        memcpy(grown, list, sizeof(char*) * n);
+      }
+      list = grown;
+    }
+    len = strlen(de->d_name) + 1;
+    if (!(list[n] = scratchAlloc(len))) {
+      closedir(dir);
+      return -1;
+    }
+    memcpy(list[n], de->d_name, len);
+    n++;
+  }
+  closedir(dir);
+
+  qsort(list, n, sizeof(char*), compareNames);
+  *names = list;
+  return n;
+}
+
+/* qsort() comparison for readDirectory(). */
+static int compareNames(const void* a, const void* b) {
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+/*
+ * This function is executed by each event loop thread.  Every loop
+ * watches the (nonblocking) server socket alongside the connections
+ * it has accepted, and pushes each connection through its states
+ * (READING, WRITING, CLOSING) as the socket becomes ready, so a slow
+ * client never ties up a thread.
+ *
+ * args is a pointer to this thread's eventloop struct
+ */
+static void* eventLoop(void* args) {
+  eventloop* loop = (eventloop*)args;
+  struct epoll_event ev, events[MAXEVENTS];
+  time_t lastSweep = time(NULL);
+  int i, n, listening = 1;
+
+  if (initArena(&(loop->scratch), ARENA_SIZE) < 0) {
+    printf("Error allocating memory for event loop.  Exiting...\n");
+    exit(MEMALLOC_FAILURE);
+  }
+  useArena(&(loop->scratch));
+  initWheel(&(loop->timers), WHEEL_TICK);
+
+  /* a NULL pointer marks the server socket */
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, serverSock, &ev) < 0) {
+    printf("Error watching server socket.  Exiting...\n");
+    exit(SOCKET_FAILURE);
+  }
+  loopUp();
+
+  /* the timeout lets the loop notice LOOP has changed; a replaced
+   * server keeps going until its connections are done */
+  while (LOOP || (loop->live && time(NULL) < drainUntil)) {
+    if (!LOOP && listening > 0) { /* but takes no new ones */
+      epoll_ctl(loop->epfd, EPOLL_CTL_DEL, serverSock, NULL);
+      listening = 0;
+    }
+
+    n = epoll_wait(loop->epfd, events, MAXEVENTS, EPOLL_TIMEOUT);
+    for (i = 0; i < n; i++) {
+      connection* c = (connection*)events[i].data.ptr;
+
+      if (!c) { /* new connections are waiting */
+        if (acceptConnections(loop) && listening > 0) { /* stop until the next sweep */
+          epoll_ctl(loop->epfd, EPOLL_CTL_DEL, serverSock, NULL);
+          listening = -1;
+        }
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        closeConnection(loop, c);
+      } else {
+        driveConnection(loop, c);
+      }
+    }
+
+    /* close whatever has run out of time */
+    wheelTurn(&(loop->timers), loopExpire, loop);
+    if (time(NULL) != lastSweep) {
+      if (!LOOP) {
+        expireIdle(loop);
+      } else if (listening < 0) { /* try accepting again */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        listening = (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, serverSock, &ev) == 0 ? 1 : -1);
+      }
+      lastSweep = time(NULL);
+    }
+  }
+
+  /* shutting down; drop anything still open */
+  while (loop->live) {
+    closeConnection(loop, loop->live);
+  }
+  freeArena(&(loop->scratch));
+
+  #ifdef DEBUG
+    printf("server.c: Event loop terminated.\n");
+  #endif
+
+  return NULL;
+}
+
+/*
+ * Accepts every pending connection on the server socket and registers
+ * each with the given event loop.  Connections are edge-triggered, so
+ * the loop is only woken when something actually changes.
+ *
+ * @param loop The event loop that will own the new connections.
+ * @return 1 if the loop should stop listening for a moment, 0 otherwise.
+ */
+static int acceptConnections(eventloop* loop) {
+  struct epoll_event ev;
+  connection* c;
+  int clientSock;
+
+  /* drain the backlog; EAGAIN means there's nothing left */
+  while ((clientSock = accept(serverSock, NULL, NULL)) >= 0) {
+    if (fcntl(clientSock, F_SETFL, fcntl(clientSock, F_GETFL) | O_NONBLOCK) < 0 ||
+        !(c = newConnection(clientSock, EVENT))) {
+      close(clientSock);
+      continue;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, clientSock, &ev) < 0) {
+      close(clientSock);
+      free(c);
+      continue;
+    }
+
+    /* the loop now owns this connection */
+    c->next = loop->live;
+    if (loop->live) {
+      loop->live->prev = c;
+    }
+    loop->live = c;
+    setDeadline(loop, c, DEADLINE_HEADER);
+
+    #ifdef DEBUG
+      printf("server.c: Event loop accepted connection %d.\n", clientSock);
+    #endif
+  }
+
+  return acceptFailed();
+}
+
+/*
+ * Advances a connection as far as its socket allows.  Requests are
+ * accumulated until the end of the header arrives, at which point the
+ * response is generated and queued; the queued response is then
+ * written until the socket would block, and the connection is closed
+ * once everything has gone out.  Requests the client pipelined behind
+ * the current one wait in the input buffer and are answered in turn.
+ *
+ * @param loop The event loop that owns the connection.
+ * @param c The connection to advance.
+ */
+static void driveConnection(eventloop* loop, connection* c) {
+  httprequest req;
+  long int bytes;
+  int parsed;
+
+  while (1) {
+    switch (c->state) {
+
+      case READING:
+        if (!c->inBuf && !(c->inBuf = malloc(MAXREQUEST))) {
+          closeConnection(loop, c);
+          return;
+        }
+
+        /* a pipelined request may already be waiting in the buffer */
+        parsed = parseRequest(c->inBuf, c->inLen, &(c->inScanned), &req);
+        if (parsed == PARSE_INCOMPLETE && c->inLen < MAXREQUEST) {
+          bytes = recv(c->conn, c->inBuf + c->inLen, MAXREQUEST - c->inLen, 0);
+          if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; /* wait for more */
+          } else if (bytes <= 0) { /* closed or broken */
+            closeConnection(loop, c);
+            return;
+          }
+          if (c->deadline.kind == DEADLINE_IDLE) { /* the next request starts */
+            setDeadline(loop, c, DEADLINE_HEADER);
+          }
+          c->inLen += bytes;
+          continue;
+        }
+
+        if (parsed == PARSE_DONE) {
+          processRequest(&req, c, 0);
+          consumeInput(c, req.length); /* the response has its own copy */
+          c->headOnly = 0;
+        } else { /* garbage, or too big to ever fit */
+          c->keepAlive = 0;
+          sendError(400, "Bad Request", (char*)0, "Can't parse request.\n", c, 0);
+        }
+        arenaReset(&(loop->scratch)); /* the response was copied out */
+        setDeadline(loop, c, DEADLINE_WRITE);
+        c->state = WRITING;
+        break;
+
+      case WRITING:
+        while (c->outSent < c->outLen) {
+          /* hold back a partial segment if a file body follows */
+          bytes = send(c->conn, c->outBuf + c->outSent, c->outLen - c->outSent, MSG_NOSIGNAL | (c->fileLeft > 0 ? MSG_MORE : 0));
+          COUNT_SYSCALL();
+          if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; /* EPOLLOUT will bring us back */
+          } else if (bytes < 0) {
+            closeConnection(loop, c);
+            return;
+          }
+          c->outSent += bytes;
+          setDeadline(loop, c, DEADLINE_WRITE);
+        }
+
+        /* then any file body, straight from the page cache */
+        while (c->fileLeft > 0) {
+          bytes = sendfile(c->conn, c->fileDesc, &(c->fileOffset), c->fileLeft);
+          COUNT_SYSCALL();
+          if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; /* EPOLLOUT will bring us back */
+          } else if (bytes <= 0) {
+            closeConnection(loop, c);
+            return;
+          }
+          c->fileLeft -= bytes;
+          setDeadline(loop, c, DEADLINE_WRITE);
+        }
+
+        /* either wait for the next request or hang up */
+        if (c->keepAlive) {
+          resetOutput(c);
+          setDeadline(loop, c, (c->inLen > 0 ? DEADLINE_HEADER : DEADLINE_IDLE));
+          c->state = READING;
+        } else {
+          c->state = CLOSING;
+        }
+        break;
+
+      case CLOSING:
+        closeConnection(loop, c);
+        return;
+    }
+  }
+}
+
+/*
+ * Closes every connection in the event loop that is waiting on a new
+ * request, once the server has stopped taking new connections, rather
+ * than leaving each to sit out its keep-alive timeout.  Connections in
+ * the middle of a request or response are left to finish.
+ *
+ * @param loop The event loop whose connections should be checked.
+ */
+static void expireIdle(eventloop* loop) {
+  connection* c = loop->live, *next;
+
+  while (c) {
+    next = c->next; /* c may be freed below */
+    if (c->deadline.kind == DEADLINE_IDLE) {
+
+      #ifdef DEBUG
+        printf("server.c: Closing idle connection %d.\n", c->conn);
+      #endif
+
+      if (c->action == RING) {
+        ringClose(loop, c);
+        ringRelease(loop, c);
+      } else {
+        closeConnection(loop, c);
+      }
+    }
+    c = next;
+  }
+}
+
+/*
+ * Starts the deadline for whatever a connection is waiting on next: the
+ * rest of a request header, which gets headerTimeout seconds however
+ * much of it trickles in meanwhile; progress on a response, which gets
+ * writeTimeout seconds each time; or the next request on a persistent
+ * connection, which gets the keep-alive timeout.  A timeout of 0 means
+ * no deadline at all.
+ *
+ * @param loop The event loop that owns the connection, or NULL for a
+ *             worker thread's connection, which the watchdog looks after.
+ * @param c The connection.
+ * @param kind What it's waiting on, one of the DEADLINE_ constants.
+ */
+static void setDeadline(eventloop* loop, connection* c, int kind) {
+  long int seconds = (kind == DEADLINE_HEADER ? headerTimeout :
+                      kind == DEADLINE_WRITE ? writeTimeout : keepAliveTimeout);
+
+  if (!loop && seconds > 0) {
+    watchSet(reaper, &(c->deadline), kind, seconds * 1000);
+  } else if (!loop) {
+    watchCancel(reaper, &(c->deadline));
+  } else if (seconds > 0) {
+    wheelSet(&(loop->timers), &(c->deadline), kind, seconds * 1000);
+  } else {
+    wheelCancel(&(loop->timers), &(c->deadline));
+  }
+}
+
+/*
+ * Closes an event loop's connection that has run out of time.
+ *
+ * @param t The connection's deadline.
+ * @param kind What it ran out on.
+ * @param arg The event loop.
+ */
+static void loopExpire(timer* t, int kind, void* arg) {
+  eventloop* loop = (eventloop*)arg;
+  connection* c = (connection*)t->data;
+
+  #ifdef DEBUG
+    printf("server.c: Connection %d ran out of time (deadline %d).\n", c->conn, kind);
+  #endif
+
+  __sync_fetch_and_add(&timeouts[kind], 1);
+  if (c->action == RING) {
+    ringClose(loop, c);
+    ringRelease(loop, c);
+  } else {
+    closeConnection(loop, c);
+  }
+}
+
+/*
+ * Shuts down a worker thread's connection that has run out of time,
+ * which wakes the worker blocked on it with an error or the end of the
+ * stream, and it gives up on the client as usual.  Called by the
+ * watchdog, with its lock held.  A response that has gone out in part
+ * within writeTimeout seconds, however slowly, is given more time.
+ *
+ * @param t The connection's deadline.
+ * @param kind What it ran out on.
+ * @param arg Unused.
+ */
+static void workerExpire(timer* t, int kind, void* arg) {
+  connection* c = (connection*)t->data;
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+
+  if (kind == DEADLINE_WRITE &&
+      getsockopt(c->conn, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+      info.tcpi_last_data_sent < writeTimeout * 1000U) {
+    wheelSet(&(reaper->wheel), t, kind, writeTimeout * 1000L - info.tcpi_last_data_sent);
+    return;
+  }
+
+  #ifdef DEBUG
+    printf("server.c: Connection %d ran out of time (deadline %d).\n", c->conn, kind);
+  #endif
+
+  __sync_fetch_and_add(&timeouts[kind], 1);
+  shutdown(c->conn, SHUT_RDWR);
+}
+
+/*
+ * Waits for the client on a persistent connection to send its next
+ * request, giving up after the keep-alive timeout.
+ *
+ * @param c The connection to wait on.
+ * @return 1 if the socket is readable (which includes the client
+ *         hanging up), 0 if the connection sat idle for too long.
+ */
+static int awaitRequest(connection* c) {
+  struct pollfd p;
+
+  p.fd = c->conn;
+  p.events = POLLIN;
+  if (poll(&p, 1, keepAliveTimeout * 1000) > 0) {
+    return 1;
+  }
+  __sync_fetch_and_add(&timeouts[DEADLINE_IDLE], 1);
+  return 0;
+}
+
+/*
+ * Closes an event-driven connection, removes it from its event loop,
+ * and frees everything associated with it.
+ *
+ * @param loop The event loop that owns the connection.
+ * @param c The connection to close.
+ */
+static void closeConnection(eventloop* loop, connection* c) {
+
+  /* closing the socket also removes it from the epoll set */
+  close(c->conn);
+  wheelCancel(&(loop->timers), &(c->deadline));
+
+  if (c->prev) {
+    c->prev->next = c->next;
+  } else {
+    loop->live = c->next;
+  }
+  if (c->next) {
+    c->next->prev = c->prev;
+  }
+
+  resetBuffers(c);
+  free(c);
+}
+
+/*
+ * This function is executed by each event loop thread when the loops
+ * use io_uring.  Rather than waiting to be told that a socket is ready
+ * and then making the calls itself, as eventLoop() does, the loop hands
+ * the kernel its accepts, receives, sends and splices up front and is
+ * told when each is done.  Everything queued while handling one batch
+ * of completions goes in with the single call that waits for the next.
+ *
+ * args is a pointer to this thread's eventloop struct
+ */
+static void* ringLoop(void* args) {
+  eventloop* loop = (eventloop*)args;
+  time_t lastSweep = time(NULL), deadline;
+  struct io_uring_sqe* sqe;
+  connection* c, *next;
+
+  if (initArena(&(loop->scratch), ARENA_SIZE) < 0) {
+    printf("Error allocating memory for event loop.  Exiting...\n");
+    exit(MEMALLOC_FAILURE);
+  }
+  useArena(&(loop->scratch));
+
+  initWheel(&(loop->timers), WHEEL_TICK);
+
+  /* only the thread that made a uring may submit to it */
+  if (initUring(&(loop->ring), URING_ENTRIES) < 0 ||
+      uringFiles(&(loop->ring), URING_FILES) < 0 ||
+      uringBuffers(&(loop->ring), URING_BUFS, URING_BUFSIZE) < 0) {
+    printf("Error setting up io_uring for event loop.  Exiting...\n");
+    exit(SOCKET_FAILURE);
+  }
+  loopUp();
+
+  /* the timeout lets the loop notice LOOP has changed; a replaced
+   * server keeps going until its connections are done */
+  while (LOOP || (loop->live && time(NULL) < drainUntil)) {
+    if (LOOP && loop->accepting == 0) {
+      ringAccept(loop);
+    } else if (!LOOP && loop->accepting > 0) { /* but takes no new ones */
+      if ((sqe = ringOp(loop, NULL, OP_CANCEL, IORING_OP_ASYNC_CANCEL))) {
+        sqe->addr = OP_ACCEPT;
+      }
+      loop->accepting = -1;
+    }
+    uringWait(&(loop->ring), EPOLL_TIMEOUT);
+    COUNT_SYSCALL();
+    ringReap(loop);
+
+    /* close whatever has run out of time */
+    wheelTurn(&(loop->timers), loopExpire, loop);
+    if (time(NULL) != lastSweep) {
+      if (!LOOP) {
+        expireIdle(loop);
+      }
+      if (loop->accepting < 0) { /* try accepting again */
+        loop->accepting = 0;
+      }
+      lastSweep = time(NULL);
+    }
+  }
+
+  /* shutting down; close everything, and give the kernel a moment to
+   * finish with the buffers it was handed */
+  for (c = loop->live; c; c = next) {
+    next = c->next;
+    ringClose(loop, c);
+  }
+  deadline = time(NULL) + 2;
+  while (loop->live && time(NULL) < deadline) {
+    uringWait(&(loop->ring), EPOLL_TIMEOUT);
+    ringReap(loop);
+  }
+  freeUring(&(loop->ring));
+
+  /* anything still here was never let go of; closing the ring did that */
+  while ((c = loop->live)) {
+    c->inflight = 0;
+    ringRelease(loop, c);
+  }
+  freeArena(&(loop->scratch));
+
+  #ifdef DEBUG
+    printf("server.c: Event loop terminated.\n");
+  #endif
+
+  return NULL;
+}
+
+/*
+ * Called by each event loop once it's ready to accept, so that main()
+ * knows when every one of them is.
+ */
+static void loopUp(void) {
+  pthread_mutex_lock(&loopsMutex);
+  loopsUp++;
+  pthread_cond_signal(&loopsCond);
+  pthread_mutex_unlock(&loopsMutex);
+}
+
+/*
+ * Fills in the next submission for an io_uring event loop, tagged with
+ * the connection it's for and what it's doing.
+ *
+ * @param loop The event loop.
+ * @param c The connection, or NULL for the server socket.
+ * @param op What the request is for, one of the OP_ tags.
+ * @param opcode The io_uring operation.
+ * @return The submission to fill in the rest of, or NULL if there's no
+ *         room for it.
+ */
+static struct io_uring_sqe* ringOp(eventloop* loop, connection* c, int op,
+                                   int opcode) {
+  struct io_uring_sqe* sqe;
+
+  if (!(sqe = uringSqe(&(loop->ring)))) {
+    #ifdef DEBUG
+      printf("server.c: Event loop's uring is full!\n");
+    #endif
+
+    return NULL;
+  }
+  sqe->opcode = opcode;
+  sqe->user_data = (uintptr_t)c | op;
+  if (c) {
+    c->inflight++;
+  }
+
+  return sqe;
+}
+
+/*
+ * Handles every completion waiting on an io_uring event loop.
+ *
+ * @param loop The event loop.
+ */
+static void ringReap(eventloop* loop) {
+  struct io_uring_cqe* cqe;
+
+  while ((cqe = uringPeek(&(loop->ring)))) {
+    ringComplete(loop, cqe);
+    uringSeen(&(loop->ring));
+  }
+}
+
+/*
+ * Arms a multishot accept on the server socket, which keeps accepting
+ * straight into the loop's registered files until it runs into trouble.
+ *
+ * @param loop The event loop.
+ */
+static void ringAccept(eventloop* loop) {
+  struct io_uring_sqe* sqe;
+
+  if (!(sqe = ringOp(loop, NULL, OP_ACCEPT, IORING_OP_ACCEPT))) {
+    return; /* try again next time around */
+  }
+  sqe->fd = serverSock;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->file_index = IORING_FILE_INDEX_ALLOC;
+  loop->accepting = 1;
+}
+
+/*
+ * Arms a multishot receive on a connection, which keeps filling provided
+ * buffers as data arrives until it runs into trouble.
+ *
+ * @param loop The event loop.
+ * @param c The connection.
+ */
+static void ringRecv(eventloop* loop, connection* c) {
+  struct io_uring_sqe* sqe;
+
+  if (!(sqe = ringOp(loop, c, OP_RECV, IORING_OP_RECV))) {
+    ringClose(loop, c);
+    return;
+  }
+  sqe->fd = c->conn;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_GROUP;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  c->receiving = 1;
+}
+
+/*
+ * Acts on one completion: a new connection, data received, output sent,
+ * or a connection finally let go of.  Whatever the connection it was for
+ * can do next is then queued.
+ *
+ * @param loop The event loop.
+ * @param cqe The completion.
+ */
+static void ringComplete(eventloop* loop, struct io_uring_cqe* cqe) {
+  connection* c = (connection*)(uintptr_t)(cqe->user_data & ~(__u64)OP_MASK);
+  int more = (cqe->flags & IORING_CQE_F_MORE);
+  struct io_uring_sqe* sqe;
+
+  if (c && !more) {
+    c->inflight--;
+  }
+
+  switch (cqe->user_data & OP_MASK) {
+
+    case OP_ACCEPT:
+      if (!more) { /* rearm now, unless something's wrong */
+        loop->accepting = (cqe->res < 0 ? -1 : 0);
+      }
+      if (cqe->res < 0) {
+        break;
+      } else if ((!LOOP && time(NULL) >= drainUntil) ||
+                 !(c = newConnection(cqe->res, RING))) {
+        if ((sqe = ringOp(loop, NULL, OP_CLOSE, IORING_OP_CLOSE))) {
+          sqe->file_index = cqe->res + 1;
+        } else {
+          uringDrop(&(loop->ring), cqe->res);
+        }
+        return;
+      }
+
+      /* the loop now owns this connection */
+      c->next = loop->live;
+      if (loop->live) {
+        loop->live->prev = c;
+      }
+      loop->live = c;
+      setDeadline(loop, c, DEADLINE_HEADER);
+
+      #ifdef DEBUG
+        printf("server.c: Event loop accepted connection %d.\n", c->conn);
+      #endif
+
+      ringRecv(loop, c);
+      ringRelease(loop, c); /* if that failed */
+      return;
+
+    case OP_RECV:
+      ringReceived(loop, c, cqe);
+      break;
+
+    case OP_SEND:
+      c->sending--;
+      if (cqe->res < 0) {
+        ringClose(loop, c);
+      } else {
+        c->outSent += cqe->res;
+        if (!c->closing) {
+          setDeadline(loop, c, DEADLINE_WRITE);
+        }
+      }
+      break;
+
+    case OP_FILL:
+      c->sending--;
+      if (cqe->res <= 0) { /* broken, or the file shrank */
+        ringClose(loop, c);
+      } else {
+        c->piped += cqe->res;
+        c->fileOffset += cqe->res;
+        c->fileLeft -= cqe->res;
+      }
+      break;
+
+    case OP_DRAIN:
+      c->sending--;
+      if (cqe->res < 0) {
+        ringClose(loop, c);
+      } else { /* a short one is still progress; ringSplice() sends the rest */
+        c->piped -= cqe->res;
+        if (cqe->res > 0 && !c->closing) {
+          setDeadline(loop, c, DEADLINE_WRITE);
+        }
+      }
+      break;
+
+    default: /* OP_CLOSE and OP_CANCEL */
+      break;
+  }
+
+  if (c) {
+    ringDrive(loop, c);
+    ringRelease(loop, c);
+  }
+}
+
+/*
+ * Copies what a receive brought in into the connection's input buffer,
+ * and rearms the receive if the kernel stopped it.  Whatever doesn't fit
+ * is held on to, and the receive cancelled, until ringRefill() has made
+ * room for it; nothing the kernel has handed over is ever thrown away.
+ *
+ * @param loop The event loop.
+ * @param c The connection.
+ * @param cqe The receive's completion.
+ */
+static void ringReceived(eventloop* loop, connection* c, struct io_uring_cqe* cqe) {
+  long int bytes = cqe->res, fits;
+  struct io_uring_sqe* sqe;
+  char* data, *held;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    c->receiving = 0;
+  }
+
+  if (bytes > 0) {
+    if (!c->closing) {
+      data = uringBuffer(&(loop->ring), cqe);
+      if (!c->inBuf && !(c->inBuf = malloc(MAXREQUEST))) {
+        uringRecycle(&(loop->ring), cqe);
+        ringClose(loop, c);
+        return;
+      }
+
+      /* what's already held has to go in first */
+      fits = (c->held ? 0 : MAXREQUEST - c->inLen);
+      if (fits > bytes) {
+        fits = bytes;
+      }
+      memcpy(c->inBuf + c->inLen, data, fits);
+      c->inLen += fits;
+
+      if (fits < bytes) { /* stop receiving until there's room */
+        if (!(held = realloc(c->held, c->heldLen + bytes - fits))) {
+          uringRecycle(&(loop->ring), cqe);
+          ringClose(loop, c);
+          return;
+        }
+        if (!c->held && c->receiving) {
+          if (!(sqe = ringOp(loop, c, OP_CANCEL, IORING_OP_ASYNC_CANCEL))) {
+            free(held);
+            uringRecycle(&(loop->ring), cqe);
+            ringClose(loop, c);
+            return;
+          }
+          sqe->addr = (uintptr_t)c | OP_RECV;
+        }
+        memcpy(held + c->heldLen, data + fits, bytes - fits);
+        c->held = held;
+        c->heldLen += bytes - fits;
+      }
+      if (c->deadline.kind == DEADLINE_IDLE) { /* the next request starts */
+        setDeadline(loop, c, DEADLINE_HEADER);
+      }
+    }
+    uringRecycle(&(loop->ring), cqe);
+  } else if (bytes == 0) { /* the client is done sending */
+    c->inShut = 1;
+  } else if (bytes != -ENOBUFS && bytes != -ECANCELED) { /* broken */
+    ringClose(loop, c);
+  }
+
+  /* out of buffers, or the kernel just felt like stopping */
+  if (!c->receiving && !c->closing && !c->inShut && !c->held) {
+    ringRecv(loop, c);
+  }
+}
+
+/*
+ * Moves as much held input as there's now room for into a connection's
+ * input buffer, and once none is left, starts receiving again.
+ *
+ * @param loop The event loop.
+ * @param c The connection.
+ */
+static void ringRefill(eventloop* loop, connection* c) {
+  long int fits = MAXREQUEST - c->inLen;
+
+  if (!c->held || fits <= 0) {
+    return;
+  }
+  if (fits > c->heldLen) {
+    fits = c->heldLen;
+  }
+  memcpy(c->inBuf + c->inLen, c->held, fits);
+  c->inLen += fits;
+  c->heldLen -= fits;
+  if (c->heldLen > 0) {
+    memmove(c->held, c->held + fits, c->heldLen);
+    return;
+  }
+
+  free(c->held);
+  c->held = NULL;
+  if (!c->receiving && !c->inShut) {
+    ringRecv(loop, c);
+  }
+}
+
+/*
+ * The io_uring version of driveConnection(): advances a connection as
+ * far as it can go without waiting on the kernel, queuing whatever it
+ * needs sent.  Requests are answered as they arrive, and pipelined ones
+ * in turn, but only once the previous response has gone out.
+ *
+ * @param loop The event loop that owns the connection.
+ * @param c The connection to advance.
+ */
+static void ringDrive(eventloop* loop, connection* c) {
+  httprequest req;
+  int parsed = PARSE_INCOMPLETE;
+
+  while (!c->closing && c->sending == 0) {
+    switch (c->state) {
+
+      case READING:
+        /* a pipelined request may already be waiting in the buffer */
+        ringRefill(loop, c);
+        if (c->closing) {
+          return;
+        }
+        if (c->inBuf) {
+          parsed = parseRequest(c->inBuf, c->inLen, &(c->inScanned), &req);
+        }
+        if (parsed == PARSE_INCOMPLETE && c->inLen < MAXREQUEST) {
+          if (c->inShut) { /* and nothing more is coming */
+            c->state = CLOSING;
+            break;
+          }
+          return; /* the receive will bring us back */
+        }
+
+        if (parsed == PARSE_DONE) {
+          processRequest(&req, c, 0);
+          consumeInput(c, req.length); /* the response has its own copy */
+          c->headOnly = 0;
+        } else { /* garbage, or too big to ever fit */
+          c->keepAlive = 0;
+          sendError(400, "Bad Request", (char*)0, "Can't parse request.\n", c, 0);
+        }
+        arenaReset(&(loop->scratch)); /* the response was copied out */
+        setDeadline(loop, c, DEADLINE_WRITE);
+        c->state = WRITING;
+        break;
+
+      case WRITING:
+        if (c->outSent < c->outLen) {
+          ringSend(loop, c);
+          return;
+        } else if (c->fileLeft > 0 || c->piped > 0) {
+          ringSplice(loop, c);
+          return;
+        }
+
+        /* either wait for the next request or hang up */
+        if (c->keepAlive) {
+          resetOutput(c);
+          setDeadline(loop, c, (c->inLen > 0 ? DEADLINE_HEADER : DEADLINE_IDLE));
+          c->state = READING;
+        } else {
+          c->state = CLOSING;
+        }
+        break;
+
+      case CLOSING:
+        ringClose(loop, c);
+        return;
+    }
+  }
+}
+
+/*
+ * Queues the rest of a connection's output buffer to be sent, holding
+ * back a partial segment if a file body follows.
+ *
+ * @param loop The event loop.
+ * @param c The connection.
+ */
+static void ringSend(eventloop* loop, connection* c) {
+  struct io_uring_sqe* sqe;
+
+  if (!(sqe = ringOp(loop, c, OP_SEND, IORING_OP_SEND))) {
+    ringClose(loop, c);
+    return;
+  }
+  sqe->fd = c->conn;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uintptr_t)(c->outBuf + c->outSent);
+  sqe->len = c->outLen - c->outSent;
+  sqe->msg_flags = MSG_NOSIGNAL | (c->fileLeft > 0 ? MSG_MORE : 0);
+  c->sending++;
+}
+
+/*
+ * Queues the next piece of a connection's file body, which goes from the
+ * file into the connection's pipe and from there onto the socket, so it
+ * never passes through here.  Whatever the pipe holds goes out first; it
+ * is only refilled once empty.  Each half is only queued once the one
+ * before it is done, so a drain always asks for exactly what's in the
+ * pipe, and one that comes up short just leaves the rest for next time.
+ *
+ * @param loop The event loop.
+ * @param c The connection.
+ */
+static void ringSplice(eventloop* loop, connection* c) {
+  struct io_uring_sqe* sqe;
+
+  if (c->pipe[0] < 0 && pipe(c->pipe) < 0) {
+    ringClose(loop, c);
+    return;
+  }
+
+  if (c->piped > 0) {
+    if (!(sqe = ringOp(loop, c, OP_DRAIN, IORING_OP_SPLICE))) {
+      ringClose(loop, c);
+      return;
+    }
+    sqe->fd = c->conn;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->off = (__u64)-1;
+    sqe->splice_fd_in = c->pipe[0];
+    sqe->splice_off_in = (__u64)-1;
+    sqe->len = c->piped;
+  } else {
+    if (!(sqe = ringOp(loop, c, OP_FILL, IORING_OP_SPLICE))) {
+      ringClose(loop, c);
+      return;
+    }
+    sqe->fd = c->pipe[1];
+    sqe->off = (__u64)-1;
+    sqe->splice_fd_in = c->fileDesc;
+    sqe->splice_off_in = c->fileOffset;
+    sqe->len = (c->fileLeft < URING_SPLICE ? c->fileLeft : URING_SPLICE);
+  }
+  c->sending++;
+}
+
+/*
+ * Starts closing an io_uring connection: its receive is cancelled and
+ * its socket closed.  The connection is freed by ringRelease() once the
+ * kernel has handed back everything it had for it.
+ *
+ * @param loop The event loop that owns the connection.
+ * @param c The connection to close.
+ */
+static void ringClose(eventloop* loop, connection* c) {
+  struct io_uring_sqe* sqe;
+
+  if (c->closing) {
+    return;
+  }
+  c->closing = 1;
+  c->state = CLOSING;
+  wheelCancel(&(loop->timers), &(c->deadline));
+
+  if (c->receiving && (sqe = ringOp(loop, c, OP_CANCEL, IORING_OP_ASYNC_CANCEL))) {
+    sqe->addr = (uintptr_t)c | OP_RECV;
+  }
+  if ((sqe = ringOp(loop, c, OP_CLOSE, IORING_OP_CLOSE))) {
+    sqe->file_index = c->conn + 1;
+  } else {
+    uringDrop(&(loop->ring), c->conn);
+  }
+}
+
+/*
+ * Frees an io_uring connection, if it's closing and the kernel has
+ * nothing left of it, and removes it from its event loop.
+ *
+ * @param loop The event loop that owns the connection.
+ * @param c The connection.
+ */
+static void ringRelease(eventloop* loop, connection* c) {
+  if (!c->closing || c->inflight > 0) {
+    return;
+  }
+
+  if (c->prev) {
+    c->prev->next = c->next;
+  } else {
+    loop->live = c->next;
+  }
+  if (c->next) {
+    c->next->prev = c->prev;
+  }
+
+  if (c->pipe[0] >= 0) {
+    close(c->pipe[0]);
+    close(c->pipe[1]);
+  }
+  resetBuffers(c);
+  free(c);
+}
+
+/*
+ * Replaces this server with a new copy of itself, started from whatever
+ * binary is now at the path this one was started from.  The new server
+ * is handed the listening sockets, and once it is accepting on them,
+ * this one stops accepting and finishes the connections it has, giving
+ * up on any still open after DRAIN_TIMEOUT seconds.
+ *
+ * @param argv The arguments this server was started with.
+ * @return 0 if the new server took over, -1 if it didn't, in which
+ *         case this one carries on as before.
+ */
+static int upgradeServer(char** argv) {
+  int* socks;
+  int chan, i, ok;
+  pid_t child;
+
+  if (!(socks = malloc(numShards * sizeof(int)))) {
+    return -1;
+  }
+  for (i = 0; i < numShards; i++) {
+    socks[i] = shards[i].sock;
+  }
+
+  if ((child = handoffSpawn(argv, &chan)) < 0) {
+    printf("Unable to start a new server; carrying on.\n");
+    free(socks);
+    return -1;
+  }
+  ok = (handoffSend(chan, socks, numShards) == 0 &&
+        handoffWait(chan, HANDOFF_WAIT) == 0);
+  close(chan);
+  free(socks);
+
+  if (!ok) {
+    printf("The new server failed to start; carrying on.\n");
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return -1;
+  }
+
+  printf("Handed over to process %d; finishing up.\n", (int)child);
+  HANDEDOFF = 1;
+  drainUntil = time(NULL) + DRAIN_TIMEOUT;
+  LOOP = 0;
+
+  return 0;
+}
+
+/*
+ * Responsible for catching a CTRL+C action and cleaning up gracefully.
+ */
+static void catchInterrupt(int signum) {
   #ifdef DEBUG
     if (LOOP) {
       printf("SIGINT caught, terminating loop...\n");
@@ -492,72 +2558,103 @@ static void catchInterrupt(int signum) {
 
   /* to prevent someone from hitting CTRL + C multiple times... */
   if (!LOOP) {
+    if (drainUntil) { /* replaced; stop waiting on the clients */
+      drainUntil = 0;
+      return;
+    }
     printf("SIGINT already caught - kill process manually if it is hanging.\n");
     return;
   }
 
-  /* cannot protect the whole operation with a loop,
-   * otherwise we risk deadlock.  This will take longer,
-   * but the list will be protected only when we add
-   * a new termination node
-   */
-  LOOP = 0; /* this will kill the loop in main() */
-  for (i = 0; i < numThreads; i++) {
-    /* add a termination node for every active thread */
-    pthread_mutex_lock(&mConList);
-    addTail(0, TERMINATE, list);
-    pthread_cond_broadcast(&free_conn);
-    pthread_mutex_unlock(&mConList);
-  }
+  /* this will kill the loop in main(), along with the acceptors and
+   * event loops; the workers are told to finish once they're gone, so
+   * nothing can be handed to a worker that has already left */
+  LOOP = 0;
 
   #ifdef DEBUG
-    printf("All termination tokens added.  Waiting for exit...\n");
+    printf("Loop terminated.  Waiting for exit...\n");
   #endif
 
   /* let execution continue normally */
 }
 
+/*
+ * Catches SIGUSR2, asking for the server to hand over to a new build.
+ * The handoff itself happens back in main(), where it's safe to do.
+ */
+static void catchUpgrade(int signum) {
+  UPGRADE = 1;
+}
+
+/*
+ * Catches SIGUSR1, asking for statistics to be printed.  The printing
+ * itself happens back in main(), where it's safe to do.
+ */
+static void catchStats(int signum) {
+  STATS = 1;
+}
+
+/*
+ * Prints the server's running statistics.
+ */
+static void printStats(void) {
+  char name[32];
+  int i;
+
+  for (i = 0; shards && i < numShards; i++) { /* gone at shutdown */
+    snprintf(name, sizeof(name), "shard %d", i);
+    printPoolStats(shards[i].pool, name);
+  }
+  printCacheStats(fileCache);
+  if (compressPool) {
+    printCompressStats(compressPool);
+  }
+  printf("Refused: %ld connections with the queue full\n", refused);
+  printf("Timeouts: %ld reading headers, %ld writing responses, %ld idle\n",
+         timeouts[DEADLINE_HEADER], timeouts[DEADLINE_WRITE],
+         timeouts[DEADLINE_IDLE]);
+  #ifdef DEBUG
+    printf("Sends: %ld syscalls for %ld responses (%.2f per response)\n",
+           sendSyscalls, sendResponses,
+           (sendResponses ? (double)sendSyscalls / sendResponses : 0.0));
+  #endif
+  fflush(stdout);
+}
+
 /* This helper function simply shortens the amount of code in main()
  * by performing global variable initializations here instead.
  */
 static void initializeGlobals(void) {
-  
-  /* initialize the mutex */
-  if (pthread_mutex_init(&mConList, NULL) != 0) { 
-    printf("Error initializing mutex.  Exiting...\n");
-    exit(MUTEX_FAILURE);
+  int i;
+
+  /* allocate the shards */
+  if (!(shards = calloc(numShards, sizeof(shard)))) {
+    printf("Error allocating memory for shards.  Exiting...\n");
+    exit(MEMALLOC_FAILURE);
   }
 
-  /* initialize condition variable */
-  if (pthread_cond_init(&free_conn, NULL) != 0) {
-    printf("Error initializing condition variable.  Exiting...\n");
-    exit(MUTEX_FAILURE);
+  for (i = 0; i < numShards; i++) {
+    /* set up the connection queue */
+    if (!(shards[i].ring = newConRing(queueSize))) {
+      printf("Error allocating memory for connection queue.  Exiting...\n");
+      exit(MEMALLOC_FAILURE);
+    }
   }
 
-  /* allocate the worker pool */
-  if (!(workers = malloc(sizeof(pthread_t) * numThreads))) {
-    printf("Error allocating memory for thread pool.  Exiting...\n");
+  /* allocate the event loops */
+  if (numLoops && !(loops = calloc(numLoops, sizeof(eventloop)))) {
+    printf("Error allocating memory for event loops.  Exiting...\n");
     exit(MEMALLOC_FAILURE);
   }
+  loopsUp = 0;
+  pthread_mutex_init(&loopsMutex, NULL);
+  pthread_cond_init(&loopsCond, NULL);
 
   /* set up the thread attribute */
   pthread_attr_init(&scope);
   pthread_attr_setscope(&scope, PTHREAD_SCOPE_SYSTEM);
   pthread_attr_setdetachstate(&scope, PTHREAD_CREATE_JOINABLE);
 
-  /* set up connections list */
-  list = newConList();
-  if (!list) {
-    printf("Error allocating memory for connections list.  Exiting...\n");
-    exit(MEMALLOC_FAILURE);
-  }
-
-  /* set up the server socket */
-  if ((serverSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-    printf("Error opening socket for listening.  Exiting...\n");
-    exit(SOCKET_FAILURE);
-  }
-
   /* set up the shared memory */
   if (OPTIMIZED) {
     int nodes = numThreads;
@@ -596,39 +2693,60 @@ static void initializeGlobals(void) {
  * up everything the server utilized.
  */
 static void cleanUpGlobals(void) {
-  int i;
+  int i, j;
   void* status;
   
-  /* free up threads first, in case the mutex is locked */
-  for (i = 0; i < numThreads; i++) {
-    int retval = pthread_join(workers[i], &status);
-    if (retval) { /* doh */
-      printf("Error joining thread %d. Code: %d\n", i, retval);
+  /* the acceptors and event loops notice LOOP on their own; they go
+   * first, since an acceptor may still be handing its workers a client */
+  for (i = 0; numShards > 1 && i < numShards; i++) {
+    int retval = pthread_join(shards[i].acceptor, &status);
+    if (retval) {
+      printf("Error joining acceptor %d. Code: %d\n", i, retval);
+    }
+  }
+  for (i = 0; i < numLoops; i++) {
+    int retval = pthread_join(loops[i].thread, &status);
+    if (retval) {
+      printf("Error joining event loop %d. Code: %d\n", i, retval);
     }
+    if (loops[i].epfd >= 0) {
+      close(loops[i].epfd);
+    }
+  }
+  free(loops);
+  pthread_mutex_destroy(&loopsMutex);
+  pthread_cond_destroy(&loopsCond);
+
+  /* then the workers; one termination node per shard, which each
+   * worker passes along once it has finished what it was given */
+  for (j = 0; j < numShards; j++) {
+    stopWorkerPool(shards[j].pool);
+  }
+  for (j = 0; j < numShards; j++) {
+    destroyWorkerPool(shards[j].pool);
 
     #ifdef DEBUG
-      printf("Thread %d joined! Status: %ld\n", i, (long)status);
+      printf("Shard %d's workers are done!\n", j);
     #endif
   }
+  destroyWatchdog(reaper);
 
-  /* destroy mutex, condition variable, and attribute struct */
-  if (pthread_mutex_destroy(&mConList) != 0) {
-    printf("Error destroying connection mutex!\n");
-  }
-  #ifdef DEBUG
-    else {
-    printf("Connection mutex successfully destroyed.\n");
-  }
-  #endif
- 
-  if (pthread_cond_destroy(&free_conn) != 0) {
-    printf("Error destroying connection condition variable!\n");
-  }
-  #ifdef DEBUG
-    else {
-    printf("Connection condition variable successfully destroyed.\n");
+  for (j = 0; j < numShards; j++) {
+    shard* s = &shards[j];
+
+    /* destroy the connection queue */
+    /* NOTE: No need to systematically close each socket connection;
+     * as each thread exited, they should have closed their own sockets
+     */
+    destroyConRing(s->ring);
+
+    /* close the socket! */
+    if (close(s->sock) < 0) {
+      printf("Error closing server socket!\n");
+    }
   }
-  #endif
+  free(shards);
+  shards = NULL;
  
   if (pthread_attr_destroy(&scope) != 0) {
     printf("Error destroying thread attributes!\n");
@@ -639,23 +2757,17 @@ static void cleanUpGlobals(void) {
   }
   #endif
 
-  /* destroy the connections list */
-  /* NOTE: No need to systematically close each socket connection;
-   * as each thread exited, they should have closed their own sockets
-   */
-  destroyAll(list);
-  free(list);
-
-  /* destroy the list of workers */
-  free(workers);
-
-  /* close the socket! */
-  if (close(serverSock) < 0) {
-    printf("Error closing server socket!\n");
+  /* nobody is holding a file anymore, so close them all */
+  #ifdef DEBUG
+    printStats();
+  #endif
+  if (compressPool) {
+    destroyCompressPool(compressPool);
   }
+  destroyFileCache(fileCache);
 
-  /* shared memory? */
-  if (OPTIMIZED) {
+  /* shared memory?  if we were replaced, the new server has it now */
+  if (OPTIMIZED && !HANDEDOFF) {
     if (destroyMemList(shList, shMeta->numNodes) < 0) {
       printf("Failure destroying shared memory list!\n");
     }
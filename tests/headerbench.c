@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../headers/httpParser.h"
+#include "../functions/getHeaderField.c"
+
+/* Microbenchmark: looks up the fields the proxy needs (Host,
+ * Content-Type, and Content-Length) in a typical request header, first
+ * with getHeaderField(), then by indexing the header once and looking
+ * each field up in the index, with every scanner this processor has.
+ *
+ * Usage: ./headerbench [iterations]
+ */
+
+char* request =
+  "GET http://www.example.com:8080/images/photo.jpg HTTP/1.1\r\n"
+  "Host: www.example.com:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Referer: http://www.example.com:8080/gallery/index.html\r\n"
+  "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Content-Type: image/jpeg\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+
+char* fields[] = { "Host", "Content-Type", "Content-Length" };
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Prints the rate of one way of doing the lookups. */
+static void report(char* name, long int iterations, double elapsed,
+                   long int checksum) {
+  printf("%-14s: %ld headers in %.3f s (%.0f ns per header) [%ld]\n",
+         name, iterations, elapsed, elapsed * 1e9 / iterations, checksum);
+}
+
+int main(int argc, char** argv) {
+  long int iterations = (argc > 1 ? atol(argv[1]) : 1000000);
+  long int len = strlen(request), i, checksum;
+  char* names[] = { "scalar", "sse2", "avx2" };
+  headerindex index;
+  httpfield* field;
+  double start;
+  int f, level;
+
+  printf("%ld byte header, %ld iterations\n", len, iterations);
+
+  /* the old way: a copy and a search per field */
+  checksum = 0;
+  start = now();
+  for (i = 0; i < iterations; i++) {
+    for (f = 0; f < 3; f++) {
+      char* value = getHeaderField(request, len, fields[f]);
+      if (value) {
+        checksum += strlen(value);
+        free(value);
+      }
+    }
+  }
+  report("getHeaderField", iterations, now() - start, checksum);
+
+  /* the new way: one pass, then walks over the index */
+  for (level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+    if (headerScanner(level) != level) {
+      printf("%-14s: not supported here\n", names[level]);
+      continue;
+    }
+    checksum = 0;
+    start = now();
+    for (i = 0; i < iterations; i++) {
+      indexHeader(request, len, &index);
+      for (f = 0; f < 3; f++) {
+        if ((field = indexFind(&index, fields[f]))) {
+          checksum += field->value.len;
+        }
+      }
+    }
+    report(names[level], iterations, now() - start, checksum);
+  }
+
+  return 0;
+}
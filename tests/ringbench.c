@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include "../headers/conList.h"
+#include "../headers/conRing.h"
+
+/* Microbenchmark: hands "connections" from producer threads to consumer
+ * threads, first through the old mutex + condition variable conlist,
+ * then through the lock-free conring, and reports the rate of each.
+ *
+ * Usage: ./ringbench [producers] [consumers] [items per producer]
+ */
+
+int producers, consumers;
+long int items;
+
+/* the conlist side */
+conlist* list;
+pthread_mutex_t mConList;
+pthread_cond_t free_conn;
+
+/* the conring side */
+conring* ring;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* listProducer(void* args) {
+  long int i;
+
+  for (i = 0; i < items; i++) {
+    pthread_mutex_lock(&mConList);
+    addTail((int)i, PROCESS, list);
+    pthread_cond_broadcast(&free_conn);
+    pthread_mutex_unlock(&mConList);
+  }
+  return NULL;
+}
+
+static void* listConsumer(void* args) {
+  connection* c;
+  long int handled = 0;
+
+  while (1) {
+    pthread_mutex_lock(&mConList);
+    while (isEmpty(list)) {
+      pthread_cond_wait(&free_conn, &mConList);
+    }
+    c = removeHead(list);
+    pthread_mutex_unlock(&mConList);
+
+    if (c->action == TERMINATE) {
+      free(c);
+      return (void*)handled;
+    }
+    handled++;
+    free(c);
+  }
+}
+
+static void* ringProducer(void* args) {
+  long int i;
+
+  for (i = 0; i < items; i++) {
+    while (ringPush(ring, (int)i, PROCESS) < 0) {
+      sched_yield(); /* full; let the consumers catch up */
+    }
+  }
+  return NULL;
+}
+
+static void* ringConsumer(void* args) {
+  long int handled = 0;
+  instruction action;
+  int conn;
+
+  while (1) {
+    ringPop(ring, &conn, &action);
+    if (action == TERMINATE) {
+      return (void*)handled;
+    }
+    handled++;
+  }
+}
+
+/* Runs one side of the benchmark and prints its rate. */
+static void run(char* name, void* (*producer)(void*), void* (*consumer)(void*),
+                void (*terminate)(void)) {
+  pthread_t* p = malloc(sizeof(pthread_t) * producers);
+  pthread_t* c = malloc(sizeof(pthread_t) * consumers);
+  long int total = 0;
+  void* handled;
+  double start, elapsed;
+  int i;
+
+  start = now();
+  for (i = 0; i < consumers; i++) {
+    pthread_create(&c[i], NULL, consumer, NULL);
+  }
+  for (i = 0; i < producers; i++) {
+    pthread_create(&p[i], NULL, producer, NULL);
+  }
+  for (i = 0; i < producers; i++) {
+    pthread_join(p[i], NULL);
+  }
+  for (i = 0; i < consumers; i++) {
+    terminate();
+  }
+  for (i = 0; i < consumers; i++) {
+    pthread_join(c[i], &handled);
+    total += (long int)handled;
+  }
+  elapsed = now() - start;
+
+  printf("%-8s: %ld handoffs in %.3f s (%.0f per second)\n",
+         name, total, elapsed, total / elapsed);
+  free(p);
+  free(c);
+}
+
+static void listTerminate(void) {
+  pthread_mutex_lock(&mConList);
+  addTail(0, TERMINATE, list);
+  pthread_cond_broadcast(&free_conn);
+  pthread_mutex_unlock(&mConList);
+}
+
+static void ringTerminate(void) {
+  while (ringPush(ring, 0, TERMINATE) < 0) {
+    sched_yield();
+  }
+}
+
+int main(int argc, char** argv) {
+  producers = (argc > 1 ? atoi(argv[1]) : 2);
+  consumers = (argc > 2 ? atoi(argv[2]) : 8);
+  items     = (argc > 3 ? atol(argv[3]) : 1000000);
+
+  printf("%d producers, %d consumers, %ld items each\n",
+         producers, consumers, items);
+
+  list = newConList();
+  pthread_mutex_init(&mConList, NULL);
+  pthread_cond_init(&free_conn, NULL);
+  run("conlist", listProducer, listConsumer, listTerminate);
+
+  ring = newConRing(CONRING_SIZE);
+  run("conring", ringProducer, ringConsumer, ringTerminate);
+
+  destroyConRing(ring);
+  free(list);
+  return 0;
+}